@@ -6,10 +6,452 @@
 #include <string>
 #include <direct.h>
 #include <memory>
+#include <algorithm>
+#include <cstdlib>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
 #pragma comment(lib, "ws2_32.lib")
 
+// Transfer compression: gzip with FTP_WITH_ZLIB (link zlib), zstd with FTP_WITH_ZSTD (link libzstd).
+#if defined(FTP_WITH_ZLIB) && __has_include(<zlib.h>)
+#include <zlib.h>
+#define FTP_HAVE_ZLIB 1
+#endif
+#if defined(FTP_WITH_ZSTD) && __has_include(<zstd.h>)
+#include <zstd.h>
+#define FTP_HAVE_ZSTD 1
+#endif
+
 using namespace std;
 
+// Framed command protocol (v2), mirroring the server: after the "FTP2" preamble every message
+// is a 1-byte type, 16-bit status and 64-bit payload length (big-endian) plus the payload.
+// A DATA frame with status ENCODED carries part of a compressed stream (see ENCODING).
+struct Frame {
+    enum Type { REQUEST = 1, RESPONSE = 2, DATA = 3, END = 4 };
+    static const int HEADER_SIZE = 11;
+    static const int ENCODED = 1;
+
+    int type;
+    int status;
+    unsigned long long length;
+};
+
+// SHA-256 (FIPS 180-4); the server names deduplicated chunks by it.
+class Sha256 {
+private:
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t used;
+    unsigned long long totalBytes;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const unsigned char* p) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+public:
+    Sha256() : state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 },
+               used(0), totalBytes(0) {}
+
+    void update(const char* data, size_t len) {
+        const unsigned char* p = (const unsigned char*)data;
+        totalBytes += len;
+        if (used > 0) {
+            size_t take = min(len, sizeof(block) - used);
+            memcpy(block + used, p, take);
+            used += take;
+            p += take;
+            len -= take;
+            if (used < sizeof(block)) return;
+            compress(block);
+            used = 0;
+        }
+        for (; len >= sizeof(block); p += sizeof(block), len -= sizeof(block)) compress(p);
+        memcpy(block, p, len);
+        used = len;
+    }
+
+    // Lowercase hex digest. Finishes the hash; the object is spent afterwards.
+    string hex() {
+        unsigned long long bits = totalBytes * 8;
+        static const char padding[64] = { (char)0x80 };
+        update(padding, used < 56 ? 56 - used : 120 - used);
+        char length[8];
+        for (int i = 0; i < 8; ++i) length[i] = (char)(bits >> (56 - 8 * i));
+        update(length, sizeof(length));
+
+        char out[65];
+        for (int i = 0; i < 8; ++i) snprintf(out + 8 * i, 9, "%08x", state[i]);
+        return string(out, 64);
+    }
+
+    static string of(const char* data, size_t len) {
+        Sha256 hash;
+        hash.update(data, len);
+        return hash.hex();
+    }
+};
+
+// Content-defined chunk boundaries, identical to the server's ContentChunker: both sides must
+// cut a file the same way for a dedup upload to find its chunks already stored.
+struct ContentChunker {
+    static constexpr size_t MIN_SIZE = 16 * 1024;
+    static constexpr size_t AVG_SIZE = 64 * 1024;
+    static constexpr size_t MAX_SIZE = 256 * 1024;
+
+    // Length of the chunk starting at data, given len bytes available. A result equal to
+    // len is only a real boundary at end of file or once len reaches MAX_SIZE.
+    static size_t cut(const unsigned char* data, size_t len) {
+        static const uint64_t MASK_SMALL = 0xffff800000000000ULL;   // 17 bits: cuts are rare below AVG_SIZE
+        static const uint64_t MASK_LARGE = 0xfffe000000000000ULL;   // 15 bits: and common above it
+        if (len <= MIN_SIZE) return len;
+        size_t limit = min(len, MAX_SIZE);
+        size_t normal = min(limit, AVG_SIZE);
+        const uint64_t* table = gear();
+        uint64_t hash = 0;
+        size_t i = MIN_SIZE;
+        for (; i < normal; ++i) {
+            hash = (hash << 1) + table[data[i]];
+            if (!(hash & MASK_SMALL)) return i + 1;
+        }
+        for (; i < limit; ++i) {
+            hash = (hash << 1) + table[data[i]];
+            if (!(hash & MASK_LARGE)) return i + 1;
+        }
+        return limit;
+    }
+
+private:
+    // Fixed pseudo-random values per byte (splitmix64 from a constant seed). Changing them
+    // changes every boundary, so they must stay as they are.
+    static const uint64_t* gear() {
+        static const vector<uint64_t> table = [] {
+            vector<uint64_t> values(256);
+            uint64_t x = 0x4654504445445550ULL;
+            for (uint64_t& value : values) {
+                uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                value = z ^ (z >> 31);
+            }
+            return values;
+        }();
+        return table.data();
+    }
+};
+
+// Streaming gzip/zstd for session transfers, the counterpart of the server's Compression.
+// The client compresses at each codec's default level; only the server adapts levels to load.
+class Compression {
+public:
+    enum Codec { NONE = 0, GZIP = 1, ZSTD = 2 };
+
+    static Codec fromName(const string& name) {
+        if (name == "gzip" && available(GZIP)) return GZIP;
+        if (name == "zstd" && available(ZSTD)) return ZSTD;
+        return NONE;
+    }
+
+    static bool available(Codec codec) {
+#ifdef FTP_HAVE_ZLIB
+        if (codec == GZIP) return true;
+#endif
+#ifdef FTP_HAVE_ZSTD
+        if (codec == ZSTD) return true;
+#endif
+#if !defined(FTP_HAVE_ZLIB) && !defined(FTP_HAVE_ZSTD)
+        (void)codec;
+#endif
+        return false;
+    }
+
+    // The codec list offered to the server, most preferred first; empty without any codec.
+    static string offer() {
+        string list;
+        if (available(ZSTD)) list = "zstd";
+        if (available(GZIP)) list += list.empty() ? "gzip" : ",gzip";
+        return list;
+    }
+
+    // Whether a file looks worth compressing: the byte entropy of samples from its start,
+    // middle and end stays below 7.5 bits. Media and archives come out near 8.
+    static bool worthCompressing(const string& path, long long size) {
+        const int SAMPLE = 64 * 1024;
+        if (size < 1024) return false;
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) return false;
+        long long counts[256] = {};
+        long long total = 0;
+        vector<char> sample(SAMPLE);
+        long long starts[3] = { 0, size / 2 - SAMPLE / 2, size - SAMPLE };
+        long long covered = 0;
+        for (long long start : starts) {
+            start = max(start, covered);
+            if (start >= size) continue;
+            in.seekg(start);
+            in.read(sample.data(), (streamsize)min((long long)SAMPLE, size - start));
+            streamsize got = in.gcount();
+            if (got <= 0) return false;
+            for (streamsize i = 0; i < got; ++i) counts[(unsigned char)sample[i]]++;
+            total += got;
+            covered = start + got;
+        }
+
+        double bits = 0;
+        for (long long count : counts) {
+            if (count > 0) bits -= (double)count / total * log2((double)count / total);
+        }
+        return bits < 7.5;
+    }
+
+    class Encoder {
+    private:
+        static const size_t SLICE = 64 * 1024;
+
+        Codec codec;
+#ifdef FTP_HAVE_ZLIB
+        z_stream zs;
+#endif
+#ifdef FTP_HAVE_ZSTD
+        ZSTD_CCtx* cctx;
+#endif
+
+    public:
+        Encoder() : codec(NONE) {
+#ifdef FTP_HAVE_ZLIB
+            zs = z_stream();
+#endif
+#ifdef FTP_HAVE_ZSTD
+            cctx = nullptr;
+#endif
+        }
+        Encoder(const Encoder&) = delete;
+        Encoder& operator=(const Encoder&) = delete;
+
+        ~Encoder() {
+#ifdef FTP_HAVE_ZLIB
+            if (codec == GZIP) deflateEnd(&zs);
+#endif
+#ifdef FTP_HAVE_ZSTD
+            if (cctx) ZSTD_freeCCtx(cctx);
+#endif
+        }
+
+        bool begin(Codec c) {
+#ifdef FTP_HAVE_ZLIB
+            if (c == GZIP) {
+                if (deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+                codec = c;
+                return true;
+            }
+#endif
+#ifdef FTP_HAVE_ZSTD
+            if (c == ZSTD) {
+                cctx = ZSTD_createCCtx();
+                if (!cctx || ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 3))) return false;
+                codec = c;
+                return true;
+            }
+#endif
+#if !defined(FTP_HAVE_ZLIB) && !defined(FTP_HAVE_ZSTD)
+            (void)c;
+#endif
+            return false;
+        }
+
+        // Appends the compressed form of len bytes to out; last ends the stream.
+        bool update(const char* data, size_t len, bool last, string& out) {
+#ifdef FTP_HAVE_ZLIB
+            if (codec == GZIP) {
+                zs.next_in = (Bytef*)data;
+                zs.avail_in = (uInt)len;
+                while (true) {
+                    size_t old = out.size();
+                    out.resize(old + SLICE);
+                    zs.next_out = (Bytef*)&out[old];
+                    zs.avail_out = (uInt)SLICE;
+                    int rc = deflate(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+                    out.resize(old + SLICE - zs.avail_out);
+                    if (rc == Z_STREAM_ERROR) return false;
+                    if (last ? rc == Z_STREAM_END : zs.avail_in == 0 && zs.avail_out != 0) return true;
+                }
+            }
+#endif
+#ifdef FTP_HAVE_ZSTD
+            if (codec == ZSTD) {
+                ZSTD_inBuffer in = { data, len, 0 };
+                ZSTD_EndDirective mode = last ? ZSTD_e_end : ZSTD_e_continue;
+                while (true) {
+                    size_t old = out.size();
+                    out.resize(old + ZSTD_CStreamOutSize());
+                    ZSTD_outBuffer buffer = { &out[old], ZSTD_CStreamOutSize(), 0 };
+                    size_t remaining = ZSTD_compressStream2(cctx, &buffer, &in, mode);
+                    out.resize(old + buffer.pos);
+                    if (ZSTD_isError(remaining)) return false;
+                    if (last ? remaining == 0 : in.pos == in.size) return true;
+                }
+            }
+#endif
+            (void)data;
+            (void)len;
+            (void)last;
+            (void)out;
+            return false;
+        }
+    };
+
+    class Decoder {
+    private:
+        Codec codec;
+        bool ended;         // a complete stream has been read
+        vector<char> buffer;
+#ifdef FTP_HAVE_ZLIB
+        z_stream zs;
+#endif
+#ifdef FTP_HAVE_ZSTD
+        ZSTD_DCtx* dctx;
+#endif
+
+    public:
+        typedef function<bool(const char*, size_t)> Sink;
+
+        Decoder() : codec(NONE), ended(false) {
+#ifdef FTP_HAVE_ZLIB
+            zs = z_stream();
+#endif
+#ifdef FTP_HAVE_ZSTD
+            dctx = nullptr;
+#endif
+        }
+        Decoder(const Decoder&) = delete;
+        Decoder& operator=(const Decoder&) = delete;
+
+        ~Decoder() {
+#ifdef FTP_HAVE_ZLIB
+            if (codec == GZIP) inflateEnd(&zs);
+#endif
+#ifdef FTP_HAVE_ZSTD
+            if (dctx) ZSTD_freeDCtx(dctx);
+#endif
+        }
+
+        bool begin(Codec c) {
+            buffer.resize(64 * 1024);
+#ifdef FTP_HAVE_ZLIB
+            if (c == GZIP) {
+                if (inflateInit2(&zs, 15 + 16) != Z_OK) return false;
+                codec = c;
+                return true;
+            }
+#endif
+#ifdef FTP_HAVE_ZSTD
+            if (c == ZSTD) {
+                dctx = ZSTD_createDCtx();
+                if (!dctx) return false;
+                codec = c;
+                return true;
+            }
+#endif
+#if !defined(FTP_HAVE_ZLIB) && !defined(FTP_HAVE_ZSTD)
+            (void)c;
+#endif
+            return false;
+        }
+
+        bool finished() const { return ended; }
+
+        // Decompresses len bytes into sink; false on corrupt input or data past the end.
+        bool update(const char* data, size_t len, const Sink& sink) {
+#ifdef FTP_HAVE_ZLIB
+            if (codec == GZIP) {
+                zs.next_in = (Bytef*)data;
+                zs.avail_in = (uInt)len;
+                bool more = len > 0;
+                while (more) {
+                    if (ended) return false;
+                    zs.next_out = (Bytef*)buffer.data();
+                    zs.avail_out = (uInt)buffer.size();
+                    int rc = inflate(&zs, Z_NO_FLUSH);
+                    if (rc == Z_BUF_ERROR && zs.avail_in == 0) break;
+                    if (rc != Z_OK && rc != Z_STREAM_END) return false;
+                    size_t produced = buffer.size() - zs.avail_out;
+                    if (produced > 0 && !sink(buffer.data(), produced)) return false;
+                    ended = rc == Z_STREAM_END;
+                    more = zs.avail_in > 0 || (!ended && zs.avail_out == 0);
+                }
+                return true;
+            }
+#endif
+#ifdef FTP_HAVE_ZSTD
+            if (codec == ZSTD) {
+                ZSTD_inBuffer in = { data, len, 0 };
+                bool more = len > 0;
+                while (more) {
+                    ZSTD_outBuffer out = { buffer.data(), buffer.size(), 0 };
+                    size_t hint = ZSTD_decompressStream(dctx, &out, &in);
+                    if (ZSTD_isError(hint)) return false;
+                    if (out.pos > 0 && !sink(buffer.data(), out.pos)) return false;
+                    ended = hint == 0;
+                    more = in.pos < in.size || out.pos == out.size;
+                }
+                return true;
+            }
+#endif
+            (void)data;
+            (void)len;
+            (void)sink;
+            return false;
+        }
+    };
+};
+
 class NetworkClient {
 private:
     string serverHost;
@@ -36,12 +478,18 @@ public:
         return true;
     }
     
-    SOCKET connectToServer() const {
+    // socketBuffer, when non-zero, sizes the kernel send and receive buffers; it has to be set
+    // before connecting for the TCP window to grow that far.
+    SOCKET connectToServer(int socketBuffer = 0) const {
         SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
         if (sock == INVALID_SOCKET) {
             cout << "Socket creation failed. Error: " << WSAGetLastError() << endl;
             return INVALID_SOCKET;
         }
+        if (socketBuffer > 0) {
+            setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&socketBuffer, sizeof(socketBuffer));
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&socketBuffer, sizeof(socketBuffer));
+        }
 
         sockaddr_in serverAddr;
         serverAddr.sin_family = AF_INET;
@@ -57,32 +505,87 @@ public:
         return sock;
     }
     
-    bool authenticate(SOCKET sock) {
+    // Opens a v2 command session on sock. A saved token is offered first; credentials are only
+    // prompted for when there is none or the server no longer accepts it. On success token
+    // holds the token to resume with next time.
+    bool openSession(SOCKET sock, string& token) {
+        if (sendAll(sock, "FTP2", 4) == SOCKET_ERROR) return false;
+
+        int status = 0;
+        string reply;
+        if (!token.empty()) {
+            string resume = "RESUME " + token;
+            if (!sendFrame(sock, Frame::REQUEST, 0, resume.c_str(), resume.size())) return false;
+            if (!recvResponse(sock, status, reply)) return false;
+            if (status == 200) return true;
+            // The server closes the connection after a refused token.
+            token.clear();
+            return false;
+        }
+
         string username, password;
         cout << "Enter username: ";
         cin >> username;
         cout << "Enter password: ";
         cin >> password;
-        
-        string credentials = username + " " + password;
-        send(sock, credentials.c_str(), credentials.size(), 0);
-        char buf[1024];
-        int r = recv(sock, buf, sizeof(buf)-1, 0);
-        if (r <= 0) return false;
-        buf[r] = '\0';
-        return string(buf).find("AUTH OK") != string::npos;
-    }
-
-    static int sendAll(SOCKET sock, const char* data, int len) {
-        int total = 0;
+
+        string login = "SESSION " + username + " " + password;
+        if (!sendFrame(sock, Frame::REQUEST, 0, login.c_str(), login.size())) return false;
+        if (!recvResponse(sock, status, reply) || status != 200) return false;
+        token = reply;
+        return true;
+    }
+
+    // Lengths are 64-bit; each send()/recv() call is capped to what an int can describe.
+    static long long sendAll(SOCKET sock, const char* data, long long len) {
+        long long total = 0;
         while (total < len) {
-            int s = send(sock, data + total, len - total, 0);
+            int s = send(sock, data + total, (int)min(len - total, (long long)INT_MAX), 0);
             if (s == SOCKET_ERROR) return SOCKET_ERROR;
             total += s;
         }
         return total;
     }
 
+    static bool recvExact(SOCKET sock, char* data, long long len) {
+        long long total = 0;
+        while (total < len) {
+            int r = recv(sock, data + total, (int)min(len - total, (long long)INT_MAX), 0);
+            if (r <= 0) return false;
+            total += r;
+        }
+        return true;
+    }
+
+    static bool sendFrame(SOCKET sock, Frame::Type type, int status, const char* payload, unsigned long long length) {
+        char header[Frame::HEADER_SIZE];
+        header[0] = (char)type;
+        header[1] = (char)((status >> 8) & 0xff);
+        header[2] = (char)(status & 0xff);
+        for (int i = 0; i < 8; ++i) header[3 + i] = (char)((length >> (56 - 8 * i)) & 0xff);
+        if (sendAll(sock, header, Frame::HEADER_SIZE) == SOCKET_ERROR) return false;
+        return length == 0 || sendAll(sock, payload, (long long)length) != SOCKET_ERROR;
+    }
+
+    static bool recvFrameHeader(SOCKET sock, Frame& frame) {
+        unsigned char header[Frame::HEADER_SIZE];
+        if (!recvExact(sock, (char*)header, Frame::HEADER_SIZE)) return false;
+        frame.type = header[0];
+        frame.status = (header[1] << 8) | header[2];
+        frame.length = 0;
+        for (int i = 0; i < 8; ++i) frame.length = (frame.length << 8) | header[3 + i];
+        return true;
+    }
+
+    // Reads a RESPONSE frame; its payload is always a short message.
+    static bool recvResponse(SOCKET sock, int& status, string& text) {
+        Frame frame;
+        if (!recvFrameHeader(sock, frame) || frame.type != Frame::RESPONSE || frame.length > 64 * 1024 * 1024) return false;
+        status = frame.status;
+        text.assign((size_t)frame.length, '\0');
+        return frame.length == 0 || recvExact(sock, &text[0], (long long)frame.length);
+    }
+
     string getServerHost() const { return serverHost; }
     int getServerPort() const { return serverPort; }
     bool isInitialized() const { return initialized; }
@@ -107,92 +610,149 @@ public:
     }
 
     string getDownloadFolder() const { return downloadFolder; }
+
+    // The last component of a local path: the name a file is stored under on the server,
+    // which keeps uploads directly in its uploads folder.
+    static string baseName(const string& path) {
+        size_t slash = path.find_last_of("/\\");
+        return slash == string::npos ? path : path.substr(slash + 1);
+    }
 };
 
 class FTPClient {
 private:
     NetworkClient networkClient;
     FileSystem fileSystem;
+    // One authenticated connection carries every command; its token lets a dropped
+    // connection be re-established without asking for credentials again.
+    SOCKET sessionSock;
+    string sessionToken;
+    // Connections a large file is spread over; 1 keeps every transfer on the session itself.
+    int streams;
+    // Send uploads as a manifest plus only the chunks the server lacks.
+    bool dedup;
+    // Codec the session agreed on with ENCODING for plain uploads and downloads.
+    Compression::Codec encoding;
+
+    static constexpr long long PARALLEL_THRESHOLD = 16LL * 1024 * 1024;
+    static constexpr long long RANGE_BYTES = 32LL * 1024 * 1024;
+    static constexpr int STREAM_BUFFER = 1024 * 1024;
+    static constexpr int STREAM_SOCKET_BUFFER = 4 * 1024 * 1024;
+    static constexpr long long DELTA_THRESHOLD = 64 * 1024;
+    static constexpr long long DELTA_LIMIT = 64LL * 1024 * 1024;
+    static constexpr int DELTA_BUFFER = 1024 * 1024;
 
 public:
-    FTPClient(const string& host = "127.0.0.1", int port = 8080) 
-        : networkClient(host, port), fileSystem() {}
+    FTPClient(const string& host = "127.0.0.1", int port = 8080)
+        : networkClient(host, port), fileSystem(), sessionSock(INVALID_SOCKET), streams(1), dedup(false),
+          encoding(Compression::NONE) {}
+
+    ~FTPClient() {
+        if (sessionSock != INVALID_SOCKET) {
+            NetworkClient::sendFrame(sessionSock, Frame::REQUEST, 0, "QUIT", 4);
+            closeSession();
+        }
+    }
 
     bool initialize() {
         return networkClient.initialize();
     }
 
-    bool uploadFile(const string& filename) {
-        SOCKET sock = networkClient.connectToServer();
-        if (sock == INVALID_SOCKET) return false;
-
-        if (!networkClient.authenticate(sock)) {
-            cout << "Authentication failed!\n";
-            closesocket(sock);
-            return false;
-        }
+    void setStreams(int count) { streams = max(1, count); }
+    void setDedup(bool enabled) { dedup = enabled; }
 
+    bool uploadFile(const string& filename) {
         ifstream in(filename, ios::binary | ios::ate);
         if (!in.is_open()) {
             cout << "Cannot open file: " << filename << endl;
-            closesocket(sock);
             return false;
         }
 
-        streamsize size = in.tellg();
+        long long size = (long long)in.tellg();
         in.seekg(0, ios::beg);
+        string serverName = FileSystem::baseName(filename);
 
-        string command = "UPLOAD " + filename;
-        if (NetworkClient::sendAll(sock, command.c_str(), (int)command.size()) == SOCKET_ERROR) {
-            cout << "Error sending command\n";
-            in.close();
-            closesocket(sock);
-            return false;
+        // A file the server already has is patched in place of being sent again.
+        if (size >= DELTA_THRESHOLD) {
+            int status = uploadDelta(filename, serverName, size);
+            if (status == 200) return true;
+            if (status == 0) return false;
+            if (status != 404) cout << "Sending the whole file instead\n";
         }
 
-        char buf[4096];
-        int r = recv(sock, buf, sizeof(buf)-1, 0);
-        if (r <= 0) {
-            cout << "No response from server\n";
+        if (dedup) {
+            int status = uploadDeduplicated(filename, serverName, size);
+            if (status != 501) return status == 200;
+            cout << "Sending the whole file instead\n";
+        }
+
+        if (streams > 1 && size >= PARALLEL_THRESHOLD) {
             in.close();
-            closesocket(sock);
-            return false;
+            return uploadParallel(filename, serverName, size);
         }
 
-        buf[r] = '\0';
-        string resp(buf);
-        if (resp != "READY") {
-            cout << "Server response: " << resp << endl;
+        string command = "UPLOAD " + serverName + " " + to_string(size);
+        if (!sendCommand(command)) {
             in.close();
-            closesocket(sock);
             return false;
         }
 
-        const int CHUNK = 4096;
+        const int CHUNK = 64 * 1024;
         vector<char> buffer(CHUNK);
-        streamsize totalSent = 0;
-        
-        while (in.good()) {
-            in.read(buffer.data(), CHUNK);
+        long long totalSent = 0;
+
+        // Compressed bodies go out as ENCODED frames; the size in the command stays the file's.
+        Compression::Encoder encoder;
+        bool compress = encoding != Compression::NONE && Compression::worthCompressing(filename, size) &&
+                        encoder.begin(encoding);
+        string packed;
+        long long wire = 0;
+        auto sendData = [&](const char* data, size_t len, bool last) {
+            if (!compress) {
+                wire += (long long)len;
+                return NetworkClient::sendFrame(sessionSock, Frame::DATA, 0, data, len);
+            }
+            packed.clear();
+            if (!encoder.update(data, len, last, packed)) return false;
+            wire += (long long)packed.size();
+            return packed.empty() ||
+                   NetworkClient::sendFrame(sessionSock, Frame::DATA, Frame::ENCODED, packed.data(), packed.size());
+        };
+
+        while (totalSent < size && in.good()) {
+            in.read(buffer.data(), (streamsize)min((long long)CHUNK, size - totalSent));
             streamsize got = in.gcount();
             if (got <= 0) break;
-            
-            int s = NetworkClient::sendAll(sock, buffer.data(), (int)got);
-            if (s == SOCKET_ERROR) {
+
+            if (!sendData(buffer.data(), (size_t)got, false)) {
                 cout << "Error sending file bytes\n";
                 in.close();
-                closesocket(sock);
+                closeSession();
                 return false;
             }
-            totalSent += s;
+            totalSent += got;
         }
-        
         in.close();
-        cout << "Sent bytes: " << totalSent << endl;
 
-        waitForServerResponse(sock);
-        closesocket(sock);
-        return true;
+        // END closes the upload either way; a short file is reported back as a size mismatch.
+        if ((compress && !sendData(NULL, 0, true)) || !NetworkClient::sendFrame(sessionSock, Frame::END, 0, NULL, 0)) {
+            cout << "Error sending file bytes\n";
+            closeSession();
+            return false;
+        }
+        cout << "Sent bytes: " << totalSent;
+        if (compress) cout << " (" << wire << " compressed)";
+        cout << endl;
+
+        int status = 0;
+        string reply;
+        if (!NetworkClient::recvResponse(sessionSock, status, reply)) {
+            cout << "No response from server\n";
+            closeSession();
+            return false;
+        }
+        cout << "Server: " << reply << endl;
+        return status == 200;
     }
 
     bool downloadFile() {
@@ -200,97 +760,119 @@ public:
         cout << "Enter server filename to download: ";
         cin >> serverFilename;
 
-        SOCKET sock = networkClient.connectToServer();
-        if (sock == INVALID_SOCKET) return false;
-
-        if (!networkClient.authenticate(sock)) {
-            cout << "Authentication failed!\n";
-            closesocket(sock);
-            return false;
-        }
-
         string local = fileSystem.getDownloadFolder() + serverFilename;
 
         if (fileSystem.fileExists(local)) {
-            char c; 
-            cout << "Overwrite " << local << "? (y/n): "; 
+            char c;
+            cout << "Overwrite " << local << "? (y/n): ";
             cin >> c;
             if (c != 'y' && c != 'Y') {
-                closesocket(sock);
                 return false;
             }
         }
 
+        if (streams > 1) {
+            string info;
+            if (!textCommand("STAT " + serverFilename, info)) {
+                if (!info.empty()) cout << "Server: " << info << endl;
+                return false;
+            }
+            long long size = atoll(info.c_str());
+            string version = info.substr(info.find(' ') + 1);
+            if (size >= PARALLEL_THRESHOLD) return downloadParallel(serverFilename, local, size, version);
+        }
+
         string cmd = "DOWNLOAD " + serverFilename;
-        if (NetworkClient::sendAll(sock, cmd.c_str(), (int)cmd.size()) == SOCKET_ERROR) {
-            cout << "Error sending command\n";
-            closesocket(sock);
+        if (!sendCommand(cmd)) return false;
+
+        ofstream out;
+        char buf[64 * 1024];
+        long long received = 0;
+        long long wire = 0;
+        unique_ptr<Compression::Decoder> decoder;
+        bool corrupt = false;
+        auto store = [&](const char* data, size_t len) {
+            if (out.is_open()) out.write(data, (streamsize)len);
+            received += (long long)len;
+            return true;
+        };
+        while (true) {
+            Frame frame;
+            if (!NetworkClient::recvFrameHeader(sessionSock, frame)) {
+                cout << "Connection lost during download\n";
+                closeSession();
+                return false;
+            }
+
+            if (frame.type == Frame::RESPONSE) {
+                string err((size_t)min(frame.length, (unsigned long long)sizeof(buf)), '\0');
+                if (!err.empty() && !NetworkClient::recvExact(sessionSock, &err[0], (long long)err.size())) closeSession();
+                cout << "Server: " << err << endl;
+                return false;
+            }
+            if (frame.type == Frame::END) break;
+            if (frame.type != Frame::DATA) {
+                cout << "Unexpected frame from server\n";
+                closeSession();
+                return false;
+            }
+
+            if (!out.is_open()) {
+                out.open(local, ios::binary);
+                if (!out.is_open()) cout << "Cannot create local file\n";
+            }
+            bool encoded = frame.status == Frame::ENCODED;
+            if (encoded && !decoder) {
+                decoder.reset(new Compression::Decoder());
+                corrupt = !decoder->begin(encoding);
+            }
+            // Drain the frame even if the local file can't be written, to keep the session in sync.
+            unsigned long long remaining = frame.length;
+            while (remaining > 0) {
+                int want = (int)min((unsigned long long)sizeof(buf), remaining);
+                if (!NetworkClient::recvExact(sessionSock, buf, want)) {
+                    cout << "Connection lost during download\n";
+                    closeSession();
+                    return false;
+                }
+                if (!encoded) store(buf, want);
+                else if (!corrupt) corrupt = !decoder->update(buf, want, store);
+                remaining -= want;
+                wire += want;
+            }
+        }
+        if (decoder && (corrupt || !decoder->finished())) {
+            cout << "Corrupt compressed data from server\n";
             return false;
         }
 
-        ofstream out(local, ios::binary);
         if (!out.is_open()) {
-            cout << "Cannot create local file\n";
-            closesocket(sock);
-            return false;
+            out.open(local, ios::binary);   // empty file
+            if (!out.is_open()) {
+                cout << "Cannot create local file\n";
+                return false;
+            }
         }
-
-        receiveFileData(sock, out);
         out.close();
-        
-        cout << "Downloaded to: " << local << endl;
-        closesocket(sock);
+
+        cout << "Downloaded " << received << " bytes";
+        if (decoder) cout << " (" << wire << " compressed)";
+        cout << " to: " << local << endl;
         return true;
     }
 
     void listServerFiles() {
-        SOCKET sock = networkClient.connectToServer();
-        if (sock == INVALID_SOCKET) return;
-
-        if (!networkClient.authenticate(sock)) {
-            cout << "Authentication failed!\n";
-            closesocket(sock);
-            return;
-        }
-
-        NetworkClient::sendAll(sock, "LIST", 4);
-
-        char buf[4096];
-        string acc;
-        int r;
-        
-        while ((r = recv(sock, buf, sizeof(buf), 0)) > 0) {
-            acc.append(buf, buf + r);
-            if (r < (int)sizeof(buf)) break;
+        string text;
+        if (textCommand("LIST", text)) {
+            cout << text << endl;
         }
-        
-        cout << acc << endl;
-        closesocket(sock);
     }
 
     void listTrashFiles() {
-        SOCKET sock = networkClient.connectToServer();
-        if (sock == INVALID_SOCKET) return;
-
-        if (!networkClient.authenticate(sock)) {
-            cout << "Authentication failed!\n";
-            closesocket(sock);
-            return;
-        }
-
-        NetworkClient::sendAll(sock, "LIST_TRASH", 10);
-        
-        char buf[4096];
-        string acc;
-        int r;
-        
-        while ((r = recv(sock, buf, sizeof(buf), 0)) > 0) {
-            acc.append(buf, buf + r);
-            if (r < (int)sizeof(buf)) break;
+        string text;
+        if (textCommand("LIST_TRASH", text)) {
+            cout << text << endl;
         }
-        
-        cout << acc << endl;
-        closesocket(sock);
     }
 
     void deleteServerFile() {
@@ -298,29 +880,9 @@ public:
         cout << "Enter filename to delete: ";
         cin >> filename;
 
-        SOCKET sock = networkClient.connectToServer();
-        if (sock == INVALID_SOCKET) return;
-
-        if (!networkClient.authenticate(sock)) {
-            cout << "Authentication failed!\n";
-            closesocket(sock);
-            return;
-        }
-
-        string cmd = "DELETE " + filename;
-        NetworkClient::sendAll(sock, cmd.c_str(), (int)cmd.size());
-
-        char buf[4096];
-        string acc;
-        int r;
-        
-        while ((r = recv(sock, buf, sizeof(buf), 0)) > 0) {
-            acc.append(buf, buf + r);
-            if (r < (int)sizeof(buf)) break;
-        }
-        
-        cout << "Server: " << acc << endl;
-        closesocket(sock);
+        string text;
+        textCommand("DELETE " + filename, text);
+        cout << "Server: " << text << endl;
     }
 
     void restoreFromTrash() {
@@ -328,29 +890,9 @@ public:
         cout << "Enter filename to restore: ";
         cin >> filename;
 
-        SOCKET sock = networkClient.connectToServer();
-        if (sock == INVALID_SOCKET) return;
-
-        if (!networkClient.authenticate(sock)) {
-            cout << "Authentication failed!\n";
-            closesocket(sock);
-            return;
-        }
-
-        string cmd = "RESTORE " + filename;
-        NetworkClient::sendAll(sock, cmd.c_str(), (int)cmd.size());
-
-        char buf[4096];
-        string acc;
-        int r;
-        
-        while ((r = recv(sock, buf, sizeof(buf), 0)) > 0) {
-            acc.append(buf, buf + r);
-            if (r < (int)sizeof(buf)) break;
-        }
-        
-        cout << "Server: " << acc << endl;
-        closesocket(sock);
+        string text;
+        textCommand("RESTORE " + filename, text);
+        cout << "Server: " << text << endl;
     }
 
     void displayMenu() {
@@ -397,61 +939,553 @@ public:
     }
 
 private:
-    void waitForServerResponse(SOCKET sock) {
-        char buf[4096];
-        fd_set readSet;
-        FD_ZERO(&readSet);
-        FD_SET(sock, &readSet);
-        
-        timeval tv; 
-        tv.tv_sec = 5; 
-        tv.tv_usec = 0;
-        
-        int sel = select(0, &readSet, NULL, NULL, &tv);
-        if (sel > 0) {
-            int got = recv(sock, buf, sizeof(buf)-1, 0);
-            if (got > 0) {
-                buf[got] = '\0';
-                cout << "Server: " << buf << endl;
-            }
-        } else if (sel == 0) {
-            cout << "No reply from server after upload (timed out) — upload may have succeeded.\n";
-        } else {
-            cout << "Select error\n";
-        }
-    }
-
-    void receiveFileData(SOCKET sock, ofstream& out) {
-        char buf[4096];
+    // Delta update (rsync-style): the server's signature of its copy tells which blocks of
+    // the new version it already has, so only references to those and the bytes in between
+    // are sent. Returns the server's status, 404 when it has no copy, 413 when a delta would
+    // save too little, or 0 if the session broke.
+    int uploadDelta(const string& filename, const string& serverName, long long size) {
+        int status = 0;
+        string signature;
+        if (!sendCommand("SIGNATURE " + serverName)) return 0;
+        if (!NetworkClient::recvResponse(sessionSock, status, signature)) {
+            cout << "Connection lost during upload\n";
+            closeSession();
+            return 0;
+        }
+        if (status != 200) return status;
+
+        // "FTPSIG 1 <version> <size> <block size>", then "<weak> <strong>" per block.
+        istringstream sig(signature);
+        string magic, version;
+        int format = 0;
+        long long basisSize = -1, block = 0;
+        sig >> magic >> format >> version >> basisSize >> block;
+        if (magic != "FTPSIG" || format != 1 || basisSize < 0 || block <= 0) return 400;
+        unordered_map<uint32_t, vector<long long>> byWeak;
+        vector<string> strong;
+        string weakHex, strongHex;
+        while (sig >> weakHex >> strongHex) {
+            byWeak[(uint32_t)strtoul(weakHex.c_str(), NULL, 16)].push_back((long long)strong.size());
+            strong.push_back(strongHex);
+        }
+        long long fullBlocks = basisSize / block;
+        size_t tailLen = (size_t)(basisSize % block);
+        if ((long long)strong.size() != fullBlocks + (tailLen > 0)) return 400;
+
+        // Past this the delta is hardly smaller than the file, and it is built in memory.
+        const size_t limit = (size_t)min(size / 2, (long long)DELTA_LIMIT);
+        string ops;
+        long long copyFirst = -1, copyCount = 0, literal = 0;
+        auto put64 = [&](long long value) {
+            for (int i = 0; i < 8; ++i) ops += (char)((unsigned long long)value >> (56 - 8 * i));
+        };
+        auto flushCopy = [&]() {
+            if (copyCount == 0) return;
+            ops += 'C';
+            put64(copyFirst);
+            put64(copyCount);
+            copyCount = 0;
+        };
+        auto addLiteral = [&](const char* data, size_t len) {
+            if (len == 0) return;
+            flushCopy();
+            ops += 'L';
+            put64((long long)len);
+            ops.append(data, len);
+            literal += (long long)len;
+        };
+        auto addCopy = [&](long long index) {
+            if (copyCount > 0 && index == copyFirst + copyCount) {
+                copyCount++;
+                return;
+            }
+            flushCopy();
+            copyFirst = index;
+            copyCount = 1;
+        };
+        // Index of the server's block matching len bytes at p (its short final block when
+        // tail is set), or -1.
+        auto findBlock = [&](uint32_t weak, const char* p, size_t len, bool tail) -> long long {
+            auto it = byWeak.find(weak);
+            if (it == byWeak.end()) return -1;
+            string hash;
+            for (long long index : it->second) {
+                if ((index == fullBlocks) != tail) continue;
+                if (hash.empty()) hash = Sha256::of(p, len).substr(0, 32);
+                if (strong[(size_t)index] == hash) return index;
+            }
+            return -1;
+        };
+
+        ifstream file(filename, ios::binary);
+        if (!file.is_open()) return 400;
+        Sha256 whole;
+        const size_t window = (size_t)block;
+        vector<char> buffer(max((size_t)DELTA_BUFFER, 4 * window));
+        size_t start = 0, pending = 0, end = 0;   // window start, first unsent byte, data end
+        uint32_t a = 0, b = 0;
+        bool rolling = false, eof = false;
+        while (ops.size() <= limit) {
+            if (end - start < window && !eof) {
+                addLiteral(buffer.data() + pending, start - pending);
+                memmove(buffer.data(), buffer.data() + start, end - start);
+                end -= start;
+                start = pending = 0;
+                file.read(buffer.data() + end, (streamsize)(buffer.size() - end));
+                size_t got = (size_t)file.gcount();
+                whole.update(buffer.data() + end, got);
+                end += got;
+                eof = !file.good();
+                rolling = false;
+                continue;
+            }
+            if (end - start < window) break;
+
+            const unsigned char* p = (const unsigned char*)buffer.data() + start;
+            if (!rolling) {
+                a = b = 0;
+                for (size_t i = 0; i < window; ++i) {
+                    a += p[i];
+                    b += a;
+                }
+                rolling = true;
+            }
+            long long index = findBlock((a & 0xffff) | (b << 16), buffer.data() + start, window, false);
+            if (index >= 0) {
+                addLiteral(buffer.data() + pending, start - pending);
+                addCopy(index);
+                start += window;
+                pending = start;
+                rolling = false;
+                continue;
+            }
+            if (start + window < end) {
+                a += p[window] - p[0];
+                b += a - (uint32_t)window * p[0];
+            } else {
+                rolling = false;
+            }
+            start++;
+        }
+        if (ops.size() > limit || file.bad()) return 413;
+
+        // The last few bytes may still match the server's short final block.
+        size_t left = end - pending;
+        if (tailLen > 0 && left >= tailLen) {
+            const char* tail = buffer.data() + end - tailLen;
+            if (findBlock(weakSum(tail, tailLen), tail, tailLen, true) >= 0) {
+                addLiteral(buffer.data() + pending, left - tailLen);
+                addCopy(fullBlocks);
+                pending = end;
+            }
+        }
+        addLiteral(buffer.data() + pending, end - pending);
+        flushCopy();
+        if (ops.size() > limit) return 413;
+
+        string delta = "FTPDELTA 1 " + to_string(block) + " " + to_string(size) + " " + whole.hex() + "\n" + ops;
+        string reply;
+        if (!sendCommand("UPLOAD_DELTA " + version + " " + to_string(delta.size()) + " " + serverName)) return 0;
+        bool sent = true;
+        for (size_t offset = 0; sent && offset < delta.size(); offset += DELTA_BUFFER) {
+            size_t n = min(delta.size() - offset, (size_t)DELTA_BUFFER);
+            sent = NetworkClient::sendFrame(sessionSock, Frame::DATA, 0, delta.data() + offset, n);
+        }
+        if (!sent || !NetworkClient::sendFrame(sessionSock, Frame::END, 0, NULL, 0) ||
+            !NetworkClient::recvResponse(sessionSock, status, reply)) {
+            cout << "Connection lost during upload\n";
+            closeSession();
+            return 0;
+        }
+        cout << "Sent delta: " << delta.size() << " bytes (" << literal << " of " << size << " bytes new)\n";
+        cout << "Server: " << reply << endl;
+        return status;
+    }
+
+    static uint32_t weakSum(const char* data, size_t len) {
+        const unsigned char* p = (const unsigned char*)data;
+        uint32_t a = 0, b = 0;
+        for (size_t i = 0; i < len; ++i) {
+            a += p[i];
+            b += a;
+        }
+        return (a & 0xffff) | (b << 16);
+    }
+
+    // SHA-256 (hex) of the file at path; empty if it can't be read.
+    static string fileChecksum(const string& path) {
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) return "";
+        Sha256 hash;
+        vector<char> buffer(STREAM_BUFFER);
+        while (in) {
+            in.read(buffer.data(), (streamsize)buffer.size());
+            if (in.gcount() > 0) hash.update(buffer.data(), (size_t)in.gcount());
+        }
+        return in.bad() ? "" : hash.hex();
+    }
+
+    // Whether the server's copy of serverName, at version, has the same content as localPath.
+    // Ranges moved in parallel are checked this way once they are all in place.
+    bool sameContent(const string& version, const string& serverName, const string& localPath) {
+        string remote;
+        if (!textCommand("CHECKSUM " + version + " " + serverName, remote)) {
+            if (!remote.empty()) cout << "Server: " << remote << endl;
+            return false;
+        }
+        return remote == fileChecksum(localPath);
+    }
+
+    // Feeds the file at path to onChunk one content-defined chunk at a time.
+    static bool forEachChunk(const string& path, const function<bool(const char*, size_t)>& onChunk) {
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) return false;
+        vector<char> buffer(4 * ContentChunker::MAX_SIZE);
+        size_t start = 0, end = 0;
+        bool eof = false;
         while (true) {
+            if (end - start < ContentChunker::MAX_SIZE && !eof) {
+                memmove(buffer.data(), buffer.data() + start, end - start);
+                end -= start;
+                start = 0;
+                in.read(buffer.data() + end, (streamsize)(buffer.size() - end));
+                end += (size_t)in.gcount();
+                eof = !in.good();
+                continue;
+            }
+            if (start == end) return in.eof();
+            size_t len = ContentChunker::cut((const unsigned char*)buffer.data() + start, end - start);
+            if (!onChunk(buffer.data() + start, len)) return false;
+            start += len;
+        }
+    }
+
+    // Dedup upload: the file's manifest goes first and the server answers with the chunks it
+    // lacks, so only those are sent. Returns the server's status, or 0 if the session broke.
+    int uploadDeduplicated(const string& filename, const string& serverName, long long size) {
+        vector<string> hashes;
+        string manifest;
+        bool read = forEachChunk(filename, [&](const char* data, size_t len) {
+            hashes.push_back(Sha256::of(data, len));
+            manifest += hashes.back() + " " + to_string(len) + "\n";
+            return true;
+        });
+        if (!read) {
+            cout << "Cannot read file: " << filename << endl;
+            return 400;
+        }
+        manifest = "FTPDEDUP 1 " + to_string(size) + "\n" + manifest;
+
+        int status = 0;
+        string reply;
+        if (!sendCommand("UPLOAD_DEDUP " + to_string(manifest.size()) + " " + serverName)) return 0;
+        if (!NetworkClient::sendFrame(sessionSock, Frame::DATA, 0, manifest.data(), manifest.size()) ||
+            !NetworkClient::sendFrame(sessionSock, Frame::END, 0, NULL, 0) ||
+            !NetworkClient::recvResponse(sessionSock, status, reply)) {
+            cout << "Connection lost during upload\n";
+            closeSession();
+            return 0;
+        }
+        if (status != 200) {
+            cout << "Server: " << reply << endl;
+            if (status == 501) closeSession();   // the server ends the session after refusing
+            return status;
+        }
+
+        set<string> wanted;
+        size_t pos = 0;
+        while (pos < reply.size()) {
+            size_t nl = reply.find('\n', pos);
+            if (nl == string::npos) nl = reply.size();
+            if (nl > pos) wanted.insert(reply.substr(pos, nl - pos));
+            pos = nl + 1;
+        }
+        size_t total = wanted.size();
+
+        // The server wants each missing chunk once, in the order it first appears.
+        size_t index = 0;
+        long long sent = 0;
+        bool ok = forEachChunk(filename, [&](const char* data, size_t len) {
+            if (index >= hashes.size()) return false;
+            if (!wanted.erase(hashes[index++])) return true;
+            sent += (long long)len;
+            return NetworkClient::sendFrame(sessionSock, Frame::DATA, 0, data, len);
+        });
+        if (!NetworkClient::sendFrame(sessionSock, Frame::END, 0, NULL, 0) ||
+            !NetworkClient::recvResponse(sessionSock, status, reply)) {
+            cout << "Connection lost during upload\n";
+            closeSession();
+            return 0;
+        }
+        if (!ok || !wanted.empty()) cout << "File changed while uploading\n";
+        cout << "Sent " << (total - wanted.size()) << " new chunks (" << sent << " of " << size << " bytes)\n";
+        cout << "Server: " << reply << endl;
+        return status;
+    }
+
+    // Moves [0, size) over up to `streams` extra sessions, each resumed with the current token.
+    // Every stream keeps claiming the next RANGE_BYTES slice until none are left, so a slow
+    // connection holds up only the slice it is on. Returns whether every slice was transferred.
+    bool runStreams(long long size, const function<bool(SOCKET, long long, long long, string&)>& transfer) {
+        atomic<long long> nextOffset(0);
+        atomic<long long> transferred(0);
+        atomic<bool> failed(false);
+        mutex errorMutex;
+        string error;
+
+        int count = (int)min((long long)streams, (size + RANGE_BYTES - 1) / RANGE_BYTES);
+        vector<thread> workers;
+        for (int i = 0; i < count; ++i) {
+            workers.emplace_back([&]() {
+                string reason;
+                string token = sessionToken;
+                SOCKET sock = networkClient.connectToServer(STREAM_SOCKET_BUFFER);
+                bool open = sock != INVALID_SOCKET && networkClient.openSession(sock, token);
+                if (!open) reason = "could not open a session";
+
+                while (open && !failed) {
+                    long long offset = nextOffset.fetch_add(RANGE_BYTES);
+                    if (offset >= size) break;
+                    long long length = min(RANGE_BYTES, size - offset);
+                    if (!transfer(sock, offset, length, reason)) break;
+                    transferred += length;
+                }
+
+                if (!reason.empty()) {
+                    failed = true;
+                    lock_guard<mutex> lock(errorMutex);
+                    if (error.empty()) error = reason;
+                }
+                if (open && reason.empty()) NetworkClient::sendFrame(sock, Frame::REQUEST, 0, "QUIT", 4);
+                if (sock != INVALID_SOCKET) closesocket(sock);
+            });
+        }
+        for (thread& worker : workers) worker.join();
+
+        if (!error.empty()) cout << "Transfer failed: " << error << endl;
+        return !failed && transferred == size;
+    }
+
+    // Each range goes out as an UPLOAD_CHUNK into a server-side upload that is published by
+    // UPLOAD_COMMIT once the server holds every byte.
+    bool uploadParallel(const string& filename, const string& serverName, long long size) {
+        random_device random;
+        char id[32];
+        snprintf(id, sizeof(id), "cli-%08x%08x%08x", random(), random(), random());
+
+        string text;
+        if (!textCommand("UPLOAD_START " + string(id) + " " + to_string(size) + " " + serverName, text)) {
+            if (!text.empty()) cout << "Server: " << text << endl;
+            return false;
+        }
+
+        auto transfer = [&](SOCKET sock, long long offset, long long length, string& reason) {
+            ifstream in(filename, ios::binary);
+            in.seekg(offset);
+            string cmd = "UPLOAD_CHUNK " + string(id) + " " + to_string(offset) + " " + to_string(length);
+            if (!in || !NetworkClient::sendFrame(sock, Frame::REQUEST, 0, cmd.c_str(), cmd.size())) {
+                reason = in ? "connection lost" : "cannot read " + filename;
+                return false;
+            }
+
+            vector<char> buffer(STREAM_BUFFER);
+            long long remaining = length;
+            while (remaining > 0) {
+                in.read(buffer.data(), (streamsize)min((long long)STREAM_BUFFER, remaining));
+                streamsize got = in.gcount();
+                if (got <= 0) break;   // the server reports the short chunk
+                if (!NetworkClient::sendFrame(sock, Frame::DATA, 0, buffer.data(), (unsigned long long)got)) {
+                    reason = "connection lost";
+                    return false;
+                }
+                remaining -= got;
+            }
+
+            int status = 0;
+            string reply;
+            if (!NetworkClient::sendFrame(sock, Frame::END, 0, NULL, 0) || !NetworkClient::recvResponse(sock, status, reply)) {
+                reason = "connection lost";
+                return false;
+            }
+            if (status != 200) reason = reply;
+            return status == 200;
+        };
+        if (!runStreams(size, transfer)) return false;
+
+        if (!textCommand("UPLOAD_COMMIT " + string(id), text)) {
+            if (!text.empty()) cout << "Server: " << text << endl;
+            return false;
+        }
+        string info;
+        if (!textCommand("STAT " + serverName, info) || atoll(info.c_str()) != size ||
+            !sameContent(info.substr(info.find(' ') + 1), serverName, filename)) {
+            cout << "Verification failed: server does not hold the content of " << filename << endl;
+            return false;
+        }
+        cout << "Server: " << text << " (" << size << " bytes over " << min((long long)streams, (size + RANGE_BYTES - 1) / RANGE_BYTES) << " streams)\n";
+        return true;
+    }
+
+    // Ranges are written into a preallocated ".part" file that replaces local only once every
+    // range has arrived in full and the whole matches the server's checksum. The server refuses ranges of any other version of the file,
+    // so the pieces can't come from different uploads.
+    bool downloadParallel(const string& serverFilename, const string& local, long long size, const string& version) {
+        string part = local + ".part";
+        {
+            ofstream out(part, ios::binary | ios::trunc);
+            out.seekp(size - 1);
+            out.put('\0');
+            if (!out) {
+                cout << "Cannot create local file\n";
+                return false;
+            }
+        }
+
+        auto transfer = [&](SOCKET sock, long long offset, long long length, string& reason) {
+            string cmd = "DOWNLOAD_RANGE " + version + " " + to_string(offset) + " " + to_string(length) + " " + serverFilename;
+            Frame frame;
+            if (!NetworkClient::sendFrame(sock, Frame::REQUEST, 0, cmd.c_str(), cmd.size()) ||
+                !NetworkClient::recvFrameHeader(sock, frame)) {
+                reason = "connection lost";
+                return false;
+            }
+            if (frame.type == Frame::RESPONSE) {
+                reason.assign((size_t)min(frame.length, (unsigned long long)4096), '\0');
+                if (!NetworkClient::recvExact(sock, &reason[0], (long long)reason.size())) reason = "connection lost";
+                if (reason.empty()) reason = "refused by server";
+                return false;
+            }
+            if (frame.type != Frame::DATA || frame.length != (unsigned long long)length) {
+                reason = "unexpected frame from server";
+                return false;
+            }
+
+            fstream out(part, ios::in | ios::out | ios::binary);
+            out.seekp(offset);
+            vector<char> buffer(STREAM_BUFFER);
+            long long remaining = length;
+            while (remaining > 0) {
+                int want = (int)min((long long)STREAM_BUFFER, remaining);
+                if (!NetworkClient::recvExact(sock, buffer.data(), want)) {
+                    reason = "connection lost";
+                    return false;
+                }
+                out.write(buffer.data(), want);
+                remaining -= want;
+            }
+            if (!out.flush()) {
+                reason = "cannot write " + part;
+                return false;
+            }
+            if (!NetworkClient::recvFrameHeader(sock, frame) || frame.type != Frame::END) {
+                reason = "connection lost";
+                return false;
+            }
+            return true;
+        };
+
+        bool ok = runStreams(size, transfer) && sameContent(version, serverFilename, part);
+        if (!ok || (fileSystem.fileExists(local) && remove(local.c_str()) != 0) || rename(part.c_str(), local.c_str()) != 0) {
+            cout << "Download of " << serverFilename << " failed\n";
+            remove(part.c_str());
+            return false;
+        }
+
+        cout << "Downloaded " << size << " bytes to: " << local << " over "
+             << min((long long)streams, (size + RANGE_BYTES - 1) / RANGE_BYTES) << " streams\n";
+        return true;
+    }
+
+    // Connects the command session unless it is still usable. The server closes sessions
+    // that sit idle, so a connection that has become readable (EOF) is replaced.
+    bool ensureSession() {
+        if (sessionSock != INVALID_SOCKET) {
             fd_set readSet;
             FD_ZERO(&readSet);
-            FD_SET(sock, &readSet);
-            
-            timeval tv; 
-            tv.tv_sec = 2; 
-            tv.tv_usec = 0;
-            
-            int sel = select(0, &readSet, NULL, NULL, &tv);
-            if (sel > 0) {
-                int got = recv(sock, buf, sizeof(buf), 0);
-                if (got > 0) {
-                    out.write(buf, got);
-                } else {
-                    break;
+            FD_SET(sessionSock, &readSet);
+            timeval tv = { 0, 0 };
+            if (select(0, &readSet, NULL, NULL, &tv) == 0) return true;
+            closeSession();
+        }
+
+        SOCKET sock = networkClient.connectToServer();
+        if (sock == INVALID_SOCKET) return false;
+
+        if (!networkClient.openSession(sock, sessionToken)) {
+            closesocket(sock);
+            if (sessionToken.empty()) {
+                // The saved token was refused; log in again with credentials.
+                sock = networkClient.connectToServer();
+                if (sock == INVALID_SOCKET) return false;
+                if (networkClient.openSession(sock, sessionToken)) {
+                    sessionSock = sock;
+                    return negotiateEncoding();
                 }
-            } else if (sel == 0) {
-                break;
-            } else {
-                cout << "Select error\n";
-                break;
+                closesocket(sock);
             }
+            cout << "Authentication failed!\n";
+            return false;
         }
+        sessionSock = sock;
+        return negotiateEncoding();
+    }
+
+    // Offers the codecs built in on a fresh session. A server without them answers
+    // "identity" and an older one refuses the command; either way transfers stay plain.
+    bool negotiateEncoding() {
+        encoding = Compression::NONE;
+        string offer = Compression::offer();
+        if (offer.empty()) return true;
+
+        string command = "ENCODING " + offer;
+        int status = 0;
+        string reply;
+        if (!NetworkClient::sendFrame(sessionSock, Frame::REQUEST, 0, command.c_str(), command.size()) ||
+            !NetworkClient::recvResponse(sessionSock, status, reply)) {
+            cout << "No response from server\n";
+            closeSession();
+            return false;
+        }
+        if (status == 200) encoding = Compression::fromName(reply);
+        return true;
+    }
+
+    void closeSession() {
+        if (sessionSock != INVALID_SOCKET) {
+            closesocket(sessionSock);
+            sessionSock = INVALID_SOCKET;
+        }
+    }
+
+    bool sendCommand(const string& command) {
+        if (!ensureSession()) return false;
+        if (!NetworkClient::sendFrame(sessionSock, Frame::REQUEST, 0, command.c_str(), command.size())) {
+            cout << "Error sending command\n";
+            closeSession();
+            return false;
+        }
+        return true;
+    }
+
+    // Runs a command whose reply is text; returns whether the server reported success.
+    bool textCommand(const string& command, string& text) {
+        if (!sendCommand(command)) return false;
+        int status = 0;
+        if (!NetworkClient::recvResponse(sessionSock, status, text)) {
+            cout << "No response from server\n";
+            closeSession();
+            return false;
+        }
+        return status == 200;
     }
 };
 
-int main() {
+int main(int argc, char* argv[]) {
     FTPClient client;
+    for (int i = 1; i < argc; ++i) {
+        if (string(argv[i]) == "--streams" && i + 1 < argc) client.setStreams(atoi(argv[++i]));
+        else if (string(argv[i]) == "--dedup") client.setDedup(true);
+    }
     
     if (!client.initialize()) {
         cout << "Failed to initialize FTP client\n";
@@ -1,972 +1,7575 @@
     // server_oop.cpp - Object Oriented Version
     #include <iostream>
     #include <fstream>
-    #include <winsock2.h>
-    #include <ws2tcpip.h>
     #include <vector>
     #include <string>
-    #include <direct.h>
     #include <cstdio>
-    #include <windows.h>
     #include <sstream>
     #include <algorithm>
     #include <cctype>
     #include <memory>
     #include <map>
+    #include <set>
+    #include <deque>
+    #include <unordered_map>
+    #include <chrono>
+    #include <climits>
+    #include <mutex>
+    #include <shared_mutex>
+    #include <atomic>
+    #include <thread>
+    #include <random>
+    #include <cstdint>
+    #include <cstring>
+    #include <ctime>
+    #include <condition_variable>
+    #include <unordered_set>
+    #include <functional>
+    #include <cmath>
+    #include <string_view>
+    #include <array>
+
+    #ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #include <direct.h>
+    #include <io.h>
+    #include <fcntl.h>
+    #include <windows.h>
+    #include <sys/utime.h>
+    #include <bcrypt.h>
     #pragma comment(lib, "ws2_32.lib")
+    #pragma comment(lib, "bcrypt.lib")
+    #define PATH_SEP "\\"
+    #define MSG_NOSIGNAL 0
+    #else
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <utime.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <dirent.h>
+    #include <errno.h>
+    #include <signal.h>
+    #include <poll.h>
+    #include <pthread.h>
+    #ifdef __linux__
+    #include <sys/epoll.h>
+    #include <sys/sendfile.h>
+    #include <netinet/tcp.h>
+    #include <sched.h>
+    #include <sys/inotify.h>
+    #define FTP_HAVE_INOTIFY 1
+    #if __has_include(<sys/random.h>)
+    #include <sys/random.h>
+    #define FTP_HAVE_GETRANDOM 1
+    #endif
+    #if __has_include(<linux/io_uring.h>)
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <cstring>
+    #define FTP_HAVE_IO_URING 1
+    #endif
+    #endif
+    #define PATH_SEP "/"
+    typedef int SOCKET;
+    #define INVALID_SOCKET (-1)
+    #define SOCKET_ERROR (-1)
+    #endif
 
-    using namespace std;
+    // Optional compressors for the static asset cache and for transfers; each also needs its
+    // library linked.
+    #if defined(FTP_WITH_ZLIB) && __has_include(<zlib.h>)
+    #include <zlib.h>
+    #define FTP_HAVE_ZLIB 1
+    #endif
+    #if defined(FTP_WITH_ZSTD) && __has_include(<zstd.h>)
+    #include <zstd.h>
+    #define FTP_HAVE_ZSTD 1
+    #endif
+    #if defined(FTP_WITH_BROTLI) && __has_include(<brotli/encode.h>)
+    #include <brotli/encode.h>
+    #define FTP_HAVE_BROTLI 1
+    #endif
 
-    class SessionManager {
-    private:
-        map<SOCKET, bool> authenticatedSessions;
-        string valid_username = "admin";
-        string valid_password = "password123";
+    // SSE2 is part of every x86-64 target; the HTTP parser scans 16 bytes at a time with it.
+    #if defined(__SSE2__) && __has_include(<emmintrin.h>)
+    #include <emmintrin.h>
+    #define FTP_HAVE_SSE2 1
+    #endif
+
+    using namespace std;
 
+    // Thin wrapper over the handful of OS calls that differ between Winsock/Win32 and POSIX.
+    class Platform {
     public:
-        bool authenticate(const string& username, const string& password) {
-            return (username == valid_username && password == valid_password);
+        static bool initSockets() {
+    #ifdef _WIN32
+            WSADATA wsaData;
+            return WSAStartup(MAKEWORD(2,2), &wsaData) == 0;
+    #else
+            signal(SIGPIPE, SIG_IGN);
+            return true;
+    #endif
         }
 
-        void addAuthenticatedSession(SOCKET sock) {
-            authenticatedSessions[sock] = true;
+        static void cleanupSockets() {
+    #ifdef _WIN32
+            WSACleanup();
+    #endif
         }
 
-        void removeSession(SOCKET sock) {
-            authenticatedSessions.erase(sock);
+        static void closeSocket(SOCKET sock) {
+    #ifdef _WIN32
+            closesocket(sock);
+    #else
+            close(sock);
+    #endif
         }
 
-        bool isAuthenticated(SOCKET sock) {
-            return authenticatedSessions.find(sock) != authenticatedSessions.end();
+        static bool setNonBlocking(SOCKET sock) {
+    #ifdef _WIN32
+            u_long mode = 1;
+            return ioctlsocket(sock, FIONBIO, &mode) == 0;
+    #else
+            int flags = fcntl(sock, F_GETFL, 0);
+            return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+    #endif
         }
 
-        string getValidUsername() const { return valid_username; }
-        string getValidPassword() const { return valid_password; }
-    };
+        static int lastSocketError() {
+    #ifdef _WIN32
+            return WSAGetLastError();
+    #else
+            return errno;
+    #endif
+        }
 
-    class FileManager {
-    private:
-        string uploadFolder;
-        string trashFolder;
-        string wwwFolder;
-        SessionManager& sessionManager;
+        static bool wouldBlock(int err) {
+    #ifdef _WIN32
+            return err == WSAEWOULDBLOCK;
+    #else
+            return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+    #endif
+        }
 
-    public:
-        FileManager(SessionManager& sm, const string& upload = "uploads\\", 
-                    const string& trash = "trash\\", 
-                    const string& www = "www\\")
-            : sessionManager(sm), uploadFolder(upload), trashFolder(trash), wwwFolder(www) {
-            createDirectories();
+        static void makeDirectory(const string& path) {
+    #ifdef _WIN32
+            _mkdir(path.c_str());
+    #else
+            mkdir(path.c_str(), 0755);
+    #endif
         }
 
-        void createDirectories() const {
-            _mkdir(uploadFolder.c_str());
-            _mkdir(trashFolder.c_str());
-            _mkdir(wwwFolder.c_str());
+        // Fills buffer from the OS's cryptographic random source.
+        static bool randomBytes(void* buffer, size_t len) {
+    #ifdef _WIN32
+            return BCryptGenRandom(NULL, (PUCHAR)buffer, (ULONG)len, BCRYPT_USE_SYSTEM_PREFERRED_RNG) == 0;
+    #else
+            unsigned char* out = (unsigned char*)buffer;
+            size_t done = 0;
+    #ifdef FTP_HAVE_GETRANDOM
+            while (done < len) {
+                ssize_t got = getrandom(out + done, len - done, 0);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) break;
+                done += (size_t)got;
+            }
+            if (done == len) return true;
+    #endif
+            int fd = open("/dev/urandom", O_RDONLY);
+            if (fd == -1) return false;
+            while (done < len) {
+                ssize_t got = read(fd, out + done, len - done);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) break;
+                done += (size_t)got;
+            }
+            close(fd);
+            return done == len;
+    #endif
         }
 
-        bool fileExists(const string& filename) const {
-            ifstream f(filename, ios::binary);
-            return f.good();
+        // Restricts the calling thread to a single CPU. Returns false where unsupported.
+        static bool pinCurrentThread(int cpu) {
+    #ifdef _WIN32
+            return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+    #elif defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    #else
+            (void)cpu;
+            return false;
+    #endif
         }
 
-        bool moveToTrash(const string& filename) const {
-            string sourcePath = uploadFolder + filename;
-            string trashPath = trashFolder + filename;
+        // Read-only descriptor for streaming a file body, or -1. size receives the file length.
+        // modified, when given, receives the last-write time in seconds since the epoch, and
+        // fileId the inode number (0 where the platform has none).
+        static int openFileForRead(const string& path, long long& size, long long* modified = nullptr,
+                                   unsigned long long* fileId = nullptr) {
+    #ifdef _WIN32
+            int fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+            if (fd == -1) return -1;
+            struct _stat64 st;
+            if (_fstat64(fd, &st) != 0) {
+                _close(fd);
+                return -1;
+            }
+            size = (long long)st.st_size;
+    #else
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) return -1;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+                close(fd);
+                return -1;
+            }
+            size = (long long)st.st_size;
+    #endif
+            if (modified) *modified = (long long)st.st_mtime;
+            if (fileId) *fileId = (unsigned long long)st.st_ino;
+            return fd;
+        }
 
-            if (!fileExists(sourcePath)) return false;
+        // Second descriptor for the same open file, closed independently of the first.
+        static int duplicateFile(int fd) {
+    #ifdef _WIN32
+            return _dup(fd);
+    #else
+            return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    #endif
+        }
 
-            if (fileExists(trashPath)) {
-                remove(trashPath.c_str());
+        // Positional read; the descriptor's own offset is not relied upon.
+        static int readFileAt(int fd, char* buffer, int len, long long offset) {
+    #ifdef _WIN32
+            if (_lseeki64(fd, offset, SEEK_SET) < 0) return -1;
+            return _read(fd, buffer, (unsigned)len);
+    #else
+            return (int)pread(fd, buffer, (size_t)len, (off_t)offset);
+    #endif
+        }
+
+        // Creates (or truncates) a file for writing; -1 on failure.
+        static int createFile(const string& path) {
+    #ifdef _WIN32
+            return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+    #else
+            return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    #endif
+        }
+
+        // Opens an existing file for writing at offset without truncating it; -1 on failure.
+        static int openFileForWriteAt(const string& path, long long offset) {
+    #ifdef _WIN32
+            int fd = _open(path.c_str(), _O_WRONLY | _O_BINARY);
+            if (fd == -1) return -1;
+            if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+    #else
+            int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+            if (fd == -1) return -1;
+            if (lseek(fd, (off_t)offset, SEEK_SET) < 0) {
+    #endif
+                closeFile(fd);
+                return -1;
             }
+            return fd;
+        }
 
-            return rename(sourcePath.c_str(), trashPath.c_str()) == 0;
+        // Writes all of data; false on any error (e.g. disk full).
+        static bool writeFile(int fd, const char* data, size_t len) {
+            while (len > 0) {
+    #ifdef _WIN32
+                int n = _write(fd, data, (unsigned)min(len, (size_t)INT_MAX));
+    #else
+                ssize_t n = write(fd, data, len);
+                if (n < 0 && errno == EINTR) continue;
+    #endif
+                if (n <= 0) return false;
+                data += n;
+                len -= (size_t)n;
+            }
+            return true;
         }
 
-        bool authenticateClient(SOCKET sock) {
-            char buf[1024];
-            int r = recv(sock, buf, sizeof(buf)-1, 0);
-            if (r <= 0) return false;
-            buf[r] = '\0';
+        static void closeFile(int fd) {
+    #ifdef _WIN32
+            _close(fd);
+    #else
+            close(fd);
+    #endif
+        }
 
-            string credentials(buf);
-            istringstream iss(credentials);
-            string username, password;
-            iss >> username >> password;
+        // TCP_CORK: hold partial frames so a response header and the first payload bytes leave
+        // in the same segment. No-op where unsupported.
+        static void setCork(SOCKET sock, bool enabled) {
+    #ifdef TCP_CORK
+            int value = enabled ? 1 : 0;
+            setsockopt(sock, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    #else
+            (void)sock;
+            (void)enabled;
+    #endif
+        }
 
-            if (sessionManager.authenticate(username, password)) {
-                sessionManager.addAuthenticatedSession(sock);
-                return true;
-            }
-            return false;
+        static bool deleteFile(const string& path) {
+            return remove(path.c_str()) == 0;
         }
 
-        string listFilesInFolder(const string& folder) const {
-            string fileList;
+        // Sets a file's mtime to now.
+        static bool touchFile(const string& path) {
+    #ifdef _WIN32
+            return _utime(path.c_str(), NULL) == 0;
+    #else
+            return utime(path.c_str(), NULL) == 0;
+    #endif
+        }
+
+        // Moves a file, replacing the destination if it already exists.
+        static bool moveFile(const string& from, const string& to) {
+    #ifdef _WIN32
+            return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_COPY_ALLOWED | MOVEFILE_REPLACE_EXISTING) != 0;
+    #else
+            return rename(from.c_str(), to.c_str()) == 0;
+    #endif
+        }
+
+        struct FileInfo {
+            long long size = 0;
+            long long modified = 0;     // seconds since the epoch
+        };
+
+        // Size and mtime of a regular file; false if path is missing or not a regular file.
+        static bool statFile(const string& path, FileInfo& info) {
+    #ifdef _WIN32
+            struct _stat64 st;
+            if (_stat64(path.c_str(), &st) != 0 || !(st.st_mode & _S_IFREG)) return false;
+    #else
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    #endif
+            info.size = (long long)st.st_size;
+            info.modified = (long long)st.st_mtime;
+            return true;
+        }
+
+        // Regular files directly in folder, with their metadata.
+        static map<string, FileInfo> scanFiles(const string& folder) {
+            map<string, FileInfo> files;
+    #ifdef _WIN32
             string pattern = folder + "*";
             WIN32_FIND_DATAA ffd;
             HANDLE hFind = FindFirstFileA(pattern.c_str(), &ffd);
-            
             if (hFind != INVALID_HANDLE_VALUE) {
                 do {
                     string name = ffd.cFileName;
                     if (name == "." || name == "..") continue;
                     if (!(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                        fileList += name + "\n";
+                        FileInfo& info = files[name];
+                        info.size = ((long long)ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow;
+                        // FILETIME counts 100 ns ticks since 1601.
+                        long long ticks = ((long long)ffd.ftLastWriteTime.dwHighDateTime << 32) | ffd.ftLastWriteTime.dwLowDateTime;
+                        info.modified = (ticks - 116444736000000000LL) / 10000000;
                     }
                 } while (FindNextFileA(hFind, &ffd));
                 FindClose(hFind);
             }
-            
-            return fileList.empty() ? "(none)\n" : fileList;
+    #else
+            DIR* dir = opendir(folder.c_str());
+            if (dir) {
+                struct dirent* entry;
+                while ((entry = readdir(dir)) != NULL) {
+                    string name = entry->d_name;
+                    if (name == "." || name == "..") continue;
+                    FileInfo info;
+                    if (statFile(folder + name, info)) files[name] = info;
+                }
+                closedir(dir);
+            }
+    #endif
+            return files;
         }
 
-        string getUploadFolder() const { return uploadFolder; }
-        string getTrashFolder() const { return trashFolder; }
-        string getWwwFolder() const { return wwwFolder; }
-        SessionManager& getSessionManager() const { return sessionManager; }
+        // Names of the regular files directly inside folder (folder ends with PATH_SEP).
+        static vector<string> listFiles(const string& folder) {
+            vector<string> names;
+            for (const auto& entry : scanFiles(folder)) names.push_back(entry.first);
+            return names;
+        }
     };
 
-    class NetworkManager {
+    // Startup options shared by every worker.
+    struct ServerOptions {
+        int workers = 1;            // <= 0: one per hardware thread
+        bool pinCpus = false;
+        bool ioUring = false;       // io_uring engine where the kernel supports it
+        bool zeroCopy = true;       // sendfile() for file bodies on the epoll engine
+        int keepAliveSeconds = 15;  // idle time allowed between requests on a persistent connection
+        int maxRequestsPerConnection = 100; // <= 1 disables HTTP keep-alive
+        bool dedup = false;         // store uploads as manifests over a shared chunk store
+        long long rateLimit = 0;            // bytes per second for all bulk transfers together; 0 = none
+        long long userRateLimit = 0;        // ... for each user's transfers together
+        long long connectionRateLimit = 0;  // ... for each connection
+        int maxConnections = 10000;         // open connections across all workers; 0 = no cap
+        int maxTransfers = 512;             // uploads and downloads in progress; 0 = no cap
+        int acceptBacklog = 128;            // connections the kernel queues for accept()
+        int headerTimeoutSeconds = 10;      // to receive a whole request head or login
+        int bodyTimeoutSeconds = 30;        // allowed between reads of an upload body
+        long long minTransferRate = 1024;   // bytes per second a transfer must keep up; 0 = off
+    };
+
+    // Process-wide counters for file-body bytes sent through sendfile() versus the
+    // read()+send() copy path, with the time spent inside those calls, and for compressed
+    // transfers the payload bytes against the bytes that crossed the wire. Served on /stats.
+    class TransferStats {
+    public:
+        enum Path { ZERO_COPY = 0, COPY = 1 };
+        enum Direction { DOWNLOAD = 0, UPLOAD = 1 };
+
     private:
-        static const int BUFFER_SIZE = 8192;
+        inline static atomic<long long> bytes[2];
+        inline static atomic<long long> calls[2];
+        inline static atomic<long long> busyNanos[2];
+        inline static atomic<long long> payloadBytes[2];
+        inline static atomic<long long> wireBytes[2];
+        inline static atomic<long long> encodedBodies[2];
+        inline static atomic<long long> incompressible;
 
     public:
-        static int sendAll(SOCKET sock, const char* data, int len) {
-            int total = 0;
-            while (total < len) {
-                int sent = send(sock, data + total, len - total, 0);
-                if (sent == SOCKET_ERROR) return SOCKET_ERROR;
-                total += sent;
-            }
-            return total;
+        static void record(Path path, long long sent, chrono::steady_clock::duration busy) {
+            if (sent > 0) bytes[path] += sent;
+            calls[path]++;
+            busyNanos[path] += chrono::duration_cast<chrono::nanoseconds>(busy).count();
         }
 
-        static int recvAll(SOCKET sock, char* buffer, int expected) {
-            int total = 0;
-            while (total < expected) {
-                int r = recv(sock, buffer + total, expected - total, 0);
-                if (r <= 0) return total;
-                total += r;
-            }
-            return total;
+        static void recordEncodedBody(Direction direction) { encodedBodies[direction]++; }
+
+        static void recordEncoded(Direction direction, long long payload, long long wire) {
+            payloadBytes[direction] += payload;
+            wireBytes[direction] += wire;
         }
 
-        static string recvUntilHeadersEnd(SOCKET sock) {
-            string acc;
-            char buf[1024];
-            fd_set readSet;
-            timeval tv;
-            
-            while (true) {
-                FD_ZERO(&readSet);
-                FD_SET(sock, &readSet);
-                tv.tv_sec = 1;
-                tv.tv_usec = 0;
-                
-                int sel = select(0, &readSet, NULL, NULL, &tv);
-                if (sel > 0) {
-                    int r = recv(sock, buf, sizeof(buf), 0);
-                    if (r <= 0) break;
-                    acc.append(buf, buf + r);
-                    
-                    if (acc.find("\r\n\r\n") != string::npos) {
-                        break;
-                    }
-                    if (acc.size() > 4 && (acc.find("HTTP/") != string::npos || 
-                                        acc.find("GET ") == 0 || 
-                                        acc.find("POST ") == 0)) {
-                        continue;
-                    }
-                } else if (sel == 0) {
-                    if (!acc.empty() && (acc.find("HTTP/") != string::npos || 
-                                        acc.find("GET ") == 0 || 
-                                        acc.find("POST ") == 0)) {
-                        break;
-                    } else {
-                        break;
-                    }
-                } else {
-                    break;
-                }
-                
-                if (acc.size() > 64 * 1024) break;
+        // A body that could have been compressed but was sent as is after sampling.
+        static void recordIncompressible() { incompressible++; }
+
+        static string report() {
+            static const char* names[2] = { "zero-copy", "copy" };
+            ostringstream out;
+            for (int p = 0; p < 2; ++p) {
+                long long b = bytes[p], n = busyNanos[p];
+                double mbPerSec = n > 0 ? (b / 1e6) / (n / 1e9) : 0.0;
+                out << names[p] << ": " << b << " bytes, " << calls[p] << " calls, "
+                    << n / 1000000 << " ms in syscalls, " << (long long)mbPerSec << " MB/s\n";
             }
-            return acc;
+            static const char* directions[2] = { "compressed downloads", "compressed uploads" };
+            for (int d = 0; d < 2; ++d) {
+                long long payload = payloadBytes[d], wire = wireBytes[d];
+                out << directions[d] << ": " << encodedBodies[d] << " bodies, " << payload << " payload bytes, "
+                    << wire << " bytes on the wire";
+                if (payload > 0) out << " (" << wire * 100 / payload << "%)";
+                out << "\n";
+            }
+            out << "sent uncompressed after sampling: " << incompressible << " bodies\n";
+            return out.str();
         }
     };
 
-    class HttpRequestHandler {
-    private:
-        FileManager& fileManager;
-        NetworkManager& networkManager;
+    // Bandwidth limits for bulk transfers: token buckets for the whole server, for each user
+    // and for each connection, any of which may be off (0). Bulk bytes - file and compressed
+    // bodies going out, upload bodies coming in - are granted at most QUANTUM at a time, so
+    // the loops, which serve connections round robin, share a limited rate evenly between
+    // transfers. Interactive responses (pages, listings, small replies) never wait; their
+    // bytes are charged to the shared buckets, which may go into debt, so bulk transfers yield
+    // to them. Limits can be changed while running; shared buckets are behind one mutex and a
+    // connection's own bucket is only touched by its loop.
+    class TransferShaper {
+    public:
+        struct Limits {
+            long long global = 0;           // bytes per second; 0 = unlimited
+            long long perUser = 0;
+            long long perConnection = 0;
+        };
 
-        string urlDecode(const string& str) const {
-            string res;
-            for (size_t i = 0; i < str.size(); ++i) {
-                if (str[i] == '%') {
-                    if (i + 2 < str.size()) {
-                        int hi = isdigit(str[i+1]) ? str[i+1] - '0' : tolower(str[i+1]) - 'a' + 10;
-                        int lo = isdigit(str[i+2]) ? str[i+2] - '0' : tolower(str[i+2]) - 'a' + 10;
-                        res += (char)(hi * 16 + lo);
-                        i += 2;
-                    } else {
-                        res += str[i];
-                    }
-                } else if (str[i] == '+') {
-                    res += ' ';
-                } else {
-                    res += str[i];
+        static const long long QUANTUM = 64 * 1024;
+        static const int REFILL_MS = 10;    // how often throttled connections are retried
+        static const long long MAX_RATE = 1LL << 40;
+
+        class Bucket {
+        private:
+            long long tokens = 0;
+            long long rate = 0;
+            long long fraction = 0;     // rate * microseconds not yet worth a whole token
+            chrono::steady_clock::time_point last;
+
+        public:
+            // Up to a tenth of a second of tokens (at least one quantum) can build up.
+            static long long burst(long long rate) { return max(rate / 10, QUANTUM); }
+
+            // Tokens available now at rate; <= 0 while in debt.
+            long long available(chrono::steady_clock::time_point now, long long newRate) {
+                long long elapsedUs = chrono::duration_cast<chrono::microseconds>(now - last).count();
+                if (newRate != rate || elapsedUs >= 1000000) {
+                    rate = newRate;
+                    tokens = burst(rate);
+                    fraction = 0;
+                    last = now;
+                } else if (elapsedUs > 0) {
+                    // Checked every few microseconds under load, so the remainder is carried.
+                    long long gained = elapsedUs * rate + fraction;
+                    tokens = min(burst(rate), tokens + gained / 1000000);
+                    fraction = gained % 1000000;
+                    last += chrono::microseconds(elapsedUs);
                 }
+                return tokens;
             }
-            return res;
+
+            // n may be negative to return tokens taken but not used.
+            void take(long long n) { tokens = max(tokens - n, -burst(rate)); }
+        };
+
+        // Shaping state of one connection.
+        struct Flow {
+            Bucket bucket;
+            string user;        // whose account the transfer counts against; "" before login
+            bool held = false;  // granted less than asked for since last cleared
+        };
+
+    private:
+        mutable mutex shaperMutex;
+        Limits current;
+        atomic<bool> active{false};
+        Bucket globalBucket;
+        unordered_map<string, Bucket> userBuckets;
+        atomic<long long> waits{0};
+        atomic<long long> bulkBytes{0};
+        atomic<long long> interactiveBytes{0};
+
+    public:
+        explicit TransferShaper(const Limits& limits) { setLimits(limits); }
+
+        Limits limits() const {
+            lock_guard<mutex> lock(shaperMutex);
+            return current;
         }
 
-        string getHeaderValue(const string& headers, const string& key) const {
-            size_t pos = headers.find(key);
-            if (pos == string::npos) return "";
-            size_t lineEnd = headers.find("\r\n", pos);
-            if (lineEnd == string::npos) return "";
-            size_t colon = headers.find(":", pos);
-            if (colon == string::npos || colon > lineEnd) return "";
-            size_t valueStart = colon + 1;
-            string val = headers.substr(valueStart, lineEnd - valueStart);
-            size_t a = val.find_first_not_of(" \t");
-            size_t b = val.find_last_not_of(" \t");
-            if (a == string::npos) return "";
-            return val.substr(a, b - a + 1);
+        void setLimits(const Limits& limits) {
+            lock_guard<mutex> lock(shaperMutex);
+            current = limits;
+            active = limits.global > 0 || limits.perUser > 0 || limits.perConnection > 0;
         }
 
-        string getCookieValue(const string& headers, const string& cookieName) const {
-            size_t pos = headers.find("Cookie:");
-            if (pos == string::npos) return "";
-            
-            size_t lineEnd = headers.find("\r\n", pos);
-            if (lineEnd == string::npos) return "";
-            
-            string cookieLine = headers.substr(pos, lineEnd - pos);
-            size_t namePos = cookieLine.find(cookieName + "=");
-            if (namePos == string::npos) return "";
-            
-            size_t valueStart = namePos + cookieName.length() + 1;
-            size_t valueEnd = cookieLine.find(";", valueStart);
-            if (valueEnd == string::npos) valueEnd = lineEnd - pos;
-            
-            return cookieLine.substr(valueStart, valueEnd - valueStart);
+        bool shaping() const { return active.load(memory_order_relaxed); }
+
+        // How many of want bulk bytes flow may move now; 0 means wait REFILL_MS and ask again.
+        // Bytes granted but not moved go back through giveBack().
+        long long grant(Flow& flow, long long want) {
+            if (!shaping()) return want;
+            auto now = chrono::steady_clock::now();
+            long long allowed = min(want, QUANTUM);
+            lock_guard<mutex> lock(shaperMutex);
+            Bucket* user = current.perUser > 0 ? &userBuckets[flow.user] : nullptr;
+            if (current.perConnection > 0) allowed = min(allowed, flow.bucket.available(now, current.perConnection));
+            if (current.global > 0) allowed = min(allowed, globalBucket.available(now, current.global));
+            if (user) allowed = min(allowed, user->available(now, current.perUser));
+            if (allowed < want) flow.held = true;
+            if (allowed <= 0) {
+                waits++;
+                return 0;
+            }
+            if (current.perConnection > 0) flow.bucket.take(allowed);
+            if (current.global > 0) globalBucket.take(allowed);
+            if (user) user->take(allowed);
+            bulkBytes += allowed;
+            return allowed;
         }
 
-        void sendHttpResponse(SOCKET clientSocket, int status, const string& contentType, const string& body, const string& additionalHeaders = "") const {
-            string statusText = (status == 200) ? "OK" : 
-                            (status == 400) ? "Bad Request" :
-                            (status == 401) ? "Unauthorized" :
-                            (status == 404) ? "Not Found" :
-                            (status == 500) ? "Internal Server Error" : "Unknown";
-            
-            string resp = "HTTP/1.1 " + to_string(status) + " " + statusText + "\r\n" +
-                        "Content-Type: " + contentType + "\r\n" +
-                        "Content-Length: " + to_string(body.size()) + "\r\n" +
-                        additionalHeaders + "\r\n" + body;
-            
-            NetworkManager::sendAll(clientSocket, resp.c_str(), (int)resp.size());
+        void giveBack(Flow& flow, long long unused) {
+            if (unused <= 0 || !shaping()) return;
+            lock_guard<mutex> lock(shaperMutex);
+            if (current.perConnection > 0) flow.bucket.take(-unused);
+            if (current.global > 0) globalBucket.take(-unused);
+            if (current.perUser > 0) userBuckets[flow.user].take(-unused);
+            bulkBytes -= unused;
         }
 
-        bool isAuthenticated(const string& headers) const {
-            string sessionToken = getCookieValue(headers, "session");
-            return sessionToken == "authenticated";
+        // Interactive bytes already sent: they count against the shared limits without waiting.
+        void charge(Flow& flow, long long sent) {
+            if (sent <= 0 || !shaping()) return;
+            auto now = chrono::steady_clock::now();
+            lock_guard<mutex> lock(shaperMutex);
+            if (current.global > 0) {
+                globalBucket.available(now, current.global);
+                globalBucket.take(sent);
+            }
+            if (current.perUser > 0) {
+                Bucket& user = userBuckets[flow.user];
+                user.available(now, current.perUser);
+                user.take(sent);
+            }
+            interactiveBytes += sent;
         }
 
-    public:
-        HttpRequestHandler(FileManager& fm, NetworkManager& nm) 
-            : fileManager(fm), networkManager(nm) {}
+        // "<n>", "<n>k", "<n>m" or "<n>g" bytes per second (binary multiples), up to MAX_RATE;
+        // -1 if malformed.
+        static long long parseRate(const string& text) {
+            long long value = 0;
+            size_t used = 0;
+            while (used < text.size() && isdigit((unsigned char)text[used])) {
+                if (used == 12) return -1;
+                value = value * 10 + (text[used++] - '0');
+            }
+            if (used == 0) return -1;
+            string suffix = text.substr(used);
+            int shift = 0;
+            if (suffix == "k" || suffix == "K") shift = 10;
+            else if (suffix == "m" || suffix == "M") shift = 20;
+            else if (suffix == "g" || suffix == "G") shift = 30;
+            else if (!suffix.empty()) return -1;
+            return value <= (MAX_RATE >> shift) ? value << shift : -1;
+        }
 
-        void handleRequest(SOCKET clientSocket, const string& req) {
-            size_t pos = req.find("\r\n");
-            string requestLine = (pos == string::npos) ? req : req.substr(0, pos);
+        string report() const {
+            Limits limits = this->limits();
+            return "shaping: global " + to_string(limits.global) + " B/s, per user " + to_string(limits.perUser) +
+                   " B/s, per connection " + to_string(limits.perConnection) + " B/s (0 = unlimited); " +
+                   to_string(bulkBytes.load()) + " bulk bytes, " + to_string(interactiveBytes.load()) +
+                   " interactive bytes, " + to_string(waits.load()) + " waits\n";
+        }
+    };
 
-            string method, path;
-            {
-                istringstream iss(requestLine);
-                iss >> method >> path;
+    // Login sessions, for browsers (the session cookie) and command clients (RESUME), shared
+    // by every worker thread. A token is 32 bytes from the OS random source, sent as 64 hex
+    // digits. Sessions are spread over SHARDS independently locked hash tables by the
+    // token's first word, so concurrent checks rarely meet on a lock. Each shard expires idle
+    // sessions on a hierarchical timer wheel of one-second ticks: a use only moves the
+    // session's deadline, and when the slot it was filed under comes due the session is
+    // either dropped or filed again under its new deadline.
+    class SessionManager {
+    private:
+        static const int TOKEN_TTL_SECONDS = 30 * 60;
+        static const int SHARDS = 64;
+        static const int WHEEL_BITS = 6;            // 64 slots per level
+        static const int WHEEL_LEVELS = 3;          // spans 64^3 seconds, about three days
+        static const int WHEEL_SLOTS = 1 << WHEEL_BITS;
+
+        struct Token {
+            uint64_t words[4];
+            bool operator==(const Token& other) const {
+                return memcmp(words, other.words, sizeof(words)) == 0;
             }
+        };
 
-            // Handle login page and login request without authentication
-            if (path == "/login" || path == "/login.html") {
-                serveLoginPage(clientSocket);
-                return;
+        struct TokenHash {
+            // Tokens are uniformly random already; words[0] picks the shard, words[1] the bucket.
+            size_t operator()(const Token& token) const { return (size_t)token.words[1]; }
+        };
+
+        struct Session {
+            long long expires;      // tick
+            string user;
+        };
+
+        struct Shard {
+            mutex shardMutex;
+            unordered_map<Token, Session, TokenHash> sessions;
+            vector<Token> wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+            long long tick = -1;                                    // last tick processed
+        };
+
+        Shard shards[SHARDS];
+        string valid_username = "admin";
+        string valid_password = "password123";
+
+        static long long currentTick() {
+            return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // Checked on every authenticated request, so digits are decoded through a table;
+        // branching on digit or letter mispredicts on random input.
+        static bool parseToken(string_view hex, Token& token) {
+            static const array<unsigned char, 256> digits = [] {
+                array<unsigned char, 256> table;
+                table.fill(0xff);
+                for (int i = 0; i < 10; ++i) table['0' + i] = (unsigned char)i;
+                for (int i = 0; i < 6; ++i) table['a' + i] = (unsigned char)(10 + i);
+                return table;
+            }();
+            if (hex.size() != 64) return false;
+            unsigned char invalid = 0;
+            for (int w = 0; w < 4; ++w) {
+                uint64_t word = 0;
+                for (int i = 0; i < 16; ++i) {
+                    unsigned char digit = digits[(unsigned char)hex[(size_t)(w * 16 + i)]];
+                    invalid |= digit;
+                    word = (word << 4) | (uint64_t)(digit & 0xf);
+                }
+                token.words[w] = word;
             }
+            return (invalid & 0xf0) == 0;
+        }
 
-            if (path == "/auth" && method == "POST") {
-                handleLogin(clientSocket, req);
-                return;
+        static string formatToken(const Token& token) {
+            static const char hex[] = "0123456789abcdef";
+            string text;
+            for (uint64_t word : token.words) {
+                for (int shift = 60; shift >= 0; shift -= 4) text += hex[(word >> shift) & 0xf];
             }
+            return text;
+        }
 
-            if (path == "/logout") {
-                handleLogout(clientSocket);
+        Shard& shardOf(const Token& token) { return shards[token.words[0] % SHARDS]; }
+
+        // Files token under the slot its expiry falls in on the lowest level whose span
+        // reaches it; sessions already due are dropped.
+        static void file(Shard& shard, const Token& token, long long expires) {
+            long long delta = expires - shard.tick;
+            if (delta <= 0) {
+                shard.sessions.erase(token);
                 return;
             }
+            int level = 0;
+            while (level + 1 < WHEEL_LEVELS && delta >= (1LL << (WHEEL_BITS * (level + 1)))) ++level;
+            shard.wheel[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)].push_back(token);
+        }
 
-            if (path == "/") {
-                if (isAuthenticated(req)) {
-                    serveStaticFile(clientSocket, "/index.html");
-                } else {
-                    sendHttpResponse(clientSocket, 302, "text/html", "", "Location: /login\r\n");
+        // Moves shard's wheel forward to now. Each tick first hands the upper-level slots that
+        // start at it down a level, then settles the level-0 slot for the tick itself.
+        static void advance(Shard& shard, long long now) {
+            if (shard.tick < 0 || shard.sessions.empty()) {
+                if (shard.sessions.empty()) {
+                    for (auto& level : shard.wheel) {
+                        for (vector<Token>& slot : level) slot.clear();
+                    }
                 }
+                shard.tick = now;
                 return;
             }
+            vector<Token> due;
+            while (shard.tick < now) {
+                long long t = ++shard.tick;
+                for (int level = WHEEL_LEVELS - 1; level >= 0; --level) {
+                    if (level > 0 && (t & ((1LL << (WHEEL_BITS * level)) - 1)) != 0) continue;
+                    due.clear();
+                    due.swap(shard.wheel[level][(t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]);
+                    for (const Token& token : due) {
+                        auto it = shard.sessions.find(token);
+                        if (it == shard.sessions.end()) continue;      // revoked
+                        file(shard, token, it->second.expires);
+                    }
+                }
+            }
+        }
 
-            // Check authentication for other routes
-            if (!isAuthenticated(req)) {
-                sendHttpResponse(clientSocket, 401, "text/html",
-                    "<html><body><h1>401 Unauthorized</h1><p>Please <a href='/login'>login</a></p></body></html>");
-                return;
+    public:
+        bool authenticate(const string& username, const string& password) {
+            return (username == valid_username && password == valid_password);
+        }
+
+        // Starts a session for user and returns its token, or "" if no random bytes could be
+        // had. The session ends after TOKEN_TTL_SECONDS without use.
+        string issueToken(const string& user) {
+            Token token;
+            if (!Platform::randomBytes(token.words, sizeof(token.words))) {
+                cout << "No random source for session tokens\n";
+                return "";
             }
+            Shard& shard = shardOf(token);
+            lock_guard<mutex> lock(shard.shardMutex);
+            long long now = currentTick();
+            advance(shard, now);
+            shard.sessions[token] = Session{ now + TOKEN_TTL_SECONDS, user };
+            file(shard, token, now + TOKEN_TTL_SECONDS);
+            return formatToken(token);
+        }
 
-            // Handle authenticated routes
-            if (method == "GET") {
-                handleGetRequest(clientSocket, path);
-            } else if (method == "POST") {
-                handlePostRequest(clientSocket, req, path);
-            } else {
-                sendHttpResponse(clientSocket, 400, "text/plain", "Unsupported request method");
+        // Whether token names a live session; each successful check extends it. user, when
+        // given, receives whose session it is.
+        bool validateToken(string_view text, string* user = nullptr) {
+            Token token;
+            if (!parseToken(text, token)) return false;
+            Shard& shard = shardOf(token);
+            lock_guard<mutex> lock(shard.shardMutex);
+            long long now = currentTick();
+            advance(shard, now);
+            auto it = shard.sessions.find(token);
+            if (it == shard.sessions.end()) return false;
+            it->second.expires = now + TOKEN_TTL_SECONDS;
+            if (user) *user = it->second.user;
+            return true;
+        }
+
+        void revokeToken(string_view text) {
+            Token token;
+            if (!parseToken(text, token)) return;
+            Shard& shard = shardOf(token);
+            lock_guard<mutex> lock(shard.shardMutex);
+            shard.sessions.erase(token);
+        }
+
+        // Drops sessions that have expired in shards nobody has used lately. Shards another
+        // thread holds are skipped; that thread advances them itself.
+        void expireIdle() {
+            long long now = currentTick();
+            for (Shard& shard : shards) {
+                unique_lock<mutex> lock(shard.shardMutex, try_to_lock);
+                if (lock.owns_lock()) advance(shard, now);
             }
         }
 
-    private:
-        void serveLoginPage(SOCKET clientSocket) const {
-            string loginPage = R"(
-    <!DOCTYPE html>
-    <html>
-    <head>
-        <meta charset="utf-8">
-        <title>FTP Server - Login</title>
-        <style>
-            * { margin: 0; padding: 0; box-sizing: border-box; }
-            body { 
-                font-family: 'Segoe UI', Tahoma, Geneva, Verdana, sans-serif;
-                background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
-                height: 100vh;
-                display: flex;
-                align-items: center;
-                justify-content: center;
+        string report() {
+            size_t live = 0;
+            for (Shard& shard : shards) {
+                lock_guard<mutex> lock(shard.shardMutex);
+                live += shard.sessions.size();
             }
-            .login-container {
-                background: rgba(255, 255, 255, 0.95);
-                padding: 40px;
-                border-radius: 15px;
-                box-shadow: 0 10px 30px rgba(0, 0, 0, 0.2);
-                width: 100%;
-                max-width: 400px;
+            return "sessions: " + to_string(live) + " live\n";
+        }
+
+        string getValidUsername() const { return valid_username; }
+        string getValidPassword() const { return valid_password; }
+    };
+
+    // SHA-256 (FIPS 180-4); names the chunks of the dedup store.
+    class Sha256 {
+    private:
+        uint32_t state[8];
+        unsigned char block[64];
+        size_t used;
+        unsigned long long totalBytes;
+
+        static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+        void compress(const unsigned char* p) {
+            static const uint32_t K[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+            };
+            uint32_t w[64];
+            for (int i = 0; i < 16; ++i) {
+                w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
             }
-            h1 { 
-                text-align: center; 
-                margin-bottom: 30px;
-                color: #2c3e50;
+            for (int i = 16; i < 64; ++i) {
+                uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
             }
-            .form-group { margin-bottom: 20px; }
-            label { display: block; margin-bottom: 5px; color: #34495e; }
-            input[type="text"], input[type="password"] {
-                width: 100%;
-                padding: 12px;
-                border: 2px solid #ddd;
-                border-radius: 8px;
-                font-size: 14px;
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+            for (int i = 0; i < 64; ++i) {
+                uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+                uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
             }
-            input:focus { outline: none; border-color: #3498db; }
-            button {
-                width: 100%;
-                padding: 12px;
-                background: #3498db;
-                color: white;
-                border: none;
-                border-radius: 8px;
-                font-size: 16px;
-                cursor: pointer;
-                transition: background 0.3s ease;
+            state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+            state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        }
+
+    public:
+        Sha256() : state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 },
+                   used(0), totalBytes(0) {}
+
+        void update(const char* data, size_t len) {
+            const unsigned char* p = (const unsigned char*)data;
+            totalBytes += len;
+            if (used > 0) {
+                size_t take = min(len, sizeof(block) - used);
+                memcpy(block + used, p, take);
+                used += take;
+                p += take;
+                len -= take;
+                if (used < sizeof(block)) return;
+                compress(block);
+                used = 0;
             }
-            button:hover { background: #2980b9; }
-            .error { 
-                color: #e74c3c; 
-                margin-top: 10px; 
-                text-align: center;
-                min-height: 20px;
+            for (; len >= sizeof(block); p += sizeof(block), len -= sizeof(block)) compress(p);
+            memcpy(block, p, len);
+            used = len;
+        }
+
+        // Lowercase hex digest. Finishes the hash; the object is spent afterwards.
+        string hex() {
+            unsigned long long bits = totalBytes * 8;
+            static const char padding[64] = { (char)0x80 };
+            update(padding, used < 56 ? 56 - used : 120 - used);
+            char length[8];
+            for (int i = 0; i < 8; ++i) length[i] = (char)(bits >> (56 - 8 * i));
+            update(length, sizeof(length));
+
+            char out[65];
+            for (int i = 0; i < 8; ++i) snprintf(out + 8 * i, 9, "%08x", state[i]);
+            return string(out, 64);
+        }
+
+        static string of(const char* data, size_t len) {
+            Sha256 hash;
+            hash.update(data, len);
+            return hash.hex();
+        }
+    };
+
+    // Content-defined chunk boundaries: a gear rolling hash (FastCDC-style, with normalized
+    // chunking) cuts where its top bits are zero, so a boundary depends only on the bytes just
+    // before it and an edit early in a file leaves the later chunks untouched. client.cpp
+    // carries the same table and masks; both sides must cut identically for a client to find
+    // its chunks already on the server.
+    struct ContentChunker {
+        static constexpr size_t MIN_SIZE = 16 * 1024;
+        static constexpr size_t AVG_SIZE = 64 * 1024;
+        static constexpr size_t MAX_SIZE = 256 * 1024;
+
+        // Length of the chunk starting at data, given len bytes available. A result equal to
+        // len is only a real boundary at end of file or once len reaches MAX_SIZE.
+        static size_t cut(const unsigned char* data, size_t len) {
+            static const uint64_t MASK_SMALL = 0xffff800000000000ULL;   // 17 bits: cuts are rare below AVG_SIZE
+            static const uint64_t MASK_LARGE = 0xfffe000000000000ULL;   // 15 bits: and common above it
+            if (len <= MIN_SIZE) return len;
+            size_t limit = min(len, MAX_SIZE);
+            size_t normal = min(limit, AVG_SIZE);
+            const uint64_t* table = gear();
+            uint64_t hash = 0;
+            size_t i = MIN_SIZE;
+            for (; i < normal; ++i) {
+                hash = (hash << 1) + table[data[i]];
+                if (!(hash & MASK_SMALL)) return i + 1;
             }
-            .credentials {
-                margin-top: 20px;
-                padding: 15px;
-                background: #f8f9fa;
-                border-radius: 8px;
-                border-left: 4px solid #3498db;
+            for (; i < limit; ++i) {
+                hash = (hash << 1) + table[data[i]];
+                if (!(hash & MASK_LARGE)) return i + 1;
             }
-            .credentials h3 {
-                margin-bottom: 10px;
-                color: #2c3e50;
+            return limit;
+        }
+
+    private:
+        // Fixed pseudo-random values per byte (splitmix64 from a constant seed). Changing them
+        // changes every boundary, so they must stay as they are.
+        static const uint64_t* gear() {
+            static const vector<uint64_t> table = [] {
+                vector<uint64_t> values(256);
+                uint64_t x = 0x4654504445445550ULL;
+                for (uint64_t& value : values) {
+                    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+                    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                    value = z ^ (z >> 31);
+                }
+                return values;
+            }();
+            return table.data();
+        }
+    };
+
+    // Content-addressed storage behind dedup mode (--dedup). A file is cut into content-defined
+    // chunks, each kept once under its SHA-256 in chunks/xx/, and what sits in uploads/ or
+    // trash/ is a manifest naming the chunks in order. A sweeper thread deletes chunks no
+    // manifest lists any more. Chunks written or reused within SWEEP_GRACE_SECONDS are always
+    // kept: that covers uploads whose manifest has not been published yet.
+    class ChunkStore {
+    public:
+        struct Manifest {
+            long long size = 0;
+            vector<pair<string, long long>> chunks;   // SHA-256 (hex) and length, in file order
+        };
+
+        // Adds every chunk a published manifest refers to; called with file moves held off.
+        typedef function<void(unordered_set<string>&)> LiveChunks;
+
+        static const long long MAX_MANIFEST_BYTES = 64LL * 1024 * 1024;
+
+    private:
+        static constexpr const char* MANIFEST_MAGIC = "FTPDEDUP 1 ";
+        static const size_t MAGIC_SIZE = 11;
+        static const int SWEEP_INTERVAL_SECONDS = 15 * 60;
+        static const int SWEEP_GRACE_SECONDS = 60 * 60;
+
+        string folder;
+        LiveChunks liveChunks;
+        mutex storeMutex;           // a sweep never deletes a chunk while it is checked or written
+        mutex sweepMutex;
+        condition_variable sweepWake;
+        bool stopping;
+        bool dropped;               // a manifest went away since the last sweep
+        atomic<unsigned long long> tempCounter;
+        thread sweeper;
+
+        static string subfolder(int index) {
+            char name[4];
+            snprintf(name, sizeof(name), "%02x", index);
+            return name;
+        }
+
+        static bool parseCount(const string& text, long long& value) {
+            if (text.empty() || text.size() > 18 || text.find_first_not_of("0123456789") != string::npos) return false;
+            value = atoll(text.c_str());
+            return true;
+        }
+
+        static bool isHash(const string& text) {
+            return text.size() == 64 && text.find_first_not_of("0123456789abcdef") == string::npos;
+        }
+
+        // Sweeps at startup, then at most once per interval and only after a manifest was dropped.
+        void sweepLoop() {
+            unique_lock<mutex> lock(sweepMutex);
+            while (!stopping) {
+                if (dropped) {
+                    dropped = false;
+                    lock.unlock();
+                    sweep();
+                    lock.lock();
+                }
+                sweepWake.wait_for(lock, chrono::seconds(SWEEP_INTERVAL_SECONDS));
             }
-        </style>
-    </head>
-    <body>
-        <div class="login-container">
-            <h1>🔐 FTP Server Login</h1>
-            <form id="loginForm">
-                <div class="form-group">
-                    <label>Username:</label>
-                    <input type="text" id="username" name="username" required>
-                </div>
-                <div class="form-group">
-                    <label>Password:</label>
-                    <input type="password" id="password" name="password" required>
-                </div>
-                <button type="submit">Login</button>
-            </form>
-            <div id="error" class="error"></div>
-            
-            <div class="credentials">
-                <h3>Default Credentials:</h3>
-                <p><strong>Username:</strong> admin</p>
-                <p><strong>Password:</strong> password123</p>
-            </div>
-        </div>
+        }
 
-        <script>
-            document.getElementById('loginForm').addEventListener('submit', async (e) => {
-                e.preventDefault();
-                
-                const username = document.getElementById('username').value;
-                const password = document.getElementById('password').value;
-                const errorDiv = document.getElementById('error');
-                
-                errorDiv.textContent = ''; // Clear previous errors
-                
-                try {
-                    const formData = new FormData();
-                    formData.append('username', username);
-                    formData.append('password', password);
-                    
-                    const response = await fetch('/auth', {
-                        method: 'POST',
-                        body: formData
-                    });
-                    
-                    if (response.ok) {
-                        // Login successful, redirect to main page
-                        window.location.href = '/';
-                    } else {
-                        const errorText = await response.text();
-                        errorDiv.textContent = 'Login failed: ' + errorText;
+        void sweep() {
+            unordered_set<string> live;
+            liveChunks(live);
+            long long cutoff = (long long)time(nullptr) - SWEEP_GRACE_SECONDS;
+            int removed = 0;
+            for (int i = 0; i < 256 && !stopping; ++i) {
+                string path = folder + subfolder(i) + PATH_SEP;
+                for (const auto& entry : Platform::scanFiles(path)) {
+                    if (entry.second.modified >= cutoff || (isHash(entry.first) && live.count(entry.first))) continue;
+                    // Checked again under the lock: an upload may have just reused the chunk.
+                    lock_guard<mutex> lock(storeMutex);
+                    Platform::FileInfo info;
+                    if (Platform::statFile(path + entry.first, info) && info.modified < cutoff &&
+                        Platform::deleteFile(path + entry.first)) {
+                        removed++;
                     }
-                } catch (error) {
-                    errorDiv.textContent = 'Login failed: ' + error.message;
                 }
-            });
+            }
+            if (removed > 0) cout << "Chunk store: removed " << removed << " unreferenced chunks" << endl;
+        }
 
-            // Auto-focus username field
-            document.getElementById('username').focus();
-        </script>
-    </body>
-    </html>
-            )";
-            sendHttpResponse(clientSocket, 200, "text/html", loginPage);
+    public:
+        ChunkStore(const string& chunkFolder, LiveChunks live)
+            : folder(chunkFolder), liveChunks(move(live)), stopping(false), dropped(true), tempCounter(0) {
+            Platform::makeDirectory(folder);
+            for (int i = 0; i < 256; ++i) Platform::makeDirectory(folder + subfolder(i));
         }
 
-        void handleLogin(SOCKET clientSocket, const string& req) {
-        size_t headersEnd = req.find("\r\n\r\n");
-        if (headersEnd == string::npos) {
-            sendHttpResponse(clientSocket, 400, "text/plain", "Bad Request");
-            return;
+        ~ChunkStore() {
+            {
+                lock_guard<mutex> lock(sweepMutex);
+                stopping = true;
+            }
+            sweepWake.notify_all();
+            if (sweeper.joinable()) sweeper.join();
         }
 
-        string body = req.substr(headersEnd + 4);
-        string username, password;
+        // Only once every published manifest can be found through liveChunks.
+        void startSweeper() {
+            sweeper = thread([this]() { sweepLoop(); });
+        }
 
-        // Check if it's multipart/form-data
-        string contentType = getHeaderValue(req, "Content-Type");
-        if (contentType.find("multipart/form-data") != string::npos) {
-            // Parse multipart form data
-            size_t boundaryPos = contentType.find("boundary=");
-            if (boundaryPos != string::npos) {
-                size_t start = boundaryPos + 9;
-                size_t end = contentType.find(';', start);
-                if (end == string::npos) end = contentType.size();
-                string b = contentType.substr(start, end - start);
-                // trim spaces
-                size_t first = b.find_first_not_of(" \t");
-                size_t last = b.find_last_not_of(" \t");
-                if (first != string::npos) b = b.substr(first, last - first + 1);
-                // remove quotes
-                if (!b.empty() && b[0] == '"') b = b.substr(1);
-                if (!b.empty() && b.back() == '"') b.pop_back();
-                string boundary = "--" + b;
-                
-                // Find username field
-                size_t userPos = body.find(boundary);
-                if (userPos != string::npos) {
-                    userPos = body.find("name=\"username\"", userPos);
-                    if (userPos != string::npos) {
-                        userPos = body.find("\r\n\r\n", userPos);
-                        if (userPos != string::npos) {
-                            userPos += 4;
-                            size_t userEnd = body.find("\r\n" + boundary, userPos);
-                            if (userEnd != string::npos) {
-                                username = body.substr(userPos, userEnd - userPos);
-                                // Remove trailing CRLF
-                                while (!username.empty() && (username.back() == '\r' || username.back() == '\n')) {
-                                    username.pop_back();
-                                }
-                            }
-                        }
+        void manifestDropped() {
+            lock_guard<mutex> lock(sweepMutex);
+            dropped = true;
+        }
+
+        string chunkPath(const string& hash) const {
+            return folder + hash.substr(0, 2) + PATH_SEP + hash;
+        }
+
+        // "FTPDEDUP 1 <size>\n" followed by one "<sha256> <length>\n" line per chunk.
+        static string formatManifest(const Manifest& manifest) {
+            string text = MANIFEST_MAGIC + to_string(manifest.size) + "\n";
+            for (const auto& chunk : manifest.chunks) text += chunk.first + " " + to_string(chunk.second) + "\n";
+            return text;
+        }
+
+        // Parses manifest text, including one declared by a client: chunk lengths must be
+        // within ContentChunker::MAX_SIZE and add up to the stated size.
+        static bool parseManifest(const string& text, Manifest& manifest) {
+            if (text.compare(0, MAGIC_SIZE, MANIFEST_MAGIC) != 0) return false;
+            istringstream lines(text.substr(MAGIC_SIZE));
+            string line;
+            manifest = Manifest();
+            if (!getline(lines, line) || !parseCount(line, manifest.size)) return false;
+            long long total = 0;
+            while (getline(lines, line)) {
+                size_t space = line.find(' ');
+                long long length = 0;
+                if (space == string::npos || !isHash(line.substr(0, space)) || !parseCount(line.substr(space + 1), length) ||
+                    length == 0 || length > (long long)ContentChunker::MAX_SIZE) return false;
+                manifest.chunks.push_back(make_pair(line.substr(0, space), length));
+                total += length;
+            }
+            return total == manifest.size;
+        }
+
+        // Reads the manifest behind an open file of fileSize bytes; false if it isn't one.
+        static bool readManifest(int fd, long long fileSize, Manifest& manifest) {
+            if (fileSize < (long long)MAGIC_SIZE || fileSize > MAX_MANIFEST_BYTES) return false;
+            char magic[MAGIC_SIZE];
+            if (Platform::readFileAt(fd, magic, (int)MAGIC_SIZE, 0) != (int)MAGIC_SIZE ||
+                memcmp(magic, MANIFEST_MAGIC, MAGIC_SIZE) != 0) return false;
+            string text((size_t)fileSize, '\0');
+            long long done = 0;
+            while (done < fileSize) {
+                int got = Platform::readFileAt(fd, &text[(size_t)done], (int)(fileSize - done), done);
+                if (got <= 0) return false;
+                done += got;
+            }
+            return parseManifest(text, manifest);
+        }
+
+        static bool readManifest(const string& path, Manifest& manifest) {
+            long long size = 0;
+            int fd = Platform::openFileForRead(path, size);
+            if (fd == -1) return false;
+            bool ok = readManifest(fd, size, manifest);
+            Platform::closeFile(fd);
+            return ok;
+        }
+
+        // Size of the file a manifest describes, read from its header alone; false for a
+        // file that is not a manifest.
+        static bool manifestSize(const string& path, long long& size) {
+            long long fileSize = 0;
+            int fd = Platform::openFileForRead(path, fileSize);
+            if (fd == -1) return false;
+            char header[40];
+            int got = Platform::readFileAt(fd, header, (int)min((long long)sizeof(header) - 1, fileSize), 0);
+            Platform::closeFile(fd);
+            if (got < (int)MAGIC_SIZE || memcmp(header, MANIFEST_MAGIC, MAGIC_SIZE) != 0) return false;
+            header[got] = '\0';
+            char* end = nullptr;
+            long long value = strtoll(header + MAGIC_SIZE, &end, 10);
+            if (end == header + MAGIC_SIZE || *end != '\n' || value < 0) return false;
+            size = value;
+            return true;
+        }
+
+        static bool writeManifest(const string& path, const Manifest& manifest) {
+            string text = formatManifest(manifest);
+            int fd = Platform::createFile(path);
+            if (fd == -1) return false;
+            bool ok = Platform::writeFile(fd, text.data(), text.size());
+            Platform::closeFile(fd);
+            return ok;
+        }
+
+        // Whether a chunk is stored. A hit renews its grace period, so it survives until the
+        // manifest about to use it is published.
+        bool has(const string& hash) {
+            lock_guard<mutex> lock(storeMutex);
+            return Platform::touchFile(chunkPath(hash));
+        }
+
+        // As has(), but only for a stored chunk of exactly length bytes, so a manifest cannot
+        // give a chunk it never sent a length other than its own.
+        bool has(const string& hash, long long length) {
+            lock_guard<mutex> lock(storeMutex);
+            Platform::FileInfo info;
+            return Platform::statFile(chunkPath(hash), info) && info.size == length && Platform::touchFile(chunkPath(hash));
+        }
+
+        // Stores a chunk under its hash unless it is already there.
+        bool put(const string& hash, const char* data, size_t len) {
+            if (has(hash, (long long)len)) return true;
+            string path = chunkPath(hash);
+            string temp = path + ".tmp-" + to_string(++tempCounter);
+            int fd = Platform::createFile(temp);
+            if (fd == -1) return false;
+            bool ok = Platform::writeFile(fd, data, len);
+            Platform::closeFile(fd);
+            lock_guard<mutex> lock(storeMutex);
+            if (!ok || !Platform::moveFile(temp, path)) {
+                Platform::deleteFile(temp);
+                return false;
+            }
+            return true;
+        }
+
+        // Cuts the file at path into chunks, stores the ones not yet held and describes the
+        // file in manifest.
+        bool ingest(const string& path, Manifest& manifest) {
+            long long size = 0;
+            int fd = Platform::openFileForRead(path, size);
+            if (fd == -1) return false;
+            manifest = Manifest();
+            manifest.size = size;
+
+            vector<char> buffer(4 * ContentChunker::MAX_SIZE);
+            size_t start = 0, end = 0;
+            long long offset = 0;
+            bool ok = true;
+            while (ok) {
+                if (end - start < ContentChunker::MAX_SIZE && offset < size) {
+                    memmove(buffer.data(), buffer.data() + start, end - start);
+                    end -= start;
+                    start = 0;
+                    int got = Platform::readFileAt(fd, buffer.data() + end, (int)min((long long)(buffer.size() - end), size - offset), offset);
+                    if (got <= 0) {
+                        ok = false;
+                    } else {
+                        end += (size_t)got;
+                        offset += got;
                     }
+                    continue;
                 }
+                if (start == end) break;
+                size_t len = ContentChunker::cut((const unsigned char*)buffer.data() + start, end - start);
+                string hash = Sha256::of(buffer.data() + start, len);
+                ok = put(hash, buffer.data() + start, len);
+                manifest.chunks.push_back(make_pair(hash, (long long)len));
+                start += len;
+            }
+            Platform::closeFile(fd);
+            return ok;
+        }
+    };
 
-                // Find password field
-                size_t passPos = body.find(boundary, userPos != string::npos ? userPos : 0);
-                if (passPos != string::npos) {
-                    passPos = body.find("name=\"password\"", passPos);
-                    if (passPos != string::npos) {
-                        passPos = body.find("\r\n\r\n", passPos);
-                        if (passPos != string::npos) {
-                            passPos += 4;
-                            size_t passEnd = body.find("\r\n" + boundary, passPos);
-                            if (passEnd != string::npos) {
-                                password = body.substr(passPos, passEnd - passPos);
-                                // Remove trailing CRLF
-                                while (!password.empty() && (password.back() == '\r' || password.back() == '\n')) {
-                                    password.pop_back();
-                                }
-                            }
-                        }
-                    }
+    // Shared by every worker thread. uploads/ and trash/ are mirrored in an in-memory catalog
+    // (name -> size, mtime), seeded by one scan at startup and kept current by the operations
+    // below and, on Linux, by an inotify watcher that picks up changes made behind the
+    // server's back. Existence checks and listings never touch the disk. Operations that move
+    // files are serialized so a listing never observes a half-finished move. In dedup mode the
+    // files are ChunkStore manifests, listed with the size of the file they describe.
+    class FileManager {
+    public:
+        // One folder's entries, kept in name, size and mtime order so that a sorted page can
+        // start from its cursor with a single tree lookup.
+        class Index {
+        public:
+            typedef pair<long long, string> Key;   // size or mtime, then name as tie-break
+
+            map<string, Platform::FileInfo> byName;
+            set<Key> bySize;
+            set<Key> byModified;
+
+            // Returns false when name is already there with the same metadata.
+            bool put(const string& name, const Platform::FileInfo& info) {
+                auto it = byName.find(name);
+                if (it != byName.end()) {
+                    if (it->second.size == info.size && it->second.modified == info.modified) return false;
+                    erase(name);
                 }
+                byName[name] = info;
+                bySize.insert(Key(info.size, name));
+                byModified.insert(Key(info.modified, name));
+                return true;
             }
-        } else {
-            // Parse URL-encoded form data (original code)
-            size_t userPos = body.find("username=");
-            size_t passPos = body.find("&password=");
-            if (userPos != string::npos && passPos != string::npos) {
-                username = urlDecode(body.substr(userPos + 9, passPos - (userPos + 9)));
-                password = urlDecode(body.substr(passPos + 10));
+
+            bool erase(const string& name) {
+                auto it = byName.find(name);
+                if (it == byName.end()) return false;
+                bySize.erase(Key(it->second.size, name));
+                byModified.erase(Key(it->second.modified, name));
+                byName.erase(it);
+                return true;
+            }
+
+            void assign(const map<string, Platform::FileInfo>& files) {
+                clear();
+                for (const auto& entry : files) put(entry.first, entry.second);
+            }
+
+            void clear() {
+                byName.clear();
+                bySize.clear();
+                byModified.clear();
             }
+
+            size_t count(const string& name) const { return byName.count(name); }
+        };
+
+        // One page of a folder listing. after is the cursor handed out as the previous page's
+        // next, or empty for the first page.
+        struct ListQuery {
+            enum Sort { NAME, SIZE, MODIFIED };
+            Sort sort = NAME;
+            bool descending = false;
+            string prefix;
+            string glob;        // '*' and '?' wildcards; empty matches everything
+            string after;
+            size_t limit = 100;
+        };
+
+        struct ListPage {
+            vector<pair<string, Platform::FileInfo>> entries;
+            string next;        // cursor for the following page; empty after the last one
+            size_t total = 0;   // entries in the folder, before filtering
+        };
+
+        // Entries a filtered page may pass over before it is cut short, so that a filter
+        // matching little of a large folder still answers in bounded time.
+        static const size_t LIST_SCAN_LIMIT = 10000;
+
+    private:
+        string uploadFolder;
+        string trashFolder;
+        string wwwFolder;
+        string stagingFolder;
+        string chunkFolder;
+        SessionManager& sessionManager;
+        mutable shared_mutex catalogMutex;
+        mutable Index uploadIndex;      // guarded by catalogMutex
+        mutable Index trashIndex;
+        mutable atomic<unsigned long long> stagingCounter;
+        // Bumped by every change the catalog sees; with the per-run epoch it versions the listings.
+        mutable atomic<unsigned long long> catalogVersion;
+        unsigned long long catalogEpoch;
+        unique_ptr<ChunkStore> chunkStore;  // null unless in dedup mode
+    #ifdef FTP_HAVE_INOTIFY
+        int inotifyFd;
+        int uploadWatch;
+        int trashWatch;
+        atomic<bool> watching;
+        thread watcher;
+    #endif
+
+        // Re-reads one file's metadata into index; a missing file is dropped from it.
+        void refreshLocked(Index& index, const string& folder, const string& name) const {
+            Platform::FileInfo info;
+            bool changed = statEntry(folder + name, info) ? index.put(name, info) : index.erase(name);
+            if (changed) ++catalogVersion;
         }
 
-        // Debug output
-        cout << "Login attempt - Username: " << username << ", Password: " << password << endl;
+        void rescanLocked() const {
+            uploadIndex.assign(scanFolder(uploadFolder));
+            trashIndex.assign(scanFolder(trashFolder));
+            ++catalogVersion;
+        }
 
-        if (fileManager.getSessionManager().authenticate(username, password)) {
-            string redirectPage = R"(
-    <html>
-    <head>
-        <meta http-equiv="refresh" content="0;url=/">
-    </head>
-    <body>
-        <p>Login successful! Redirecting...</p>
-    </body>
-    </html>
-            )";
-            sendHttpResponse(clientSocket, 200, "text/html", redirectPage, 
-                        "Set-Cookie: session=authenticated; Path=/; HttpOnly");
-            cout << "Login successful for user: " << username << endl;
-        } else {
-            sendHttpResponse(clientSocket, 401, "text/plain", "Invalid credentials");
-            cout << "Login failed for user: " << username << endl;
+        bool statEntry(const string& path, Platform::FileInfo& info) const {
+            if (!Platform::statFile(path, info)) return false;
+            if (chunkStore) ChunkStore::manifestSize(path, info.size);
+            return true;
         }
-    }
 
-        void handleLogout(SOCKET clientSocket) {
-            string logoutPage = R"(
-    <html>
-    <head>
-        <meta http-equiv="refresh" content="2;url=/login">
-    </head>
-    <body>
-        <p>Logged out successfully. Redirecting to login page...</p>
-    </body>
-    </html>
-            )";
-            sendHttpResponse(clientSocket, 200, "text/html", logoutPage,
-                        "Set-Cookie: session=; Path=/; Expires=Thu, 01 Jan 1970 00:00:00 GMT");
+        map<string, Platform::FileInfo> scanFolder(const string& folder) const {
+            map<string, Platform::FileInfo> files = Platform::scanFiles(folder);
+            if (chunkStore) {
+                for (auto& entry : files) ChunkStore::manifestSize(folder + entry.first, entry.second.size);
+            }
+            return files;
         }
 
-        void handleGetRequest(SOCKET clientSocket, const string& path) {
-            string actualPath = (path == "/") ? "/index.html" : path;
+        // Chunks referenced from uploads/ and trash/. Read from disk rather than the catalog,
+        // which may briefly lag behind changes made outside the server; the shared lock keeps
+        // the server's own moves from hiding a manifest between the two folders.
+        void markLiveChunks(unordered_set<string>& live) const {
+            shared_lock<shared_mutex> lock(catalogMutex);
+            for (const string& folder : { uploadFolder, trashFolder }) {
+                for (const string& name : Platform::listFiles(folder)) {
+                    ChunkStore::Manifest manifest;
+                    if (!ChunkStore::readManifest(folder + name, manifest)) continue;
+                    for (const auto& chunk : manifest.chunks) live.insert(chunk.first);
+                }
+            }
+        }
 
-            if (actualPath.rfind("/list_trash", 0) == 0) {
-                string list = "=== Trash Files ===\n" + fileManager.listFilesInFolder(fileManager.getTrashFolder());
-                sendHttpResponse(clientSocket, 200, "text/plain", list);
-                return;
+        // Moves a finished staging file into uploads under filename, replacing any previous
+        // version and dropping a trashed copy of the same name.
+        bool publish(const string& stagingPath, const string& filename) const {
+            unique_lock<shared_mutex> lock(catalogMutex);
+            if (!Platform::moveFile(stagingPath, uploadFolder + filename)) return false;
+            refreshLocked(uploadIndex, uploadFolder, filename);
+            if (trashIndex.count(filename)) {
+                Platform::deleteFile(trashFolder + filename);
+                refreshLocked(trashIndex, trashFolder, filename);
             }
-            
-            if (actualPath.rfind("/list", 0) == 0) {
-                string list = "=== Server Files ===\n" + fileManager.listFilesInFolder(fileManager.getUploadFolder());
-                sendHttpResponse(clientSocket, 200, "text/plain", list);
-                return;
+            if (chunkStore) chunkStore->manifestDropped();
+            return true;
+        }
+
+        static string listIndex(const Index& index) {
+            string fileList;
+            for (const auto& entry : index.byName) {
+                fileList += entry.first + "\n";
+            }
+            return fileList.empty() ? "(none)\n" : fileList;
+        }
+
+        // '*' matches any run of characters, '?' any single one.
+        static bool globMatch(const string& pattern, const string& name) {
+            size_t p = 0, n = 0, star = string::npos, resume = 0;
+            while (n < name.size()) {
+                if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+                    ++p;
+                    ++n;
+                } else if (p < pattern.size() && pattern[p] == '*') {
+                    star = p++;
+                    resume = n;
+                } else if (star != string::npos) {
+                    p = star + 1;
+                    n = ++resume;
+                } else {
+                    return false;
+                }
             }
+            while (p < pattern.size() && pattern[p] == '*') ++p;
+            return p == pattern.size();
+        }
+
+        static bool hasPrefix(const string& name, const string& prefix) {
+            return name.compare(0, prefix.size(), prefix) == 0;
+        }
+
+        // Smallest string above every name that starts with prefix, or "" when there is none.
+        static string prefixEnd(string prefix) {
+            while (!prefix.empty() && (unsigned char)prefix.back() == 0xff) prefix.pop_back();
+            if (!prefix.empty()) prefix.back() = (char)((unsigned char)prefix.back() + 1);
+            return prefix;
+        }
+
+        // Cursors of the size and mtime orders are "<key>:<name>".
+        static string keyCursor(const Index::Key& key) {
+            return to_string(key.first) + ":" + key.second;
+        }
+
+        static bool parseKeyCursor(const string& cursor, Index::Key& key) {
+            size_t colon = cursor.find(':');
+            if (colon == string::npos || colon == 0 || colon > 20) return false;
+            char* end = nullptr;
+            key.first = strtoll(cursor.c_str(), &end, 10);
+            if (end != cursor.c_str() + colon) return false;
+            key.second = cursor.substr(colon + 1);
+            return true;
+        }
+
+        // Fills page from [it, end). In name order the walk starts inside the prefix range
+        // and stops at its end; in the other orders non-matching names are skipped. Either
+        // way at most LIST_SCAN_LIMIT entries are looked at.
+        template <typename Iterator, typename NameOf, typename CursorOf>
+        static void collect(const Index& index, Iterator it, Iterator end, const ListQuery& query,
+                            const string& prefix, bool nameOrdered, NameOf nameOf, CursorOf cursorOf,
+                            ListPage& page) {
+            auto inRange = [&](const string& name) { return !nameOrdered || hasPrefix(name, prefix); };
+            for (size_t scanned = 1; it != end && inRange(nameOf(*it)); ++it, ++scanned) {
+                const string& name = nameOf(*it);
+                if (hasPrefix(name, prefix) && (query.glob.empty() || globMatch(query.glob, name))) {
+                    page.entries.emplace_back(name, index.byName.find(name)->second);
+                }
+                if (page.entries.size() == query.limit || scanned == LIST_SCAN_LIMIT) {
+                    Iterator following = std::next(it);
+                    if (following != end && inRange(nameOf(*following))) page.next = cursorOf(*it);
+                    return;
+                }
+            }
+        }
+
+    #ifdef FTP_HAVE_INOTIFY
+        void startWatcher() {
+            inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotifyFd == -1) return;
+            const uint32_t events = IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE |
+                                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+            uploadWatch = inotify_add_watch(inotifyFd, uploadFolder.c_str(), events);
+            trashWatch = inotify_add_watch(inotifyFd, trashFolder.c_str(), events);
+            watching = true;
+            watcher = thread([this]() { watch(); });
+        }
+
+        // Applies inotify events to the catalog. A lost event queue forces a full rescan.
+        void watch() {
+            vector<char> buffer(64 * 1024);
+            while (watching) {
+                pollfd pfd = { inotifyFd, POLLIN, 0 };
+                if (poll(&pfd, 1, 500) <= 0) continue;
+                ssize_t n = read(inotifyFd, buffer.data(), buffer.size());
+                if (n <= 0) continue;
+
+                unique_lock<shared_mutex> lock(catalogMutex);
+                for (ssize_t pos = 0; pos < n;) {
+                    const inotify_event* event = (const inotify_event*)(buffer.data() + pos);
+                    pos += (ssize_t)(sizeof(inotify_event) + event->len);
+                    if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                        rescanLocked();
+                    } else if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+                        if (event->wd == uploadWatch) refreshLocked(uploadIndex, uploadFolder, event->name);
+                        else if (event->wd == trashWatch) refreshLocked(trashIndex, trashFolder, event->name);
+                    }
+                }
+            }
+        }
+    #endif
+
+    public:
+        FileManager(SessionManager& sm, bool dedup = false, const string& upload = "uploads" PATH_SEP, 
+                    const string& trash = "trash" PATH_SEP, 
+                    const string& www = "www" PATH_SEP,
+                    const string& chunks = "chunks" PATH_SEP)
+            : uploadFolder(upload), trashFolder(trash), wwwFolder(www),
+              stagingFolder(upload + ".staging" PATH_SEP), chunkFolder(chunks), sessionManager(sm), stagingCounter(0),
+              catalogVersion(0), catalogEpoch(random_device{}()) {
+            createDirectories();
+            if (dedup) {
+                chunkStore.reset(new ChunkStore(chunkFolder, [this](unordered_set<string>& live) { markLiveChunks(live); }));
+            }
+            // Anything left in staging belongs to uploads interrupted by a previous run.
+            for (const string& name : Platform::listFiles(stagingFolder)) {
+                Platform::deleteFile(stagingFolder + name);
+            }
+    #ifdef FTP_HAVE_INOTIFY
+            inotifyFd = uploadWatch = trashWatch = -1;
+            watching = false;
+            // Watch before scanning, so nothing changed in between goes unnoticed.
+            startWatcher();
+    #endif
+            {
+                unique_lock<shared_mutex> lock(catalogMutex);
+                rescanLocked();
+            }
+            if (chunkStore) chunkStore->startSweeper();
+        }
+
+        ~FileManager() {
+    #ifdef FTP_HAVE_INOTIFY
+            watching = false;
+            if (watcher.joinable()) watcher.join();
+            if (inotifyFd != -1) close(inotifyFd);
+    #endif
+            chunkStore.reset();     // its sweeper reads the folders through this object
+        }
+
+        void createDirectories() const {
+            Platform::makeDirectory(uploadFolder);
+            Platform::makeDirectory(trashFolder);
+            Platform::makeDirectory(wwwFolder);
+            Platform::makeDirectory(stagingFolder);
+        }
+
+        // Unique path an in-progress upload is written to; it is not visible in listings.
+        string newStagingPath(const string& filename) const {
+            return stagingFolder + to_string(++stagingCounter) + "-" + filename;
+        }
+
+        // Part file of a resumable upload; chunks are written into it at their offsets.
+        string chunkedUploadPath(const string& id) const {
+            return stagingFolder + "chunked-" + id;
+        }
+
+        // Whether a client-supplied name can only refer to a file directly inside uploads/.
+        static bool validName(const string& filename) {
+            return !filename.empty() && filename.find_first_of("/\\") == string::npos &&
+                   filename.find("..") == string::npos;
+        }
+
+        // Identifies one version of a file's content; changes whenever the file is replaced
+        // (new inode) or rewritten (size or mtime).
+        static string versionTag(unsigned long long fileId, long long size, long long modified) {
+            char tag[64];
+            snprintf(tag, sizeof(tag), "%llx-%llx-%llx", fileId, (unsigned long long)size, (unsigned long long)modified);
+            return tag;
+        }
+
+        // Version of the uploads and trash listings.
+        string catalogTag() const {
+            char tag[48];
+            snprintf(tag, sizeof(tag), "catalog-%llx-%llx", catalogEpoch, catalogVersion.load());
+            return tag;
+        }
+
+        // For a file in uploads/ written other than through commitUpload.
+        void uploadChanged(const string& filename) const {
+            unique_lock<shared_mutex> lock(catalogMutex);
+            refreshLocked(uploadIndex, uploadFolder, filename);
+        }
+
+        bool hasUpload(const string& filename) const {
+            shared_lock<shared_mutex> lock(catalogMutex);
+            return uploadIndex.count(filename) != 0;
+        }
+
+        bool hasTrashed(const string& filename) const {
+            shared_lock<shared_mutex> lock(catalogMutex);
+            return trashIndex.count(filename) != 0;
+        }
+
+        // Publishes a finished staging file under filename, replacing any previous version and
+        // dropping a trashed copy of the same name. In dedup mode the content goes into the
+        // chunk store and a manifest is published in its place.
+        bool commitUpload(const string& stagingPath, const string& filename) const {
+            if (!chunkStore) return publish(stagingPath, filename);
+            ChunkStore::Manifest manifest;
+            if (!chunkStore->ingest(stagingPath, manifest)) return false;
+            Platform::deleteFile(stagingPath);
+            return commitManifest(manifest, filename);
+        }
+
+        // Dedup mode: publishes a file whose chunks are all in the chunk store.
+        bool commitManifest(const ChunkStore::Manifest& manifest, const string& filename) const {
+            string path = newStagingPath(filename);
+            if (!ChunkStore::writeManifest(path, manifest)) {
+                Platform::deleteFile(path);
+                return false;
+            }
+            return publish(path, filename);
+        }
+
+        ChunkStore* getChunkStore() const { return chunkStore.get(); }
+
+        bool moveToTrash(const string& filename) const {
+            unique_lock<shared_mutex> lock(catalogMutex);
+            string sourcePath = uploadFolder + filename;
+            string trashPath = trashFolder + filename;
+
+            if (!uploadIndex.count(filename)) return false;
+
+            if (trashIndex.count(filename)) {
+                remove(trashPath.c_str());
+            }
+
+            bool moved = Platform::moveFile(sourcePath, trashPath);
+            refreshLocked(uploadIndex, uploadFolder, filename);
+            refreshLocked(trashIndex, trashFolder, filename);
+            if (chunkStore) chunkStore->manifestDropped();
+            return moved;
+        }
+
+        bool restoreFromTrash(const string& filename) const {
+            unique_lock<shared_mutex> lock(catalogMutex);
+            bool moved = Platform::moveFile(trashFolder + filename, uploadFolder + filename);
+            refreshLocked(uploadIndex, uploadFolder, filename);
+            refreshLocked(trashIndex, trashFolder, filename);
+            return moved;
+        }
+
+        bool deleteFromTrash(const string& filename) const {
+            unique_lock<shared_mutex> lock(catalogMutex);
+            bool deleted = Platform::deleteFile(trashFolder + filename);
+            refreshLocked(trashIndex, trashFolder, filename);
+            if (chunkStore) chunkStore->manifestDropped();
+            return deleted;
+        }
+
+        int emptyTrash() const {
+            unique_lock<shared_mutex> lock(catalogMutex);
+            int deletedCount = 0;
+            map<string, Platform::FileInfo> trashed;
+            trashed.swap(trashIndex.byName);
+            trashIndex.clear();
+            for (const auto& entry : trashed) {
+                if (Platform::deleteFile(trashFolder + entry.first)) deletedCount++;
+                else refreshLocked(trashIndex, trashFolder, entry.first);
+            }
+            ++catalogVersion;
+            if (chunkStore) chunkStore->manifestDropped();
+            return deletedCount;
+        }
+
+        // The user "username password" logs in as, or "" if the credentials are wrong.
+        string authenticateClient(const string& credentials) {
+            istringstream iss(credentials);
+            string username, password;
+            iss >> username >> password;
+            return sessionManager.authenticate(username, password) ? username : "";
+        }
+
+        string listUploads() const {
+            shared_lock<shared_mutex> lock(catalogMutex);
+            return listIndex(uploadIndex);
+        }
+
+        string listTrash() const {
+            shared_lock<shared_mutex> lock(catalogMutex);
+            return listIndex(trashIndex);
+        }
+
+        // A page of uploads or trash in the requested order. Only the entries on the page (plus
+        // those a filter skips) are visited, so deep pages cost the same as the first.
+        // Returns false for a cursor that doesn't belong to the sort order.
+        bool listPage(bool trash, const ListQuery& query, ListPage& page) const {
+            shared_lock<shared_mutex> lock(catalogMutex);
+            const Index& index = trash ? trashIndex : uploadIndex;
+            page = ListPage();
+            page.total = index.byName.size();
+            if (query.limit == 0) return true;
+
+            if (query.sort == ListQuery::NAME) {
+                // The glob's literal lead narrows the name range just like a prefix does.
+                string prefix = query.prefix;
+                string lead = query.glob.substr(0, query.glob.find_first_of("*?"));
+                if (hasPrefix(lead, prefix)) prefix = lead;
+                else if (!hasPrefix(prefix, lead)) return true;
+
+                const auto& names = index.byName;
+                auto nameOf = [](const pair<const string, Platform::FileInfo>& entry) -> const string& { return entry.first; };
+                auto cursorOf = [](const pair<const string, Platform::FileInfo>& entry) { return entry.first; };
+                if (!query.descending) {
+                    auto from = names.lower_bound(prefix);
+                    if (!query.after.empty() && query.after >= prefix) from = names.upper_bound(query.after);
+                    collect(index, from, names.end(), query, prefix, true, nameOf, cursorOf, page);
+                } else {
+                    string limit = prefixEnd(prefix);
+                    auto to = limit.empty() ? names.end() : names.lower_bound(limit);
+                    if (!query.after.empty() && (limit.empty() || query.after < limit)) to = names.lower_bound(query.after);
+                    collect(index, make_reverse_iterator(to), names.rend(), query, prefix, true, nameOf, cursorOf, page);
+                }
+                return true;
+            }
+
+            const set<Index::Key>& keys = query.sort == ListQuery::SIZE ? index.bySize : index.byModified;
+            Index::Key after;
+            if (!query.after.empty() && !parseKeyCursor(query.after, after)) return false;
+            auto nameOf = [](const Index::Key& key) -> const string& { return key.second; };
+            if (!query.descending) {
+                auto from = query.after.empty() ? keys.begin() : keys.upper_bound(after);
+                collect(index, from, keys.end(), query, query.prefix, false, nameOf, keyCursor, page);
+            } else {
+                auto to = query.after.empty() ? keys.end() : keys.lower_bound(after);
+                collect(index, make_reverse_iterator(to), keys.rend(), query, query.prefix, false, nameOf, keyCursor, page);
+            }
+            return true;
+        }
+
+        string getUploadFolder() const { return uploadFolder; }
+        string getTrashFolder() const { return trashFolder; }
+        string getWwwFolder() const { return wwwFolder; }
+        SessionManager& getSessionManager() const { return sessionManager; }
+    };
+
+    // Resumable uploads assembled in place. Each upload, named by a client-chosen id, owns one
+    // staging file that chunks are written into at their offsets, possibly in parallel. The
+    // byte ranges received so far are tracked so a client can ask what is still missing after
+    // a disconnect. Once every byte has arrived the file is renamed into uploads in one step.
+    class ChunkedUploadManager {
+    public:
+        typedef pair<long long, long long> Range;   // offset, length
+
+        struct Status {
+            string filename;
+            long long size;
+            long long received;
+            vector<Range> missing;
+        };
+
+    private:
+        static const int ABANDONED_SECONDS = 24 * 60 * 60;
+
+        struct Upload {
+            string filename;
+            long long size;
+            string path;
+            map<long long, long long> received;   // start -> end (exclusive), disjoint
+            chrono::steady_clock::time_point touched;
+            shared_ptr<const void> writers;     // one further reference per chunk being written
+            bool committing = false;            // being published, outside the lock
+        };
+
+        FileManager& fileManager;
+        mutex uploadsMutex;
+        map<string, Upload> uploads;
+
+        static bool validId(const string& id) {
+            if (id.empty() || id.size() > 64) return false;
+            for (char c : id) {
+                if (!isalnum((unsigned char)c) && c != '-' && c != '_') return false;
+            }
+            return true;
+        }
+
+        static Status describe(const Upload& upload) {
+            Status status;
+            status.filename = upload.filename;
+            status.size = upload.size;
+            status.received = 0;
+            long long next = 0;
+            for (const auto& range : upload.received) {
+                if (range.first > next) status.missing.push_back(Range(next, range.first - next));
+                status.received += range.second - range.first;
+                next = range.second;
+            }
+            if (next < upload.size) status.missing.push_back(Range(next, upload.size - next));
+            return status;
+        }
+
+        void dropAbandoned(chrono::steady_clock::time_point now) {
+            for (auto it = uploads.begin(); it != uploads.end();) {
+                if (!it->second.committing && now - it->second.touched > chrono::seconds(ABANDONED_SECONDS)) {
+                    Platform::deleteFile(it->second.path);
+                    it = uploads.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+    public:
+        explicit ChunkedUploadManager(FileManager& fm) : fileManager(fm) {}
+
+        // Creates the upload, or resumes it when id already names the same file and size.
+        // Returns 200, 400 for bad arguments, 409 if id is taken by a different file, or 500.
+        int start(const string& id, const string& filename, long long size, Status& status) {
+            if (!validId(id) || !FileManager::validName(filename) || size < 0) return 400;
+            lock_guard<mutex> lock(uploadsMutex);
+            auto now = chrono::steady_clock::now();
+            dropAbandoned(now);
+
+            auto it = uploads.find(id);
+            if (it != uploads.end()) {
+                if (it->second.filename != filename || it->second.size != size) return 409;
+                it->second.touched = now;
+                status = describe(it->second);
+                return 200;
+            }
+
+            Upload upload;
+            upload.filename = filename;
+            upload.size = size;
+            upload.path = fileManager.chunkedUploadPath(id);
+            upload.touched = now;
+            upload.writers = make_shared<char>(0);
+            int fd = Platform::createFile(upload.path);
+            if (fd == -1) return 500;
+            Platform::closeFile(fd);
+            status = describe(upload);
+            uploads[id] = upload;
+            return 200;
+        }
+
+        // Checks a chunk against the upload and yields the file it is to be written into, plus
+        // a mark the writer holds until its file is closed. Returns 200, 400 for a malformed
+        // offset or length, 404 for an unknown id, 409 while the upload is being committed or
+        // 416 when the chunk lies outside the file.
+        int beginChunk(const string& id, long long offset, long long length, string& path, shared_ptr<const void>& writer) {
+            if (offset < 0 || length < 0) return 400;
+            lock_guard<mutex> lock(uploadsMutex);
+            auto it = uploads.find(id);
+            if (it == uploads.end()) return 404;
+            if (it->second.committing) return 409;
+            if (offset + length > it->second.size) return 416;
+            it->second.touched = chrono::steady_clock::now();
+            path = it->second.path;
+            writer = it->second.writers;
+            return 200;
+        }
+
+        // Marks a fully written chunk as received, merging it with neighbouring ranges.
+        bool recordChunk(const string& id, long long offset, long long length, Status& status) {
+            lock_guard<mutex> lock(uploadsMutex);
+            auto it = uploads.find(id);
+            if (it == uploads.end()) return false;
+            Upload& upload = it->second;
+            upload.touched = chrono::steady_clock::now();
+
+            long long start = offset;
+            long long end = offset + length;
+            if (end > start) {
+                auto next = upload.received.upper_bound(start);
+                if (next != upload.received.begin()) {
+                    auto prev = std::prev(next);
+                    if (prev->second >= start) {
+                        start = prev->first;
+                        end = max(end, prev->second);
+                        next = upload.received.erase(prev);
+                    }
+                }
+                while (next != upload.received.end() && next->first <= end) {
+                    end = max(end, next->second);
+                    next = upload.received.erase(next);
+                }
+                upload.received[start] = end;
+            }
+            status = describe(upload);
+            return true;
+        }
+
+        bool status(const string& id, Status& status) {
+            lock_guard<mutex> lock(uploadsMutex);
+            auto it = uploads.find(id);
+            if (it == uploads.end()) return false;
+            status = describe(it->second);
+            return true;
+        }
+
+        // Publishes a complete upload. Returns 200, 404, 409 while ranges are missing, a chunk
+        // is still being written into the file or another commit is under way, or 500. The
+        // publish itself (in dedup mode, hashing the whole file) runs without the lock held;
+        // the upload is marked so nothing else touches it meanwhile.
+        int commit(const string& id, Status& status) {
+            string path, filename;
+            {
+                lock_guard<mutex> lock(uploadsMutex);
+                auto it = uploads.find(id);
+                if (it == uploads.end()) return 404;
+                status = describe(it->second);
+                if (!status.missing.empty() || it->second.writers.use_count() > 1 || it->second.committing) return 409;
+                it->second.committing = true;
+                path = it->second.path;
+                filename = it->second.filename;
+            }
+
+            bool published = fileManager.commitUpload(path, filename);
+            lock_guard<mutex> lock(uploadsMutex);
+            auto it = uploads.find(id);
+            if (!published) {
+                if (it != uploads.end()) it->second.committing = false;
+                return 500;
+            }
+            if (it != uploads.end()) uploads.erase(it);
+            return 200;
+        }
+
+        // False for an unknown id, or one that is being committed.
+        bool abort(const string& id) {
+            lock_guard<mutex> lock(uploadsMutex);
+            auto it = uploads.find(id);
+            if (it == uploads.end() || it->second.committing) return false;
+            Platform::deleteFile(it->second.path);
+            uploads.erase(it);
+            return true;
+        }
+    };
+
+    class NetworkManager {
+    private:
+        static const int BUFFER_SIZE = 8192;
+
+    public:
+        static const int MAX_GATHER = 16;
+
+        // Lengths are 64-bit; each send()/recv() call is capped to what an int can describe.
+        static long long sendAll(SOCKET sock, const char* data, long long len) {
+            long long total = 0;
+            while (total < len) {
+                int sent = send(sock, data + total, (int)min(len - total, (long long)INT_MAX), MSG_NOSIGNAL);
+                if (sent == SOCKET_ERROR) return SOCKET_ERROR;
+                total += sent;
+            }
+            return total;
+        }
+
+        static long long recvAll(SOCKET sock, char* buffer, long long expected) {
+            long long total = 0;
+            while (total < expected) {
+                int r = recv(sock, buffer + total, (int)min(expected - total, (long long)INT_MAX), 0);
+                if (r <= 0) return total;
+                total += r;
+            }
+            return total;
+        }
+
+        // Non-blocking variants used by the event loop: > 0 bytes moved, 0 peer closed (recv only),
+        // IO_WOULD_BLOCK when the socket is not ready, IO_ERROR on a hard failure.
+        static const int IO_WOULD_BLOCK = -1;
+        static const int IO_ERROR = -2;
+
+        static int recvSome(SOCKET sock, char* buffer, int len) {
+            int r = recv(sock, buffer, len, 0);
+            if (r >= 0) return r;
+            return Platform::wouldBlock(Platform::lastSocketError()) ? IO_WOULD_BLOCK : IO_ERROR;
+        }
+
+        static int sendSome(SOCKET sock, const char* data, int len) {
+            int sent = send(sock, data, len, MSG_NOSIGNAL);
+            if (sent >= 0) return sent;
+            return Platform::wouldBlock(Platform::lastSocketError()) ? IO_WOULD_BLOCK : IO_ERROR;
+        }
+
+        // Sends several buffers with one call, like writev(); returns what sendSome does.
+        static int sendGathered(SOCKET sock, const pair<const char*, size_t>* parts, int count) {
+    #ifdef _WIN32
+            WSABUF buffers[MAX_GATHER];
+            for (int i = 0; i < count; ++i) {
+                buffers[i].buf = (char*)parts[i].first;
+                buffers[i].len = (ULONG)parts[i].second;
+            }
+            DWORD sent = 0;
+            if (WSASend(sock, buffers, (DWORD)count, &sent, 0, NULL, NULL) == 0) return (int)sent;
+    #else
+            iovec buffers[MAX_GATHER];
+            for (int i = 0; i < count; ++i) {
+                buffers[i].iov_base = (void*)parts[i].first;
+                buffers[i].iov_len = parts[i].second;
+            }
+            msghdr msg = {};
+            msg.msg_iov = buffers;
+            msg.msg_iovlen = (size_t)count;
+            ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+            if (sent >= 0) return (int)sent;
+    #endif
+            return Platform::wouldBlock(Platform::lastSocketError()) ? IO_WOULD_BLOCK : IO_ERROR;
+        }
+
+        static int bufferSize() { return BUFFER_SIZE; }
+    };
+
+    // Streaming compression for transfers: gzip through zlib and zstd through libzstd, each
+    // available when the server is built with it (FTP_WITH_ZLIB / FTP_WITH_ZSTD). Also keeps
+    // the process-wide share of CPU time spent compressing, which adaptive levels back off on.
+    class Compression {
+    public:
+        enum Codec { NONE = 0, GZIP = 1, ZSTD = 2 };
+
+    private:
+        inline static atomic<long long> busyNanos{0};
+        inline static atomic<long long> windowStart{0};
+        inline static atomic<int> loadPercent{0};
+
+    public:
+        static const char* name(Codec codec) {
+            return codec == GZIP ? "gzip" : codec == ZSTD ? "zstd" : "identity";
+        }
+
+        static Codec fromName(const string& name) {
+            if (name == "gzip" || name == "x-gzip") return available(GZIP) ? GZIP : NONE;
+            if (name == "zstd") return available(ZSTD) ? ZSTD : NONE;
+            return NONE;
+        }
+
+        static bool available(Codec codec) {
+    #ifdef FTP_HAVE_ZLIB
+            if (codec == GZIP) return true;
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+            if (codec == ZSTD) return true;
+    #endif
+    #if !defined(FTP_HAVE_ZLIB) && !defined(FTP_HAVE_ZSTD)
+            (void)codec;
+    #endif
+            return false;
+        }
+
+        static bool enabled() { return available(GZIP) || available(ZSTD); }
+
+        // Whether an Accept-Encoding value allows coding; "q=0" refuses it, "*" stands for
+        // anything not listed. Scanned in place; it runs for every static file served.
+        static bool accepts(string_view header, string_view coding) {
+            int explicitly = -1, wildcard = -1;
+            while (!header.empty()) {
+                size_t comma = header.find(',');
+                string_view item = header.substr(0, comma);
+                header.remove_prefix(comma == string_view::npos ? header.size() : comma + 1);
+
+                size_t semi = item.find(';');
+                string_view name = item.substr(0, semi);
+                while (!name.empty() && (name.front() == ' ' || name.front() == '\t')) name.remove_prefix(1);
+                while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) name.remove_suffix(1);
+
+                bool allowed = true;
+                size_t q = semi == string_view::npos ? string_view::npos : item.find("q=", semi);
+                if (q != string_view::npos) {
+                    // q-values are at most "1.000"; zero in any spelling refuses.
+                    allowed = false;
+                    for (size_t i = q + 2; i < item.size() && (isdigit((unsigned char)item[i]) || item[i] == '.'); ++i) {
+                        if (item[i] >= '1' && item[i] <= '9') allowed = true;
+                    }
+                }
+                if (sameToken(name, coding)) explicitly = allowed;
+                else if (name == "*") wildcard = allowed;
+            }
+            return explicitly != -1 ? explicitly == 1 : wildcard == 1;
+        }
+
+        static bool sameToken(string_view a, string_view b) {
+            if (a.size() != b.size()) return false;
+            for (size_t i = 0; i < a.size(); ++i) {
+                if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+            }
+            return true;
+        }
+
+        // The codec to answer an Accept-Encoding value (or a command's codec list) with;
+        // zstd is preferred for its speed at a given ratio.
+        static Codec negotiate(const string& acceptEncoding) {
+            if (acceptEncoding.empty()) return NONE;
+            if (available(ZSTD) && accepts(acceptEncoding, "zstd")) return ZSTD;
+            if (available(GZIP) && accepts(acceptEncoding, "gzip")) return GZIP;
+            return NONE;
+        }
+
+        // Adds compression time to the process-wide tally; every second or so the share of
+        // all cores it took is published through load().
+        static void recordBusy(chrono::steady_clock::duration busy) {
+            long long now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+            busyNanos += chrono::duration_cast<chrono::nanoseconds>(busy).count();
+            long long start = windowStart;
+            if (now - start >= 1000000000LL && windowStart.compare_exchange_strong(start, now)) {
+                long long cores = max(1u, thread::hardware_concurrency());
+                long long elapsed = start == 0 ? 1000000000LL : now - start;
+                loadPercent = (int)min(100LL, busyNanos.exchange(0) * 100 / (elapsed * cores));
+            }
+        }
+
+        // Percent of the machine's CPU time recently spent compressing.
+        static int load() { return loadPercent; }
+
+        // One compressed stream. The level may change between updates: gzip switches in
+        // place, zstd closes the current frame and starts the next at the new level (zstd
+        // decoders read concatenated frames as one stream).
+        class Encoder {
+        private:
+            static const size_t SLICE = 64 * 1024;
+
+            Codec codec;
+            int level;
+            int nextLevel;
+    #ifdef FTP_HAVE_ZLIB
+            z_stream zs;
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+            ZSTD_CCtx* cctx;
+    #endif
+
+    #ifdef FTP_HAVE_ZSTD
+            bool zstdRun(ZSTD_inBuffer& in, ZSTD_EndDirective mode, string& out) {
+                while (true) {
+                    size_t old = out.size();
+                    out.resize(old + ZSTD_CStreamOutSize());
+                    ZSTD_outBuffer buffer = { &out[old], ZSTD_CStreamOutSize(), 0 };
+                    size_t remaining = ZSTD_compressStream2(cctx, &buffer, &in, mode);
+                    out.resize(old + buffer.pos);
+                    if (ZSTD_isError(remaining)) return false;
+                    if (mode == ZSTD_e_end ? remaining == 0 : in.pos == in.size) return true;
+                }
+            }
+    #endif
+
+        public:
+            Encoder() : codec(NONE), level(0), nextLevel(0) {
+    #ifdef FTP_HAVE_ZLIB
+                zs = z_stream();
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+                cctx = nullptr;
+    #endif
+            }
+            Encoder(const Encoder&) = delete;
+            Encoder& operator=(const Encoder&) = delete;
+
+            ~Encoder() {
+    #ifdef FTP_HAVE_ZLIB
+                if (codec == GZIP) deflateEnd(&zs);
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+                if (cctx) ZSTD_freeCCtx(cctx);
+    #endif
+            }
+
+            static int minLevel(Codec) { return 1; }
+            static int maxLevel(Codec c) { return c == ZSTD ? 12 : 9; }
+            static int defaultLevel(Codec c) { return c == ZSTD ? 3 : 6; }
+
+            bool begin(Codec c, int startLevel) {
+                level = nextLevel = startLevel;
+    #ifdef FTP_HAVE_ZLIB
+                if (c == GZIP) {
+                    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+                    codec = c;
+                    return true;
+                }
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+                if (c == ZSTD) {
+                    cctx = ZSTD_createCCtx();
+                    if (!cctx || ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level))) return false;
+                    codec = c;
+                    return true;
+                }
+    #endif
+    #if !defined(FTP_HAVE_ZLIB) && !defined(FTP_HAVE_ZSTD)
+                (void)c;
+    #endif
+                return false;
+            }
+
+            int currentLevel() const { return nextLevel; }
+            void setLevel(int newLevel) { nextLevel = newLevel; }
+
+            // Appends the compressed form of len bytes to out; last ends the stream.
+            bool update(const char* data, size_t len, bool last, string& out) {
+    #ifdef FTP_HAVE_ZLIB
+                if (codec == GZIP) {
+                    zs.next_in = (Bytef*)data;
+                    zs.avail_in = (uInt)len;
+                    bool retune = nextLevel != level;
+                    while (true) {
+                        size_t old = out.size();
+                        out.resize(old + SLICE);
+                        zs.next_out = (Bytef*)&out[old];
+                        zs.avail_out = (uInt)SLICE;
+                        int rc = retune ? deflateParams(&zs, nextLevel, Z_DEFAULT_STRATEGY)
+                                        : deflate(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+                        out.resize(old + SLICE - zs.avail_out);
+                        if (rc == Z_STREAM_ERROR) return false;
+                        if (retune) {
+                            // deflateParams flushes what came before; it asks again while out of room.
+                            if (rc == Z_BUF_ERROR && zs.avail_out == 0) continue;
+                            level = nextLevel;
+                            retune = false;
+                            continue;
+                        }
+                        if (last ? rc == Z_STREAM_END : zs.avail_in == 0 && zs.avail_out != 0) return true;
+                    }
+                }
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+                if (codec == ZSTD) {
+                    if (nextLevel != level) {
+                        ZSTD_inBuffer none = { nullptr, 0, 0 };
+                        if (!zstdRun(none, ZSTD_e_end, out)) return false;
+                        if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, nextLevel))) return false;
+                        level = nextLevel;
+                    }
+                    ZSTD_inBuffer in = { data, len, 0 };
+                    return zstdRun(in, last ? ZSTD_e_end : ZSTD_e_continue, out);
+                }
+    #endif
+                (void)data;
+                (void)len;
+                (void)last;
+                (void)out;
+                return false;
+            }
+        };
+
+        // The inverse of Encoder, for compressed uploads. Output is handed to a callback in
+        // pieces, so a small compressed body can't make it hold much memory.
+        class Decoder {
+        private:
+            Codec codec;
+            bool ended;         // a complete stream has been read
+            vector<char> buffer;
+    #ifdef FTP_HAVE_ZLIB
+            z_stream zs;
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+            ZSTD_DCtx* dctx;
+    #endif
+
+        public:
+            typedef function<bool(const char*, size_t)> Sink;
+
+            Decoder() : codec(NONE), ended(false) {
+    #ifdef FTP_HAVE_ZLIB
+                zs = z_stream();
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+                dctx = nullptr;
+    #endif
+            }
+            Decoder(const Decoder&) = delete;
+            Decoder& operator=(const Decoder&) = delete;
+
+            ~Decoder() {
+    #ifdef FTP_HAVE_ZLIB
+                if (codec == GZIP) inflateEnd(&zs);
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+                if (dctx) ZSTD_freeDCtx(dctx);
+    #endif
+            }
+
+            bool begin(Codec c) {
+                buffer.resize(64 * 1024);
+    #ifdef FTP_HAVE_ZLIB
+                if (c == GZIP) {
+                    if (inflateInit2(&zs, 15 + 16) != Z_OK) return false;
+                    codec = c;
+                    return true;
+                }
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+                if (c == ZSTD) {
+                    dctx = ZSTD_createDCtx();
+                    if (!dctx) return false;
+                    codec = c;
+                    return true;
+                }
+    #endif
+    #if !defined(FTP_HAVE_ZLIB) && !defined(FTP_HAVE_ZSTD)
+                (void)c;
+    #endif
+                return false;
+            }
+
+            // True once the input seen so far forms a complete stream.
+            bool finished() const { return ended; }
+
+            // Decompresses len bytes into sink; false on corrupt input, bytes past the end of
+            // the stream, or when sink refuses.
+            bool update(const char* data, size_t len, const Sink& sink) {
+    #ifdef FTP_HAVE_ZLIB
+                if (codec == GZIP) {
+                    zs.next_in = (Bytef*)data;
+                    zs.avail_in = (uInt)len;
+                    bool more = len > 0;
+                    while (more) {
+                        if (ended) return false;
+                        zs.next_out = (Bytef*)buffer.data();
+                        zs.avail_out = (uInt)buffer.size();
+                        int rc = inflate(&zs, Z_NO_FLUSH);
+                        if (rc == Z_BUF_ERROR && zs.avail_in == 0) break;   // drained; needs more input
+                        if (rc != Z_OK && rc != Z_STREAM_END) return false;
+                        size_t produced = buffer.size() - zs.avail_out;
+                        if (produced > 0 && !sink(buffer.data(), produced)) return false;
+                        ended = rc == Z_STREAM_END;
+                        // A full buffer may leave output behind even once the input is used up.
+                        more = zs.avail_in > 0 || (!ended && zs.avail_out == 0);
+                    }
+                    return true;
+                }
+    #endif
+    #ifdef FTP_HAVE_ZSTD
+                if (codec == ZSTD) {
+                    ZSTD_inBuffer in = { data, len, 0 };
+                    bool more = len > 0;
+                    while (more) {
+                        ZSTD_outBuffer out = { buffer.data(), buffer.size(), 0 };
+                        size_t hint = ZSTD_decompressStream(dctx, &out, &in);
+                        if (ZSTD_isError(hint)) return false;
+                        if (out.pos > 0 && !sink(buffer.data(), out.pos)) return false;
+                        // 0 means a frame just ended with all of its output delivered.
+                        ended = hint == 0;
+                        more = in.pos < in.size || out.pos == out.size;
+                    }
+                    return true;
+                }
+    #endif
+                (void)data;
+                (void)len;
+                (void)sink;
+                return false;
+            }
+        };
+    };
+
+    // Size-classed free lists of byte buffers for response bytes and connection input, kept
+    // per worker thread so taking and returning one needs no lock. Classes grow by 4x from
+    // 256 bytes to 256 KiB; a returned buffer joins the largest class its capacity covers.
+    // Once the lists are warm, steady traffic reuses buffers instead of allocating them;
+    // tests/alloc_test.sh checks that cached pages and assets are then served without any.
+    class BufferPool {
+    private:
+        static const size_t MIN_CLASS_BYTES = 256;
+        static const int CLASSES = 6;
+        static const size_t MAX_FREE = 64;          // buffers kept per class and thread
+
+        struct Lists {
+            vector<string> free[CLASSES];
+            Lists() {
+                for (vector<string>& list : free) list.reserve(MAX_FREE);
+            }
+        };
+
+        inline static atomic<long long> reused{0};
+        inline static atomic<long long> allocated{0};
+
+        static Lists& lists() {
+            thread_local Lists perThread;
+            return perThread;
+        }
+
+        static size_t classBytes(int c) { return MIN_CLASS_BYTES << (2 * c); }
+
+    public:
+        // An empty string with room for at least size bytes.
+        static string acquire(size_t size) {
+            string buffer;
+            int c = 0;
+            while (c < CLASSES && classBytes(c) < size) ++c;
+            if (c == CLASSES) {
+                buffer.reserve(size);       // larger than any class; not pooled
+                return buffer;
+            }
+            vector<string>& list = lists().free[c];
+            if (!list.empty()) {
+                buffer = move(list.back());
+                list.pop_back();
+                reused.fetch_add(1, memory_order_relaxed);
+                return buffer;
+            }
+            buffer.reserve(classBytes(c));
+            allocated.fetch_add(1, memory_order_relaxed);
+            return buffer;
+        }
+
+        // Takes buffer's storage for reuse when its class has room; buffer is left empty
+        // either way.
+        static void release(string& buffer) {
+            if (buffer.capacity() < MIN_CLASS_BYTES) return;
+            int c = 0;
+            while (c + 1 < CLASSES && classBytes(c + 1) <= buffer.capacity()) ++c;
+            vector<string>& list = lists().free[c];
+            if (list.size() < MAX_FREE) {
+                buffer.clear();
+                list.push_back(move(buffer));
+            }
+            string().swap(buffer);
+        }
+
+        static string report() {
+            return "buffer pool: " + to_string(reused.load()) + " reused, " + to_string(allocated.load()) + " allocated\n";
+        }
+    };
+
+    class CompressedBody;
+
+    // A piece of pending response output: in-memory bytes (owned, or shared with a cache), a
+    // byte range of an open file that is read lazily as the socket drains, or a compressed
+    // body whose next block is made into data each time the previous one is out. Owns fileFd.
+    struct OutputSegment {
+        string data;
+        shared_ptr<const string> shared;    // sent instead of data when set
+        size_t offset = 0;
+        int fileFd = -1;
+        string filePath;                    // file queued by path, opened by openFile()
+        long long fileOffset = 0;
+        long long fileRemaining = 0;
+        shared_ptr<CompressedBody> encoder;
+
+        OutputSegment() {}
+        OutputSegment(const OutputSegment&) = delete;
+        OutputSegment& operator=(const OutputSegment&) = delete;
+
+        OutputSegment(OutputSegment&& other) noexcept
+            : data(move(other.data)), shared(move(other.shared)), offset(other.offset), fileFd(other.fileFd),
+              filePath(move(other.filePath)), fileOffset(other.fileOffset), fileRemaining(other.fileRemaining),
+              encoder(move(other.encoder)) {
+            other.fileFd = -1;
+        }
+
+        OutputSegment& operator=(OutputSegment&& other) noexcept {
+            if (this != &other) {
+                if (fileFd != -1) Platform::closeFile(fileFd);
+                BufferPool::release(data);
+                data = move(other.data);
+                shared = move(other.shared);
+                offset = other.offset;
+                fileFd = other.fileFd;
+                filePath = move(other.filePath);
+                fileOffset = other.fileOffset;
+                fileRemaining = other.fileRemaining;
+                encoder = move(other.encoder);
+                other.fileFd = -1;
+            }
+            return *this;
+        }
+
+        ~OutputSegment() {
+            if (fileFd != -1) Platform::closeFile(fileFd);
+            BufferPool::release(data);
+        }
+
+        bool isFile() const { return fileFd != -1 || !filePath.empty(); }
+        // Complete bytes that can be gathered with their neighbours into one send.
+        bool inMemory() const { return !isFile() && !encoder; }
+
+        // A file queued by path is opened only once it reaches the front of the queue, so a
+        // body made of many files holds one descriptor at a time. False if it can't be read.
+        bool openFile() {
+            if (fileFd != -1 || filePath.empty()) return true;
+            long long size = 0;
+            fileFd = Platform::openFileForRead(filePath, size);
+            return fileFd != -1 && size >= fileOffset + fileRemaining;
+        }
+
+        const char* bytes() const { return shared ? shared->data() : data.data(); }
+        size_t size() const { return shared ? shared->size() : data.size(); }
+    };
+
+    // The output queue of a connection. Segments live in storage that never moves or shrinks
+    // - an in-flight io_uring send may point into one - and a ring of pointers orders them,
+    // so queueing responses doesn't allocate once the connection has seen its deepest queue.
+    // Popping a segment releases its file and buffer right away.
+    class SegmentQueue {
+    private:
+        deque<OutputSegment> storage;       // grows at the back only, so elements stay put
+        vector<OutputSegment*> spare;
+        vector<OutputSegment*> ring;
+        size_t head = 0;
+        size_t count = 0;
+
+        void grow() {
+            vector<OutputSegment*> larger(max((size_t)4, ring.size() * 2));
+            for (size_t i = 0; i < count; ++i) larger[i] = ring[(head + i) % ring.size()];
+            ring.swap(larger);
+            head = 0;
+        }
+
+    public:
+        bool empty() const { return count == 0; }
+        size_t size() const { return count; }
+        OutputSegment& front() { return *ring[head]; }
+        OutputSegment& operator[](size_t i) { return *ring[(head + i) % ring.size()]; }
+        const OutputSegment& operator[](size_t i) const { return *ring[(head + i) % ring.size()]; }
+
+        void push_back(OutputSegment&& seg) {
+            if (count == ring.size()) grow();
+            OutputSegment* slot;
+            if (spare.empty()) {
+                storage.emplace_back();
+                slot = &storage.back();
+            } else {
+                slot = spare.back();
+                spare.pop_back();
+            }
+            *slot = move(seg);
+            ring[(head + count) % ring.size()] = slot;
+            ++count;
+        }
+
+        void pop_front() {
+            *ring[head] = OutputSegment();
+            spare.push_back(ring[head]);
+            head = (head + 1) % ring.size();
+            --count;
+        }
+    };
+
+    // Streams one upload body to a staging file through a fixed-size buffer, so memory per
+    // upload stays constant whatever its size. Accepts exactly the declared length; a write
+    // error is latched so the caller can fail the request immediately. Unless finish()
+    // succeeds, the staging file is removed on destruction.
+    class UploadSink {
+    private:
+        static const size_t BUFFER_BYTES = 256 * 1024;
+
+        int fd;
+        string path;
+        vector<char> buffer;
+        size_t buffered;
+        long long expected;
+        long long received;
+        bool failed;
+        bool finished;
+        bool ownsFile;      // a staging file of its own, as opposed to a slice of a shared one
+        shared_ptr<const void> writer;  // marks a resumable upload as being written until closed
+
+        bool flush() {
+            if (buffered > 0 && !Platform::writeFile(fd, buffer.data(), buffered)) failed = true;
+            buffered = 0;
+            return !failed;
+        }
+
+    public:
+        UploadSink() : fd(-1), buffered(0), expected(0), received(0), failed(false), finished(false), ownsFile(true) {}
+
+        ~UploadSink() {
+            if (fd != -1) Platform::closeFile(fd);
+            if (ownsFile && !finished && !path.empty()) Platform::deleteFile(path);
+        }
+
+        bool open(const string& stagingPath, long long contentLength) {
+            path = stagingPath;
+            expected = contentLength;
+            fd = Platform::createFile(path);
+            if (fd == -1) return false;
+            buffer.resize(BUFFER_BYTES);
+            return true;
+        }
+
+        // Writes length bytes into an existing file starting at offset. The file belongs to
+        // the caller and is left in place whatever happens; writerMark is held until it is closed.
+        bool openAt(const string& filePath, long long offset, long long length, shared_ptr<const void> writerMark) {
+            path = filePath;
+            expected = length;
+            ownsFile = false;
+            writer = move(writerMark);
+            fd = Platform::openFileForWriteAt(path, offset);
+            if (fd == -1) return false;
+            buffer.resize(BUFFER_BYTES);
+            return true;
+        }
+
+        // Takes at most the bytes still missing from the body; returns how many were taken.
+        size_t write(const char* data, size_t len) {
+            size_t take = (size_t)min((long long)len, expected - received);
+            size_t done = 0;
+            while (done < take && !failed) {
+                size_t n = min(take - done, BUFFER_BYTES - buffered);
+                memcpy(buffer.data() + buffered, data + done, n);
+                buffered += n;
+                done += n;
+                if (buffered == BUFFER_BYTES) flush();
+            }
+            received += (long long)take;
+            return take;
+        }
+
+        bool complete() const { return received == expected; }
+        long long length() const { return expected; }
+        bool hasFailed() const { return failed; }
+        const string& stagingPath() const { return path; }
+
+        // Flushes and closes the staging file; the caller then commits or discards it.
+        bool finish() {
+            flush();
+            Platform::closeFile(fd);
+            fd = -1;
+            writer.reset();
+            finished = !failed;
+            return finished;
+        }
+    };
+
+    // One request head as parsed by HttpParser. The views point into the connection's input
+    // buffer and are only valid until the request is consumed from it.
+    struct HttpRequest {
+        struct Header {
+            string_view name;
+            string_view value;      // without surrounding whitespace
+        };
+
+        string_view method;
+        string_view target;
+        string_view version;
+        vector<Header> headers;
+        string_view head;           // request line through the blank line
+        string_view body;           // set once the whole Content-Length body is buffered
+        long long contentLength = -1;   // -1 when absent
+
+        static bool equalsIgnoreCase(string_view a, string_view b) {
+            if (a.size() != b.size()) return false;
+            for (size_t i = 0; i < a.size(); ++i) {
+                if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+            }
+            return true;
+        }
+
+        // The first header with this name, compared without regard to case; empty if absent.
+        string_view header(string_view name) const {
+            for (const Header& h : headers) {
+                if (equalsIgnoreCase(h.name, name)) return h.value;
+            }
+            return string_view();
+        }
+
+        bool http11() const { return version == "HTTP/1.1"; }
+    };
+
+    // Incremental HTTP/1.x request-head parser. Each feed() resumes where the last one stopped,
+    // so every byte of a head is scanned once however the request is split across reads. The
+    // scan finds line ends, the first colon of each line and forbidden control bytes together,
+    // 16 bytes at a time where SSE2 is available. Positions are kept as offsets until the
+    // head is complete because the buffer may move as it grows.
+    class HttpParser {
+    public:
+        enum Status { INCOMPLETE, COMPLETE, INVALID };
+
+    private:
+        static const size_t MAX_HEADERS = 100;
+
+        struct Span {
+            size_t start;
+            size_t length;
+        };
+        struct Field {
+            Span name;
+            Span value;
+        };
+
+        enum Stage { REQUEST_LINE, HEADERS, DONE, FAILED };
+
+        Stage stage;
+        size_t scanned;     // bytes already scanned
+        size_t lineStart;
+        size_t colon;       // first ':' of the current line, or npos
+        size_t headEnd;
+        Span method, target, version;
+        vector<Field> fields;
+        long long contentLength;
+
+        // Moves scanned up to the next '\n' and returns true, or to the end of the buffer and
+        // returns false, noting the line's first colon. Control bytes other than tab and CR
+        // fail the request.
+        bool scanLine(const char* data, size_t size) {
+            size_t i = scanned;
+    #ifdef FTP_HAVE_SSE2
+            const __m128i lf = _mm_set1_epi8('\n');
+            const __m128i colonByte = _mm_set1_epi8(':');
+            const __m128i tab = _mm_set1_epi8('\t');
+            const __m128i cr = _mm_set1_epi8('\r');
+            const __m128i del = _mm_set1_epi8(0x7f);
+            const __m128i lastControl = _mm_set1_epi8(0x1f);
+            for (; i + 16 <= size; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+                unsigned newlines = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+                unsigned colons = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, colonByte));
+                __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(v, lastControl), lastControl);
+                control = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, cr)), control);
+                control = _mm_or_si128(control, _mm_cmpeq_epi8(v, del));
+                unsigned before = newlines ? (newlines & (0u - newlines)) - 1 : 0xffffu;   // lanes ahead of the '\n'
+                unsigned forbidden = (unsigned)_mm_movemask_epi8(control) & before;
+                if (forbidden) {
+                    stage = FAILED;
+                    return false;
+                }
+                if (colon == string::npos && (colons & before)) colon = i + __builtin_ctz(colons & before);
+                if (newlines) {
+                    scanned = i + __builtin_ctz(newlines);
+                    return true;
+                }
+            }
+    #endif
+            for (; i < size; ++i) {
+                unsigned char c = (unsigned char)data[i];
+                if (c == '\n') {
+                    scanned = i;
+                    return true;
+                }
+                if (c == ':' && colon == string::npos) colon = i;
+                if ((c < 0x20 && c != '\t' && c != '\r') || c == 0x7f) {
+                    stage = FAILED;
+                    return false;
+                }
+            }
+            scanned = size;
+            return false;
+        }
+
+        bool parseRequestLine(const char* data, size_t start, size_t end) {
+            const char* line = data + start;
+            size_t len = end - start;
+            const char* sp1 = (const char*)memchr(line, ' ', len);
+            if (!sp1 || sp1 == line) return false;
+            const char* sp2 = (const char*)memchr(sp1 + 1, ' ', (size_t)(line + len - sp1 - 1));
+            if (!sp2 || sp2 == sp1 + 1) return false;
+            method = Span{ start, (size_t)(sp1 - line) };
+            target = Span{ (size_t)(sp1 + 1 - data), (size_t)(sp2 - sp1 - 1) };
+            version = Span{ (size_t)(sp2 + 1 - data), (size_t)(line + len - sp2 - 1) };
+            return version.length == 8 && string_view(data + version.start, 7) == "HTTP/1.";
+        }
+
+        // name ":" OWS value OWS. Whitespace before the colon and folded continuation lines
+        // are refused, as RFC 9112 requires of a server.
+        bool parseHeaderLine(const char* data, size_t start, size_t end) {
+            if (data[start] == ' ' || data[start] == '\t') return false;
+            if (colon == string::npos || colon >= end || colon == start) return false;
+            if (data[colon - 1] == ' ' || data[colon - 1] == '\t') return false;
+            if (fields.size() == MAX_HEADERS) return false;
+            size_t valueStart = colon + 1;
+            size_t valueEnd = end;
+            while (valueStart < valueEnd && (data[valueStart] == ' ' || data[valueStart] == '\t')) ++valueStart;
+            while (valueEnd > valueStart && (data[valueEnd - 1] == ' ' || data[valueEnd - 1] == '\t')) --valueEnd;
+            fields.push_back(Field{ Span{ start, colon - start }, Span{ valueStart, valueEnd - valueStart } });
+            return true;
+        }
+
+        // Content-Length must be digits, and repeated copies must agree.
+        bool readContentLength(const char* data) {
+            for (const Field& field : fields) {
+                if (!HttpRequest::equalsIgnoreCase(string_view(data + field.name.start, field.name.length), "Content-Length")) continue;
+                string_view value(data + field.value.start, field.value.length);
+                if (value.empty() || value.size() > 18) return false;
+                long long length = 0;
+                for (char c : value) {
+                    if (c < '0' || c > '9') return false;
+                    length = length * 10 + (c - '0');
+                }
+                if (contentLength != -1 && contentLength != length) return false;
+                contentLength = length;
+            }
+            return true;
+        }
+
+        static string_view view(const char* data, const Span& span) {
+            return string_view(data + span.start, span.length);
+        }
+
+    public:
+        HttpParser() { reset(); }
+
+        // Forgets the current request; call once it has been consumed from the buffer.
+        void reset() {
+            stage = REQUEST_LINE;
+            scanned = 0;
+            lineStart = 0;
+            colon = string::npos;
+            headEnd = 0;
+            method = target = version = Span{ 0, 0 };
+            fields.clear();
+            contentLength = -1;
+        }
+
+        // Continues over buffer, which must hold everything passed before plus any new bytes.
+        // On COMPLETE, request views the head; its body is left for the caller to set.
+        Status feed(const string& buffer, HttpRequest& request) {
+            const char* data = buffer.data();
+            while (stage == REQUEST_LINE || stage == HEADERS) {
+                if (!scanLine(data, buffer.size())) break;
+                size_t end = scanned > lineStart && data[scanned - 1] == '\r' ? scanned - 1 : scanned;
+                bool ok = true;
+                if (end == lineStart) {
+                    // Blank lines ahead of a request are skipped; after the headers one ends them.
+                    if (stage == HEADERS) {
+                        headEnd = scanned + 1;
+                        stage = readContentLength(data) ? DONE : FAILED;
+                    }
+                } else if (stage == REQUEST_LINE) {
+                    ok = parseRequestLine(data, lineStart, end);
+                    stage = HEADERS;
+                } else {
+                    ok = parseHeaderLine(data, lineStart, end);
+                }
+                if (!ok) stage = FAILED;
+                lineStart = ++scanned;
+                colon = string::npos;
+            }
+
+            if (stage == FAILED) return INVALID;
+            if (stage != DONE) return INCOMPLETE;
+            request.method = view(data, method);
+            request.target = view(data, target);
+            request.version = view(data, version);
+            request.head = string_view(data, headEnd);
+            request.contentLength = contentLength;
+            request.headers.clear();
+            for (const Field& field : fields) {
+                request.headers.push_back(HttpRequest::Header{ view(data, field.name), view(data, field.value) });
+            }
+            return COMPLETE;
+        }
+    };
+
+    // Streaming multipart/form-data parser (RFC 7578). Bytes are fed as they arrive; part
+    // headers go to onPart, content to onData in pieces, and onEnd closes each part. Only a
+    // possible partial delimiter at the end of a read is held back, so memory stays constant
+    // whatever the size of the parts. Delimiters are found with Boyer-Moore-Horspool, which
+    // skips most of the bytes of file content without looking at them.
+    class MultipartParser {
+    public:
+        struct Part {
+            string name;
+            string filename;        // empty for a plain field
+            string contentType;
+        };
+        typedef function<bool(const Part&)> PartHandler;
+        typedef function<bool(const char*, size_t)> DataHandler;
+        typedef function<bool()> EndHandler;
+
+    private:
+        static const size_t MAX_PART_HEADER_BYTES = 8 * 1024;
+
+        enum Stage { PREAMBLE, AFTER_DELIMITER, HEADERS, BODY, EPILOGUE, FAILED };
+
+        string delimiter;           // CRLF "--" boundary
+        size_t skip[256];
+        Stage stage;
+        string carry;               // unconsumed bytes from the previous feed
+        string headerBlock;
+        PartHandler onPart;
+        DataHandler onData;
+        EndHandler onEnd;
+
+        size_t search(const char* p, size_t n) const {
+            size_t m = delimiter.size();
+            unsigned char last = (unsigned char)delimiter[m - 1];
+            for (size_t i = 0; i + m <= n; i += skip[(unsigned char)p[i + m - 1]]) {
+                if ((unsigned char)p[i + m - 1] == last && memcmp(p + i, delimiter.data(), m - 1) == 0) return i;
+            }
+            return string::npos;
+        }
+
+        // How many trailing bytes of p could be the start of a delimiter cut off by the read.
+        size_t partialDelimiter(const char* p, size_t n) const {
+            for (size_t k = min(n, delimiter.size() - 1); k > 0; --k) {
+                if (p[n - k] == '\r' && memcmp(p + n - k, delimiter.data(), k) == 0) return k;
+            }
+            return 0;
+        }
+
+        static string parameter(const string& header, const string& key) {
+            size_t i = 0;
+            while ((i = header.find(';', i)) != string::npos) {
+                ++i;
+                while (i < header.size() && (header[i] == ' ' || header[i] == '\t')) ++i;
+                size_t eq = header.find('=', i);
+                if (eq == string::npos) return "";
+                string name = header.substr(i, eq - i);
+                transform(name.begin(), name.end(), name.begin(), ::tolower);
+                i = eq + 1;
+                string value;
+                if (i < header.size() && header[i] == '"') {
+                    // Browsers percent-encode quotes in names rather than escape them, so a
+                    // backslash is taken as it is (an old-style Windows path).
+                    size_t close = header.find('"', i + 1);
+                    value = header.substr(i + 1, close == string::npos ? string::npos : close - i - 1);
+                    i = close == string::npos ? header.size() : close + 1;
+                } else {
+                    size_t end = header.find(';', i);
+                    value = header.substr(i, end == string::npos ? string::npos : end - i);
+                    value.erase(value.find_last_not_of(" \t") + 1);
+                }
+                if (name == key) return value;
+            }
+            return "";
+        }
+
+        bool beginPart() {
+            Part part;
+            bool formData = false;
+            size_t start = 0;
+            while (start < headerBlock.size()) {
+                size_t end = headerBlock.find('\n', start);
+                if (end == string::npos) end = headerBlock.size();
+                string line = headerBlock.substr(start, end - start);
+                start = end + 1;
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                size_t colon = line.find(':');
+                if (colon == string::npos) continue;
+                string_view name(line.data(), colon);
+                string value = line.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(" \t"));
+                if (HttpRequest::equalsIgnoreCase(name, "Content-Disposition")) {
+                    formData = value.size() >= 9 && HttpRequest::equalsIgnoreCase(string_view(value).substr(0, 9), "form-data");
+                    part.name = parameter(value, "name");
+                    part.filename = parameter(value, "filename");
+                } else if (HttpRequest::equalsIgnoreCase(name, "Content-Type")) {
+                    part.contentType = value;
+                }
+            }
+            headerBlock.clear();
+            return formData && onPart(part);
+        }
+
+        // Consumes what it can of p and keeps the rest for the next feed.
+        bool process(const char* p, size_t n) {
+            size_t i = 0;
+            while (i < n && stage != FAILED) {
+                if (stage == PREAMBLE || stage == BODY) {
+                    size_t at = search(p + i, n - i);
+                    size_t content = at != string::npos ? at : n - i - partialDelimiter(p + i, n - i);
+                    if (stage == BODY && content > 0 && !onData(p + i, content)) stage = FAILED;
+                    if (stage == FAILED || at == string::npos) {
+                        i += content;
+                        break;
+                    }
+                    if (stage == BODY && !onEnd()) stage = FAILED;
+                    else stage = AFTER_DELIMITER;
+                    i += at + delimiter.size();
+                } else if (stage == AFTER_DELIMITER) {
+                    // "--" closes the body and CRLF opens another part; padding may come between.
+                    if (p[i] == ' ' || p[i] == '\t') {
+                        ++i;
+                        continue;
+                    }
+                    if (n - i < 2) break;
+                    if (p[i] == '-' && p[i + 1] == '-') stage = EPILOGUE;
+                    else if (p[i] == '\r' && p[i + 1] == '\n') stage = HEADERS;
+                    else stage = FAILED;
+                    i += 2;
+                } else if (stage == HEADERS) {
+                    const char* newline = (const char*)memchr(p + i, '\n', n - i);
+                    size_t take = newline ? (size_t)(newline - (p + i)) + 1 : n - i;
+                    headerBlock.append(p + i, take);
+                    i += take;
+                    if (headerBlock.size() > MAX_PART_HEADER_BYTES) stage = FAILED;
+                    else if (newline && (headerBlock == "\r\n" || (headerBlock.size() >= 4 &&
+                                         headerBlock.compare(headerBlock.size() - 4, 4, "\r\n\r\n") == 0))) {
+                        stage = beginPart() ? BODY : FAILED;
+                    }
+                } else {
+                    i = n;      // epilogue is ignored
+                }
+            }
+            if (stage == FAILED) return false;
+            carry.assign(p + i, n - i);
+            return true;
+        }
+
+    public:
+        MultipartParser(const string& boundary, PartHandler part, DataHandler data, EndHandler end)
+            : delimiter("\r\n--" + boundary), stage(PREAMBLE), carry("\r\n"),
+              onPart(move(part)), onData(move(data)), onEnd(move(end)) {
+            // The body opens with the delimiter minus its CRLF, which carry supplies.
+            for (size_t& s : skip) s = delimiter.size();
+            for (size_t j = 0; j + 1 < delimiter.size(); ++j) skip[(unsigned char)delimiter[j]] = delimiter.size() - 1 - j;
+        }
+
+        // The boundary of a multipart/form-data Content-Type, or empty for any other type.
+        static string boundaryOf(string_view contentType) {
+            string type(contentType);
+            transform(type.begin(), type.end(), type.begin(), ::tolower);
+            if (type.rfind("multipart/form-data", 0) != 0) return "";
+            string boundary = parameter(string(contentType), "boundary");
+            return boundary.size() <= 70 ? boundary : "";
+        }
+
+        // False once the body is malformed or a handler refused; the parser is then spent.
+        bool feed(const char* data, size_t len) {
+            if (stage == FAILED) return false;
+            if (carry.empty()) return process(data, len);
+            string pending;
+            pending.swap(carry);
+            pending.append(data, len);
+            return process(pending.data(), pending.size());
+        }
+
+        // The closing delimiter has been read.
+        bool finished() const { return stage == EPILOGUE; }
+    };
+
+    // A multipart/form-data upload: an HTML form with one or more file inputs. File parts
+    // stream into staging files, other fields are kept in memory up to a limit, and the files
+    // are published together once the whole body has arrived. Whatever is still staged when
+    // the upload is dropped is deleted.
+    class MultipartUpload {
+    private:
+        static const size_t MAX_FIELD_BYTES = 64 * 1024;
+
+        FileManager& fileManager;
+        MultipartParser parser;
+        unique_ptr<UploadSink> sink;                // the file part being received
+        string fieldName;
+        string fieldValue;
+        map<string, string> fields;
+        vector<pair<string, string>> staged;        // filename, staging path
+        bool failed;                                // a staging file couldn't be written
+
+        bool beginPart(const MultipartParser::Part& part) {
+            if (part.filename.empty()) {
+                fieldName = part.name;
+                fieldValue.clear();
+                return true;
+            }
+            // Older browsers send the whole client-side path.
+            string filename = part.filename.substr(part.filename.find_last_of("/\\") + 1);
+            if (filename.empty() || filename == "." || filename == "..") return false;
+            sink.reset(new UploadSink());
+            if (!sink->open(fileManager.newStagingPath(filename), LLONG_MAX)) {
+                failed = true;
+                return false;
+            }
+            staged.push_back(make_pair(filename, sink->stagingPath()));
+            return true;
+        }
+
+        bool partData(const char* data, size_t len) {
+            if (!sink) {
+                fieldValue.append(data, len);
+                return fieldValue.size() <= MAX_FIELD_BYTES;
+            }
+            sink->write(data, len);
+            failed = sink->hasFailed();
+            return !failed;
+        }
+
+        bool endPart() {
+            if (!sink) {
+                fields[fieldName] = fieldValue;
+                return true;
+            }
+            failed = !sink->finish();
+            sink.reset();
+            return !failed;
+        }
+
+    public:
+        MultipartUpload(FileManager& fm, const string& boundary)
+            : fileManager(fm),
+              parser(boundary,
+                     [this](const MultipartParser::Part& part) { return beginPart(part); },
+                     [this](const char* data, size_t len) { return partData(data, len); },
+                     [this]() { return endPart(); }),
+              failed(false) {}
+
+        MultipartUpload(const MultipartUpload&) = delete;
+        MultipartUpload& operator=(const MultipartUpload&) = delete;
+
+        ~MultipartUpload() {
+            sink.reset();
+            for (const auto& file : staged) Platform::deleteFile(file.second);
+        }
+
+        // False on a malformed body (hasFailed() false) or a write error (hasFailed() true).
+        bool write(const char* data, size_t len) { return parser.feed(data, len); }
+
+        bool finished() const { return parser.finished(); }
+        bool hasFailed() const { return failed; }
+        const map<string, string>& formFields() const { return fields; }
+
+        // Publishes the staged files; names receives them in form order.
+        bool commit(vector<string>& names) {
+            bool ok = true;
+            for (const auto& file : staged) {
+                if (fileManager.commitUpload(file.second, file.first)) {
+                    names.push_back(file.first);
+                } else {
+                    Platform::deleteFile(file.second);
+                    ok = false;
+                }
+            }
+            staged.clear();
+            return ok;
+        }
+    };
+
+    // Per-connection state for the event loop. Handlers queue output and move the state machine;
+    // the loop owns all socket reads and writes.
+    class Connection {
+    public:
+        enum class State {
+            Detecting,      // first bytes decide HTTP vs. raw command protocol
+            HttpRequest,    // accumulating headers + Content-Length body
+            HttpUploadBody, // upload body streams into uploadSink
+            CommandAuth,    // waiting for "username password"
+            CommandReady,   // authenticated, waiting for a command
+            CommandUpload,  // raw upload bytes stream into uploadFile
+            Draining        // response queued, input ignored, close once flushed
+        };
+
+        static const size_t INPUT_BUFFER_BYTES = 4096;
+
+        SOCKET sock;
+        State state;
+        string inBuffer;
+        HttpParser httpParser;  // progress through the request head at the front of inBuffer
+        HttpRequest request;    // the request being handled; reused so its header table stays allocated
+        SegmentQueue output;
+        bool closeWhenDrained;
+        bool peerClosed;
+        bool canRead;       // socket may still hold unread bytes (edge already consumed)
+        bool moreToWrite;   // write budget ran out before the socket blocked
+        bool queued;        // already on the loop's ready list
+        bool corked;        // TCP_CORK held until the current file body is out
+        bool keepAlive;     // the current HTTP response leaves the connection open
+        bool sessionMode;   // command connection speaking the framed v2 protocol
+        bool authenticated; // command connection past its credentials or RESUME
+        bool throttled;     // waiting for bandwidth; retried by the loop every REFILL_MS
+        TransferShaper::Flow flow;
+        bool transferring;  // holds one of AdmissionControl's transfer slots
+        long long windowBytes;      // bytes moved either way since windowStarted
+        chrono::steady_clock::time_point windowStarted;
+        chrono::steady_clock::time_point headStarted;   // first byte of the request head being read
+        bool pipelined;     // complete requests are buffered behind a full output queue
+        int requestsServed;
+        chrono::steady_clock::time_point lastActivity;
+
+        unique_ptr<ofstream> uploadFile;
+        unique_ptr<UploadSink> uploadSink;
+        string uploadName;
+        string chunkUploadId;               // set while the HTTP body is a resumable-upload chunk
+        string deltaVersion;                // set while the body is a delta against this version
+        long long chunkOffset;
+        string sessionToken;
+        string frameHeader;                 // partial v2 frame header within an upload
+        unsigned long long dataRemaining;   // payload bytes left in the current v2 DATA frame,
+                                            // or of a compressed HTTP upload body
+        bool dataEncoded;                   // the current v2 DATA frame is flagged Frame::ENCODED
+        Compression::Codec encoding;        // v2: what the session agreed on with ENCODING
+        unique_ptr<Compression::Decoder> uploadDecoder;   // set while the upload body is compressed
+        unique_ptr<MultipartUpload> multipart;            // set while the upload body is a form
+        // UPLOAD_DEDUP: 1 while the client's manifest arrives, 2 while the chunks it was asked
+        // for do; the manifest and the chunks still owed are kept in between.
+        int dedupStage;
+        ChunkStore::Manifest dedupManifest;
+        vector<pair<string, long long>> dedupMissing;
+
+        // io_uring engine: operations in flight, the receive buffer they target, and file
+        // chunks read ahead into registered buffer slots, in send order.
+        struct FileChunk {
+            int slot;
+            size_t len;
+            size_t sent;
+            bool filled;
+        };
+        int inflight;
+        bool recvPosted;
+        bool sendPosted;
+        long long recvGranted;  // bulk bytes the shaper granted the posted receive / send;
+        long long sendGranted;  // 0 for an interactive send, charged when it completes
+        bool closing;
+        int fixedSlot;
+        vector<char> recvBuffer;
+        deque<FileChunk> chunks;
+    #ifdef FTP_HAVE_IO_URING
+        iovec sendParts[NetworkManager::MAX_GATHER];    // the posted gathered send reads these
+        msghdr sendMessage;
+    #endif
+
+        explicit Connection(SOCKET s)
+            : sock(s), state(State::Detecting), closeWhenDrained(false), peerClosed(false),
+              canRead(false), moreToWrite(false), queued(false), corked(false), keepAlive(false), sessionMode(false),
+              authenticated(false), throttled(false), transferring(false), windowBytes(0),
+              windowStarted(chrono::steady_clock::now()), headStarted(windowStarted),
+              pipelined(false), requestsServed(0), lastActivity(windowStarted),
+              chunkOffset(0), dataRemaining(0), dataEncoded(false), encoding(Compression::NONE), dedupStage(0), inflight(0), recvPosted(false), sendPosted(false),
+              recvGranted(0), sendGranted(0), closing(false), fixedSlot(-1) {
+            inBuffer = BufferPool::acquire(INPUT_BUFFER_BYTES);
+        }
+
+        ~Connection() {
+            BufferPool::release(inBuffer);
+        }
+
+        void send(const string& data) {
+            if (data.empty()) return;
+            string copy = BufferPool::acquire(data.size());
+            copy.append(data);
+            send(move(copy));
+        }
+
+        // Queues a buffer the caller is done with, ideally one taken from BufferPool.
+        void send(string&& data) {
+            if (data.empty()) return;
+            OutputSegment seg;
+            seg.data = move(data);
+            output.push_back(move(seg));
+        }
+
+        // Queues bytes owned elsewhere (e.g. a cached response) without copying them.
+        void sendShared(const shared_ptr<const string>& data) {
+            if (!data || data->empty()) return;
+            OutputSegment seg;
+            seg.shared = data;
+            output.push_back(move(seg));
+        }
+
+        // Takes ownership of fd and streams size bytes of it from the start.
+        void sendFile(int fd, long long size) {
+            sendFileRange(fd, 0, size);
+        }
+
+        // Takes ownership of fd and streams length bytes of it starting at offset.
+        void sendFileRange(int fd, long long offset, long long length) {
+            OutputSegment seg;
+            seg.fileFd = fd;
+            seg.fileOffset = offset;
+            seg.fileRemaining = length;
+            output.push_back(move(seg));
+        }
+
+        // Like sendFileRange, but the file is only opened when its turn comes.
+        void sendFileAt(const string& path, long long offset, long long length) {
+            OutputSegment seg;
+            seg.filePath = path;
+            seg.fileOffset = offset;
+            seg.fileRemaining = length;
+            output.push_back(move(seg));
+        }
+
+        // Queues a body that is compressed as it goes out.
+        void sendEncoded(const shared_ptr<CompressedBody>& body) {
+            OutputSegment seg;
+            seg.encoder = body;
+            output.push_back(move(seg));
+        }
+
+        bool hasPendingOutput() const { return !output.empty(); }
+
+        // The unsent bytes of the in-memory segments at the front of the queue, up to budget
+        // bytes in at most MAX_GATHER parts, for one gathered send. Returns the part count.
+        int gatherOutput(pair<const char*, size_t>* parts, size_t budget) const {
+            int count = 0;
+            size_t total = 0;
+            for (size_t i = 0; i < output.size(); ++i) {
+                const OutputSegment& seg = output[i];
+                if (!seg.inMemory() || count == NetworkManager::MAX_GATHER || total >= budget) break;
+                size_t len = min(seg.size() - seg.offset, budget - total);
+                parts[count++] = make_pair(seg.bytes() + seg.offset, len);
+                total += len;
+            }
+            return count;
+        }
+
+        // Accounts for sent bytes written from the front of the queue, which may end partway
+        // through any segment; the in-memory segments completed are dropped.
+        void consumeOutput(size_t sent) {
+            while (!output.empty()) {
+                OutputSegment& seg = output.front();
+                size_t take = min(sent, seg.size() - seg.offset);
+                seg.offset += take;
+                sent -= take;
+                if (seg.offset < seg.size() || !seg.inMemory()) break;
+                output.pop_front();
+            }
+        }
+
+        // Queue nothing further: close as soon as the pending output has been written.
+        void finish() {
+            state = State::Draining;
+            closeWhenDrained = true;
+        }
+
+        // One HTTP exchange is complete: wait for the next request on a persistent
+        // connection, otherwise close once the response is out.
+        void endHttpRequest() {
+            requestsServed++;
+            headStarted = chrono::steady_clock::now();
+            if (keepAlive) {
+                state = State::HttpRequest;
+            } else {
+                finish();
+            }
+        }
+    };
+
+    // An HTTP response head queued as pieces that the loop writes with one gathered send:
+    // the status line from a prebuilt table, the header fields appended into a pooled
+    // buffer, and the body as its own segment, so a large body is never copied into the head.
+    class HttpResponse {
+    private:
+        static const size_t FIELDS_BYTES = 1024;
+
+        int status;
+        string fields;
+
+        struct StatusLine {
+            int status;
+            const char* line;
+        };
+
+    public:
+        explicit HttpResponse(int code) : status(code), fields(BufferPool::acquire(FIELDS_BYTES)) {}
+        HttpResponse(const HttpResponse&) = delete;
+        HttpResponse& operator=(const HttpResponse&) = delete;
+        ~HttpResponse() { BufferPool::release(fields); }
+
+        // "HTTP/1.1 <status> <reason>\r\n" for the statuses this server sends; null otherwise.
+        static const shared_ptr<const string>& statusLine(int code) {
+            static const StatusLine lines[] = {
+                { 200, "HTTP/1.1 200 OK\r\n" },
+                { 206, "HTTP/1.1 206 Partial Content\r\n" },
+                { 302, "HTTP/1.1 302 Found\r\n" },
+                { 304, "HTTP/1.1 304 Not Modified\r\n" },
+                { 400, "HTTP/1.1 400 Bad Request\r\n" },
+                { 401, "HTTP/1.1 401 Unauthorized\r\n" },
+                { 403, "HTTP/1.1 403 Forbidden\r\n" },
+                { 404, "HTTP/1.1 404 Not Found\r\n" },
+                { 408, "HTTP/1.1 408 Request Timeout\r\n" },
+                { 409, "HTTP/1.1 409 Conflict\r\n" },
+                { 411, "HTTP/1.1 411 Length Required\r\n" },
+                { 413, "HTTP/1.1 413 Payload Too Large\r\n" },
+                { 415, "HTTP/1.1 415 Unsupported Media Type\r\n" },
+                { 416, "HTTP/1.1 416 Range Not Satisfiable\r\n" },
+                { 431, "HTTP/1.1 431 Request Header Fields Too Large\r\n" },
+                { 500, "HTTP/1.1 500 Internal Server Error\r\n" },
+                { 503, "HTTP/1.1 503 Service Unavailable\r\n" },
+            };
+            static const vector<pair<int, shared_ptr<const string>>> table = [] {
+                vector<pair<int, shared_ptr<const string>>> built;
+                for (const StatusLine& entry : lines) built.push_back(make_pair(entry.status, make_shared<const string>(entry.line)));
+                return built;
+            }();
+            static const shared_ptr<const string> none;
+            for (const auto& entry : table) {
+                if (entry.first == code) return entry.second;
+            }
+            return none;
+        }
+
+        HttpResponse& header(string_view name, string_view value) {
+            fields.append(name.data(), name.size()).append(": ").append(value.data(), value.size()).append("\r\n");
+            return *this;
+        }
+
+        HttpResponse& header(string_view name, long long value) {
+            char digits[24];
+            int length = snprintf(digits, sizeof(digits), "%lld", value);
+            return header(name, string_view(digits, (size_t)length));
+        }
+
+        // Fields already formatted as "Name: value\r\n" lines; a missing final CRLF is added.
+        HttpResponse& lines(string_view block) {
+            if (block.empty()) return *this;
+            fields.append(block.data(), block.size());
+            if (block.size() < 2 || block.compare(block.size() - 2, 2, "\r\n") != 0) fields.append("\r\n");
+            return *this;
+        }
+
+        // Queues the status line and the fields, closed by this connection's Connection line.
+        // The body, if any, is queued by the caller next.
+        void sendHead(Connection& conn) {
+            const shared_ptr<const string>& line = statusLine(status);
+            if (line) {
+                conn.sendShared(line);
+            } else {
+                fields.insert(0, "HTTP/1.1 " + to_string(status) + " Unknown\r\n");
+            }
+            fields.append(conn.keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+            conn.send(move(fields));
+        }
+
+        void send(Connection& conn, string body) {
+            sendHead(conn);
+            conn.send(move(body));
+        }
+
+        void send(Connection& conn, const shared_ptr<const string>& body) {
+            sendHead(conn);
+            conn.sendShared(body);
+        }
+    };
+
+    // A file opened to be sent. Given a chunk store, a dedup manifest is read instead of sent:
+    // its chunks are queued by path and opened one at a time as the transfer reaches them.
+    // size, modified and fileId describe the content for validators and ranges; for a
+    // manifest they are its own mtime and inode with the size of the file it stands for.
+    class StoredFile {
+    private:
+        int fd;
+        const ChunkStore* chunks;           // set when reading through a manifest
+        ChunkStore::Manifest manifest;
+        vector<long long> starts;           // offset of each manifest chunk within the file
+        mutable int chunkFd;                // the chunk read() last opened
+        mutable size_t chunkIndex;
+
+    public:
+        long long size;
+        long long modified;
+        unsigned long long fileId;
+
+        StoredFile() : fd(-1), chunks(nullptr), chunkFd(-1), chunkIndex(0), size(0), modified(0), fileId(0) {}
+        StoredFile(const StoredFile&) = delete;
+        StoredFile& operator=(const StoredFile&) = delete;
+
+        ~StoredFile() {
+            if (fd != -1) Platform::closeFile(fd);
+            if (chunkFd != -1) Platform::closeFile(chunkFd);
+        }
+
+        bool open(const string& path, const ChunkStore* store) {
+            fd = Platform::openFileForRead(path, size, &modified, &fileId);
+            if (fd == -1) return false;
+            if (store && ChunkStore::readManifest(fd, size, manifest)) {
+                chunks = store;
+                size = manifest.size;
+                long long offset = 0;
+                for (const auto& chunk : manifest.chunks) {
+                    starts.push_back(offset);
+                    offset += chunk.second;
+                }
+                Platform::closeFile(fd);
+                fd = -1;
+            }
+            return true;
+        }
+
+        // Queues length bytes from offset on conn; false when out of descriptors.
+        bool queue(Connection& conn, long long offset, long long length) const {
+            if (!chunks) {
+                int copy = Platform::duplicateFile(fd);
+                if (copy == -1) return false;
+                conn.sendFileRange(copy, offset, length);
+                return true;
+            }
+            size_t i = (size_t)(upper_bound(starts.begin(), starts.end(), offset) - starts.begin());
+            for (i = i > 0 ? i - 1 : 0; length > 0 && i < manifest.chunks.size(); ++i) {
+                long long within = offset - starts[i];
+                long long take = min(length, manifest.chunks[i].second - within);
+                conn.sendFileAt(chunks->chunkPath(manifest.chunks[i].first), within, take);
+                offset += take;
+                length -= take;
+            }
+            return true;
+        }
+
+        // A second handle on the same content for a reader that outlives this one; null when
+        // out of descriptors.
+        shared_ptr<StoredFile> share() const {
+            shared_ptr<StoredFile> copy = make_shared<StoredFile>();
+            if (!chunks) {
+                copy->fd = Platform::duplicateFile(fd);
+                if (copy->fd == -1) return nullptr;
+            }
+            copy->chunks = chunks;
+            copy->manifest = manifest;
+            copy->starts = starts;
+            copy->size = size;
+            copy->modified = modified;
+            copy->fileId = fileId;
+            return copy;
+        }
+
+        // read() until len bytes are in; false on an error or a short file.
+        bool readFully(char* buffer, size_t len, long long offset) const {
+            for (size_t done = 0; done < len;) {
+                int got = read(buffer + done, (int)min(len - done, (size_t)INT_MAX), offset + (long long)done);
+                if (got <= 0) return false;
+                done += (size_t)got;
+            }
+            return true;
+        }
+
+        // Positional read of up to len bytes of the content; 0 at the end, -1 on error.
+        int read(char* buffer, int len, long long offset) const {
+            if (offset < 0 || offset >= size || len <= 0) return 0;
+            if (!chunks) return Platform::readFileAt(fd, buffer, len, offset);
+            size_t i = (size_t)(upper_bound(starts.begin(), starts.end(), offset) - starts.begin()) - 1;
+            if (chunkFd == -1 || chunkIndex != i) {
+                if (chunkFd != -1) Platform::closeFile(chunkFd);
+                long long chunkSize = 0;
+                chunkFd = Platform::openFileForRead(chunks->chunkPath(manifest.chunks[i].first), chunkSize);
+                chunkIndex = i;
+                if (chunkFd == -1) return -1;
+            }
+            long long within = offset - starts[i];
+            return Platform::readFileAt(chunkFd, buffer, (int)min((long long)len, manifest.chunks[i].second - within), within);
+        }
+    };
+
+    // Framed command protocol (v2). A client opens with the 4-byte preamble "FTP2"; after that
+    // every message is a frame: 1-byte type, 16-bit status, 64-bit payload length (big-endian),
+    // then the payload. Status codes follow HTTP (200, 400, 401, 404, 409, 416, 500). A DATA
+    // frame whose status is ENCODED carries a piece of a compressed stream in the codec the
+    // session agreed on (see ENCODING); a body's encoded frames concatenate into one stream.
+    struct Frame {
+        enum Type { REQUEST = 1, RESPONSE = 2, DATA = 3, END = 4 };
+        static const int ENCODED = 1;
+        static const size_t HEADER_SIZE = 11;
+        static constexpr const char* MAGIC = "FTP2";
+        static const size_t MAGIC_SIZE = 4;
+
+        int type;
+        int status;
+        unsigned long long length;
+
+        static string header(Type type, int status, unsigned long long length) {
+            string h(HEADER_SIZE, '\0');
+            h[0] = (char)type;
+            h[1] = (char)((status >> 8) & 0xff);
+            h[2] = (char)(status & 0xff);
+            for (int i = 0; i < 8; ++i) h[3 + i] = (char)((length >> (56 - 8 * i)) & 0xff);
+            return h;
+        }
+
+        static Frame parse(const char* p) {
+            Frame f;
+            f.type = (unsigned char)p[0];
+            f.status = ((unsigned char)p[1] << 8) | (unsigned char)p[2];
+            f.length = 0;
+            for (int i = 0; i < 8; ++i) f.length = (f.length << 8) | (unsigned char)p[3 + i];
+            return f;
+        }
+    };
+
+    // A file body compressed while it is sent. Each produce() compresses the next BLOCK of the
+    // file and returns it framed as an HTTP chunk or as v2 DATA frames flagged Frame::ENCODED,
+    // so memory stays bounded whatever the file's size. The level adapts every few blocks:
+    // when compressing took most of the time since the last check the connection is waiting
+    // on the CPU and the level steps down; when the socket is what it waits on the level steps
+    // up. It also steps down while compression across the process uses much of the machine.
+    class CompressedBody {
+    public:
+        enum Framing { HTTP_CHUNKED, COMMAND_FRAMES };
+
+    private:
+        static const int BLOCK = 256 * 1024;
+        static const int ADAPT_BLOCKS = 8;
+        static const int SAMPLE = 64 * 1024;
+        static const long long MIN_SIZE = 1024;
+
+        shared_ptr<StoredFile> file;
+        Framing framing;
+        Compression::Codec codec;
+        Compression::Encoder encoder;
+        long long offset;
+        bool ended;
+        vector<char> buffer;
+        int blocks;
+        chrono::steady_clock::duration busy;
+        chrono::steady_clock::time_point since;
+
+        void adapt(chrono::steady_clock::time_point now) {
+            if (++blocks < ADAPT_BLOCKS) return;
+            double share = chrono::duration<double>(busy).count() / max(1e-9, chrono::duration<double>(now - since).count());
+            int level = encoder.currentLevel();
+            if ((share > 0.6 || Compression::load() > 50) && level > Compression::Encoder::minLevel(codec)) {
+                encoder.setLevel(level - 1);
+            } else if (share < 0.3 && Compression::load() < 25 && level < Compression::Encoder::maxLevel(codec)) {
+                encoder.setLevel(level + 1);
+            }
+            blocks = 0;
+            busy = chrono::steady_clock::duration::zero();
+            since = now;
+        }
+
+        void frame(const string& payload, string& out) const {
+            if (payload.empty()) return;
+            if (framing == HTTP_CHUNKED) {
+                char size[20];
+                snprintf(size, sizeof(size), "%zx\r\n", payload.size());
+                out += size;
+                out += payload;
+                out += "\r\n";
+            } else {
+                out += Frame::header(Frame::DATA, Frame::ENCODED, payload.size());
+                out += payload;
+            }
+        }
+
+    public:
+        CompressedBody(const shared_ptr<StoredFile>& source, Compression::Codec c, Framing f)
+            : file(source), framing(f), codec(c), offset(0), ended(false), blocks(0),
+              busy(chrono::steady_clock::duration::zero()), since(chrono::steady_clock::now()) {}
+
+        bool begin() {
+            buffer.resize(BLOCK);
+            return encoder.begin(codec, Compression::Encoder::defaultLevel(codec));
+        }
+
+        bool done() const { return ended; }
+
+        // Appends the next piece of the framed body to out, never nothing; after the last one
+        // done() is true. False on a read or codec error.
+        bool produce(string& out) {
+            string compressed;
+            long long payload = 0;
+            while (compressed.empty() && !ended) {
+                auto started = chrono::steady_clock::now();
+                size_t len = (size_t)min((long long)BLOCK, file->size - offset);
+                if (!file->readFully(buffer.data(), len, offset)) return false;
+                bool last = offset + (long long)len == file->size;
+                if (!encoder.update(buffer.data(), len, last, compressed)) return false;
+                offset += (long long)len;
+                payload += (long long)len;
+                ended = last;
+
+                auto finished = chrono::steady_clock::now();
+                busy += finished - started;
+                Compression::recordBusy(finished - started);
+                adapt(finished);
+            }
+            size_t before = out.size();
+            frame(compressed, out);
+            if (ended) out += framing == HTTP_CHUNKED ? string("0\r\n\r\n") : Frame::header(Frame::END, 200, 0);
+            TransferStats::recordEncoded(TransferStats::DOWNLOAD, payload, (long long)(out.size() - before));
+            return true;
+        }
+
+        // Whether compressing file is likely to pay, from the order-0 entropy of samples at
+        // its start, middle and end: already-compressed data (archives, images, video) comes
+        // out at nearly 8 bits per byte, text and logs well under 6.
+        static bool worthCompressing(const StoredFile& file) {
+            if (file.size < MIN_SIZE) return false;
+            long long counts[256] = {};
+            long long total = 0;
+            vector<char> sample(SAMPLE);
+            long long starts[3] = { 0, file.size / 2 - SAMPLE / 2, file.size - SAMPLE };
+            long long covered = 0;
+            for (long long start : starts) {
+                start = max(start, covered);
+                size_t len = (size_t)min((long long)SAMPLE, file.size - start);
+                if (start >= file.size || len == 0) continue;
+                if (!file.readFully(sample.data(), len, start)) return false;
+                for (size_t i = 0; i < len; ++i) counts[(unsigned char)sample[i]]++;
+                total += (long long)len;
+                covered = start + (long long)len;
+            }
+
+            double bits = 0;
+            for (long long count : counts) {
+                if (count > 0) bits -= (double)count / total * log2((double)count / total);
+            }
+            return bits < 7.5;
+        }
+    };
+
+    // rsync-style updates of a file the server already holds. The server publishes a signature
+    // of its copy, one line per block of blockSizeFor(size) bytes:
+    //   "FTPSIG 1 <version> <size> <block size>\n", then "<weak> <strong>\n" per block
+    // where weak is the block's rolling checksum (8 hex digits) and strong the first 128 bits
+    // of its SHA-256 (32 hex digits). The client slides the weak checksum over its new version
+    // a byte at a time and answers with a delta:
+    //   "FTPDELTA 1 <block size> <size> <sha256>\n", then operations back to back:
+    //   'C' <first block> <count>   copy blocks of the server's copy
+    //   'L' <length> <bytes>        bytes the server doesn't have
+    // with every number 8 bytes big-endian. The new version is rebuilt in a staging file and
+    // only published once its size and SHA-256 check out, so readers see the old file or the
+    // new one, never a mix.
+    class DeltaSync {
+    public:
+        static const int MIN_BLOCK = 2 * 1024;
+        static const int MAX_BLOCK = 128 * 1024;
+
+        // Roughly the square root of the file size, which balances the signature's size
+        // against how much a changed block costs.
+        static int blockSizeFor(long long size) {
+            long long block = MIN_BLOCK;
+            while (block < MAX_BLOCK && block * block < size) block *= 2;
+            return (int)block;
+        }
+
+        // rsync's checksum: a is the byte sum and b the sum of the running a, both mod 2^16.
+        // Sliding one byte drops out and adds in: a += in - out; b += a - len * out.
+        static uint32_t weakSum(const char* data, size_t len) {
+            const unsigned char* p = (const unsigned char*)data;
+            uint32_t a = 0, b = 0;
+            for (size_t i = 0; i < len; ++i) {
+                a += p[i];
+                b += a;
+            }
+            return (a & 0xffff) | (b << 16);
+        }
+
+        static string strongSum(const char* data, size_t len) {
+            return Sha256::of(data, len).substr(0, 32);
+        }
+
+        // Signature of filename in uploads. Returns 200, 404 (also for a name that could only
+        // point elsewhere) or 500.
+        static int signature(FileManager& fileManager, const string& filename, string& out) {
+            StoredFile file;
+            if (!isUpload(fileManager, filename)) return 404;
+            if (!file.open(fileManager.getUploadFolder() + filename, fileManager.getChunkStore())) return 404;
+            int block = blockSizeFor(file.size);
+            out = "FTPSIG 1 " + FileManager::versionTag(file.fileId, file.size, file.modified) + " " +
+                  to_string(file.size) + " " + to_string(block) + "\n";
+            out.reserve(out.size() + (size_t)((file.size + block - 1) / block) * 42);
+
+            vector<char> buffer((size_t)block);
+            char line[48];
+            for (long long offset = 0; offset < file.size; offset += block) {
+                size_t len = (size_t)min((long long)block, file.size - offset);
+                if (!file.readFully(buffer.data(), len, offset)) return 500;
+                snprintf(line, sizeof(line), "%08x ", (unsigned)weakSum(buffer.data(), len));
+                out += line;
+                out += strongSum(buffer.data(), len);
+                out += '\n';
+            }
+            return 200;
+        }
+
+        // Rebuilds filename from the delta at deltaPath and publishes it. version is the one
+        // the client's signature named. Returns 200, 404, 409 when the file has changed since,
+        // 400 for a delta that doesn't apply, or 500.
+        static int apply(FileManager& fileManager, const string& filename, const string& version,
+                         const string& deltaPath, long long& copied, long long& literal) {
+            copied = literal = 0;
+            StoredFile basis;
+            if (!isUpload(fileManager, filename)) return 404;
+            if (!basis.open(fileManager.getUploadFolder() + filename, fileManager.getChunkStore())) return 404;
+            if (FileManager::versionTag(basis.fileId, basis.size, basis.modified) != version) return 409;
+
+            long long deltaSize = 0;
+            int fd = Platform::openFileForRead(deltaPath, deltaSize);
+            if (fd == -1) return 500;
+            int status = rebuild(fileManager, filename, basis, fd, deltaSize, copied, literal);
+            Platform::closeFile(fd);
+            return status;
+        }
+
+    private:
+        static const size_t COPY_BUFFER = 256 * 1024;
+
+        // Names come straight from clients; only files in the uploads catalog may be read or
+        // replaced.
+        static bool isUpload(const FileManager& fileManager, const string& filename) {
+            return FileManager::validName(filename) && fileManager.hasUpload(filename);
+        }
+
+        static bool readExact(int fd, char* buffer, size_t len, long long offset) {
+            for (size_t done = 0; done < len;) {
+                int got = Platform::readFileAt(fd, buffer + done, (int)(len - done), offset + (long long)done);
+                if (got <= 0) return false;
+                done += (size_t)got;
+            }
+            return true;
+        }
+
+        static long long number(const char* p) {
+            unsigned long long value = 0;
+            for (int i = 0; i < 8; ++i) value = (value << 8) | (unsigned char)p[i];
+            return value > (unsigned long long)LLONG_MAX ? -1 : (long long)value;
+        }
+
+        static int rebuild(FileManager& fileManager, const string& filename, const StoredFile& basis,
+                           int fd, long long deltaSize, long long& copied, long long& literal) {
+            char head[160];
+            size_t headLen = (size_t)min(deltaSize, (long long)sizeof(head));
+            if (!readExact(fd, head, headLen, 0)) return 400;
+            const char* newline = (const char*)memchr(head, '\n', headLen);
+            if (!newline) return 400;
+            istringstream header(string(head, (size_t)(newline - head)));
+            string magic, expectedHash;
+            int formatVersion = 0;
+            long long block = 0, size = -1;
+            header >> magic >> formatVersion >> block >> size >> expectedHash;
+            if (magic != "FTPDELTA" || formatVersion != 1 || block != blockSizeFor(basis.size) || size < 0 ||
+                expectedHash.size() != 64) return 400;
+
+            UploadSink out;
+            if (!out.open(fileManager.newStagingPath(filename), size)) return 500;
+            long long blocks = (basis.size + block - 1) / block;
+            vector<char> buffer(COPY_BUFFER);
+            Sha256 hash;
+            long long pos = (long long)(newline - head) + 1;
+
+            // Moves length bytes from one of the two sources into the output.
+            auto transfer = [&](bool fromBasis, long long offset, long long length) {
+                while (length > 0) {
+                    size_t n = (size_t)min(length, (long long)buffer.size());
+                    bool read = fromBasis ? basis.readFully(buffer.data(), n, offset) : readExact(fd, buffer.data(), n, offset);
+                    if (!read) return 500;
+                    if (out.write(buffer.data(), n) < n) return 400;
+                    if (out.hasFailed()) return 500;
+                    hash.update(buffer.data(), n);
+                    offset += (long long)n;
+                    length -= (long long)n;
+                }
+                return 200;
+            };
+
+            int status = 200;
+            while (status == 200 && pos < deltaSize) {
+                char op[17];
+                size_t opLen = (size_t)min(deltaSize - pos, (long long)sizeof(op));
+                if (!readExact(fd, op, opLen, pos)) return 500;
+                if (op[0] == 'C' && opLen == 17) {
+                    long long first = number(op + 1), count = number(op + 9);
+                    if (first < 0 || count <= 0 || first >= blocks || count > blocks - first) return 400;
+                    long long start = first * block;
+                    long long length = min((first + count) * block, basis.size) - start;
+                    status = transfer(true, start, length);
+                    copied += length;
+                    pos += 17;
+                } else if (op[0] == 'L' && opLen >= 9) {
+                    long long length = number(op + 1);
+                    pos += 9;
+                    if (length < 0 || length > deltaSize - pos) return 400;
+                    status = transfer(false, pos, length);
+                    literal += length;
+                    pos += length;
+                } else {
+                    return 400;
+                }
+            }
+            if (status != 200) return status;
+            if (!out.complete()) return 400;
+            if (!out.finish()) return 500;
+            if (hash.hex() != expectedHash) {
+                Platform::deleteFile(out.stagingPath());
+                return 400;
+            }
+            return fileManager.commitUpload(out.stagingPath(), filename) ? 200 : 500;
+        }
+    };
+
+    // IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT") conversion for Last-Modified and
+    // If-Modified-Since, done arithmetically so no locale or gmtime variant is involved.
+    struct HttpDate {
+        static string format(long long seconds) {
+            static const char* const days[] = { "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" };
+            static const char* const months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                                  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+            long long day = seconds >= 0 ? seconds / 86400 : (seconds - 86399) / 86400;
+            long long secs = seconds - day * 86400;
+
+            // Civil date from days since 1970-01-01 (H. Hinnant's algorithm).
+            long long z = day + 719468;
+            long long era = (z >= 0 ? z : z - 146096) / 146097;
+            long long doe = z - era * 146097;
+            long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+            long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+            long long mp = (5 * doy + 2) / 153;
+            long long d = doy - (153 * mp + 2) / 5 + 1;
+            long long m = mp < 10 ? mp + 3 : mp - 9;
+            long long y = yoe + era * 400 + (m <= 2 ? 1 : 0);
+
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%s, %02d %s %04lld %02d:%02d:%02d GMT", days[((day % 7) + 7) % 7], (int)d,
+                     months[m - 1], y, (int)(secs / 3600), (int)(secs / 60 % 60), (int)(secs % 60));
+            return buf;
+        }
+
+        // Seconds since the epoch, or -1 if value isn't an IMF-fixdate.
+        static long long parse(const string& value) {
+            static const string months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+            int d = 0, y = 0, hh = 0, mm = 0, ss = 0;
+            char month[4] = {};
+            if (sscanf(value.c_str(), "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &d, month, &y, &hh, &mm, &ss) != 6) return -1;
+            size_t index = months.find(month);
+            if (index == string::npos || index % 3 != 0) return -1;
+            long long m = (long long)index / 3 + 1;
+
+            // Days since 1970-01-01 from a civil date (inverse of the above).
+            long long yy = y - (m <= 2 ? 1 : 0);
+            long long era = (yy >= 0 ? yy : yy - 399) / 400;
+            long long yoe = yy - era * 400;
+            long long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+            long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+            long long day = era * 146097 + doe - 719468;
+            return day * 86400 + hh * 3600 + mm * 60 + ss;
+        }
+    };
+
+    // Static files under www/ held in memory, each with its response headers prebuilt and,
+    // for text types, gzip and brotli variants. Precompressed siblings (app.js.gz, app.js.br)
+    // are used when present and at least as new as the file; otherwise the variants are made
+    // here when the server is built with FTP_WITH_ZLIB / FTP_WITH_BROTLI. An entry is checked
+    // against the file's size and mtime at most once per RECHECK_MS and reloaded if either
+    // changed. Shared by all workers; entries are immutable and replaced whole.
+    class StaticAssetCache {
+    public:
+        struct Variant {
+            shared_ptr<const string> headers;   // status line through validators; no Connection line
+            shared_ptr<const string> body;
+            string etag;                        // quoted
+            string validators;                  // header lines a 304 for this variant repeats
+        };
+
+        struct Asset {
+            unsigned long long fileId = 0;
+            long long size = 0;
+            long long modified = -1;            // -1 when not backed by a file
+            Variant identity;
+            Variant gzip;       // body is null when there is no such variant
+            Variant brotli;
+
+            const Variant& select(string_view acceptEncoding) const {
+                if (brotli.body && Compression::accepts(acceptEncoding, "br")) return brotli;
+                if (gzip.body && Compression::accepts(acceptEncoding, "gzip")) return gzip;
+                return identity;
+            }
+        };
+
+    private:
+        static const int RECHECK_MS = 1000;
+        static const long long MAX_ASSET_BYTES = 8 * 1024 * 1024;   // larger files stream from disk
+
+        struct Entry {
+            shared_ptr<const Asset> asset;
+            chrono::steady_clock::time_point checked;
+        };
+
+        string root;
+        mutex assetsMutex;
+        unordered_map<string, Entry> assets;
+
+        static bool compressible(const string& contentType) {
+            return contentType.rfind("text/", 0) == 0 || contentType == "application/javascript" ||
+                   contentType == "application/json" || contentType == "image/svg+xml";
+        }
+
+        static bool readWhole(const string& path, long long maxBytes, string& content, long long& modified,
+                              unsigned long long* fileId = nullptr) {
+            long long size = 0;
+            int fd = Platform::openFileForRead(path, size, &modified, fileId);
+            if (fd == -1) return false;
+            bool ok = size <= maxBytes;
+            if (ok) content.assign((size_t)size, '\0');
+            long long done = 0;
+            while (ok && done < size) {
+                int got = Platform::readFileAt(fd, &content[(size_t)done], (int)(size - done), done);
+                if (got <= 0) ok = false;
+                else done += got;
+            }
+            Platform::closeFile(fd);
+            return ok;
+        }
+
+        // A precompressed sibling, unless it is missing or older than the file it encodes.
+        static string readPrecompressed(const string& path, long long sourceModified) {
+            string content;
+            long long modified = 0;
+            if (!readWhole(path, MAX_ASSET_BYTES, content, modified) || modified < sourceModified) return "";
+            return content;
+        }
+
+        static string gzipCompress(const string& input) {
+    #ifdef FTP_HAVE_ZLIB
+            z_stream zs = {};
+            if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return "";
+            string out(deflateBound(&zs, (uLong)input.size()), '\0');
+            zs.next_in = (Bytef*)input.data();
+            zs.avail_in = (uInt)input.size();
+            zs.next_out = (Bytef*)&out[0];
+            zs.avail_out = (uInt)out.size();
+            int rc = deflate(&zs, Z_FINISH);
+            out.resize(zs.total_out);
+            deflateEnd(&zs);
+            return rc == Z_STREAM_END ? out : "";
+    #else
+            (void)input;
+            return "";
+    #endif
+        }
+
+        static string brotliCompress(const string& input) {
+    #ifdef FTP_HAVE_BROTLI
+            size_t size = BrotliEncoderMaxCompressedSize(input.size());
+            if (size == 0) return "";
+            string out(size, '\0');
+            if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, input.size(),
+                                       (const uint8_t*)input.data(), &size, (uint8_t*)&out[0])) return "";
+            out.resize(size);
+            return out;
+    #else
+            (void)input;
+            return "";
+    #endif
+        }
+
+        static Variant makeVariant(const string& contentType, const string& encoding, const string& tag,
+                                   long long modified, string body, bool vary) {
+            Variant variant;
+            // Each encoding is a different representation, so it needs its own validator.
+            variant.etag = "\"" + tag + (encoding.empty() ? "" : "-" + encoding) + "\"";
+            variant.validators = "ETag: " + variant.etag + "\r\n";
+            if (modified >= 0) variant.validators += "Last-Modified: " + HttpDate::format(modified) + "\r\n";
+            if (vary) variant.validators += "Vary: Accept-Encoding\r\n";
+
+            string headers = "HTTP/1.1 200 OK\r\nContent-Type: " + contentType + "\r\n" +
+                             "Content-Length: " + to_string(body.size()) + "\r\n";
+            if (!encoding.empty()) headers += "Content-Encoding: " + encoding + "\r\n";
+            headers += variant.validators;
+            variant.headers = make_shared<const string>(move(headers));
+            variant.body = make_shared<const string>(move(body));
+            return variant;
+        }
+
+        shared_ptr<const Asset> load(const string& name) const {
+            string path = root + name;
+            string content;
+            long long modified = 0;
+            unsigned long long fileId = 0;
+            if (!readWhole(path, MAX_ASSET_BYTES, content, modified, &fileId)) return nullptr;
+
+            string tag = FileManager::versionTag(fileId, (long long)content.size(), modified);
+            shared_ptr<Asset> asset = build(contentTypeFor(name), move(content), tag, modified,
+                                            readPrecompressed(path + ".gz", modified),
+                                            readPrecompressed(path + ".br", modified));
+            asset->fileId = fileId;
+            return asset;
+        }
+
+    public:
+        explicit StaticAssetCache(const string& wwwFolder) : root(wwwFolder) {
+            for (const string& name : Platform::listFiles(root)) lookup(name);
+        }
+
+        // Content-Type by file extension.
+        static string contentTypeFor(const string& path) {
+            static const map<string, string> types = {
+                { "html", "text/html" }, { "htm", "text/html" }, { "css", "text/css" },
+                { "js", "application/javascript" }, { "json", "application/json" },
+                { "txt", "text/plain" }, { "svg", "image/svg+xml" }, { "png", "image/png" },
+                { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" }, { "gif", "image/gif" },
+                { "ico", "image/x-icon" }, { "wasm", "application/wasm" },
+            };
+            size_t dot = path.rfind('.');
+            if (dot == string::npos || path.find('/', dot) != string::npos) return "application/octet-stream";
+            string ext = path.substr(dot + 1);
+            transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            auto it = types.find(ext);
+            return it == types.end() ? "application/octet-stream" : it->second;
+        }
+
+        // Builds an asset from content already in memory; gz and br are precompressed
+        // variants, or empty to have them made here when the content type benefits.
+        // modified is the Last-Modified time, or -1 for none.
+        static shared_ptr<Asset> build(const string& contentType, string content, const string& tag,
+                                       long long modified, string gz = "", string br = "") {
+            bool vary = compressible(contentType);
+            if (vary) {
+                if (gz.empty()) gz = gzipCompress(content);
+                if (br.empty()) br = brotliCompress(content);
+            }
+
+            shared_ptr<Asset> asset = make_shared<Asset>();
+            asset->size = (long long)content.size();
+            asset->modified = modified;
+            if (!gz.empty() && gz.size() < content.size()) asset->gzip = makeVariant(contentType, "gzip", tag, modified, move(gz), vary);
+            if (!br.empty() && br.size() < content.size()) asset->brotli = makeVariant(contentType, "br", tag, modified, move(br), vary);
+            asset->identity = makeVariant(contentType, "", tag, modified, move(content), vary);
+            return asset;
+        }
+
+        // The asset for a path relative to www/, or null when it isn't a file small enough
+        // to cache.
+        shared_ptr<const Asset> lookup(const string& name) {
+            auto now = chrono::steady_clock::now();
+            lock_guard<mutex> lock(assetsMutex);
+            auto it = assets.find(name);
+            if (it != assets.end() && now - it->second.checked < chrono::milliseconds(RECHECK_MS)) {
+                return it->second.asset;
+            }
+
+            long long size = 0, modified = 0;
+            unsigned long long fileId = 0;
+            int fd = Platform::openFileForRead(root + name, size, &modified, &fileId);
+            if (fd == -1) {
+                if (it != assets.end()) assets.erase(it);
+                return nullptr;
+            }
+            Platform::closeFile(fd);
+            const Asset* cached = it != assets.end() ? it->second.asset.get() : nullptr;
+            if (cached && cached->fileId == fileId && cached->size == size && cached->modified == modified) {
+                it->second.checked = now;
+                return it->second.asset;
+            }
+
+            shared_ptr<const Asset> asset = load(name);
+            if (!asset) {
+                if (it != assets.end()) assets.erase(it);
+                return nullptr;
+            }
+            Entry& entry = assets[name];
+            entry.asset = asset;
+            entry.checked = now;
+            return asset;
+        }
+    };
+
+    // Admission control shared by every worker: caps on open connections and on transfers in
+    // progress, and counts of every request or connection turned away, by reason. A
+    // connection over the cap is answered 503 with Retry-After as soon as it is accepted,
+    // before any state is allocated for it, so an overloaded server sheds load cheaply and
+    // the connections it has admitted keep their latency. The loops enforce the read
+    // deadlines and the minimum transfer rate and record what they cut off here.
+    class AdmissionControl {
+    public:
+        enum Reason { CONNECTIONS, TRANSFERS, HEADER_TIMEOUT, HEADER_TOO_LARGE, BODY_TIMEOUT, SLOW_TRANSFER, REASONS };
+
+        static const int RETRY_AFTER_SECONDS = 2;
+
+    private:
+        int maxConnections;     // 0 = no cap
+        int maxTransfers;
+        atomic<int> connections{0};
+        atomic<int> transfers{0};
+        atomic<long long> rejected[REASONS];
+
+        static bool claim(atomic<int>& count, int limit) {
+            int current = count.load(memory_order_relaxed);
+            do {
+                if (limit > 0 && current >= limit) return false;
+            } while (!count.compare_exchange_weak(current, current + 1, memory_order_relaxed));
+            return true;
+        }
+
+    public:
+        AdmissionControl(int connectionLimit, int transferLimit)
+            : maxConnections(connectionLimit), maxTransfers(transferLimit) {
+            for (atomic<long long>& count : rejected) count = 0;
+        }
+
+        // Takes a connection slot; on false the caller refuses the connection (busyResponse).
+        bool admitConnection() {
+            if (claim(connections, maxConnections)) return true;
+            record(CONNECTIONS);
+            return false;
+        }
+
+        void connectionClosed() { connections--; }
+
+        // A transfer (an upload body or a download) holds a slot from its request until the
+        // loop has written its response or the connection closes. A connection holds at
+        // most one, so pipelined downloads don't count twice.
+        bool beginTransfer(Connection& conn) {
+            if (!conn.transferring) {
+                if (!claim(transfers, maxTransfers)) {
+                    record(TRANSFERS);
+                    return false;
+                }
+                conn.transferring = true;
+            }
+            conn.windowStarted = chrono::steady_clock::now();
+            conn.windowBytes = 0;
+            conn.flow.held = false;
+            return true;
+        }
+
+        void endTransfer(Connection& conn) {
+            if (!conn.transferring) return;
+            conn.transferring = false;
+            transfers--;
+        }
+
+        void record(Reason reason) { rejected[reason]++; }
+
+        static string retryAfterHeader() {
+            return "Retry-After: " + to_string(RETRY_AFTER_SECONDS) + "\r\n";
+        }
+
+        // What a connection refused at accept gets; it may not even be HTTP yet, but a
+        // command client shows the text and gives up just the same.
+        static const string& busyResponse() {
+            static const string response = "HTTP/1.1 503 Service Unavailable\r\n" + retryAfterHeader() +
+                "Content-Type: text/plain\r\nContent-Length: 12\r\nConnection: close\r\n\r\nServer busy\n";
+            return response;
+        }
+
+        string report() const {
+            static const char* const names[REASONS] = {
+                "connection cap", "transfer cap", "header timeout", "header too large", "body timeout", "slow transfer",
+            };
+            ostringstream out;
+            out << "admission: " << connections.load() << " connections (cap " << maxConnections << "), "
+                << transfers.load() << " transfers (cap " << maxTransfers << "); rejected:";
+            for (int i = 0; i < REASONS; ++i) out << (i ? ", " : " ") << names[i] << " " << rejected[i].load();
+            out << "\n";
+            return out.str();
+        }
+    };
+
+    class HttpRequestHandler {
+    private:
+        static const long long MAX_BUFFERED_BODY = 1024 * 1024;
+        static const size_t MAX_RANGES = 16;
+
+        enum RangeResult { RANGE_IGNORED, RANGE_UNSATISFIABLE, RANGE_SATISFIABLE };
+        typedef pair<long long, long long> ByteRange;   // first and last byte, inclusive
+
+        FileManager& fileManager;
+        NetworkManager& networkManager;
+        ChunkedUploadManager& chunkedUploads;
+        StaticAssetCache& assets;
+        TransferShaper& shaper;
+        AdmissionControl& admission;
+
+        string urlDecode(const string& str) const {
+            string res;
+            for (size_t i = 0; i < str.size(); ++i) {
+                if (str[i] == '%') {
+                    if (i + 2 < str.size()) {
+                        int hi = isdigit(str[i+1]) ? str[i+1] - '0' : tolower(str[i+1]) - 'a' + 10;
+                        int lo = isdigit(str[i+2]) ? str[i+2] - '0' : tolower(str[i+2]) - 'a' + 10;
+                        res += (char)(hi * 16 + lo);
+                        i += 2;
+                    } else {
+                        res += str[i];
+                    }
+                } else if (str[i] == '+') {
+                    res += ' ';
+                } else {
+                    res += str[i];
+                }
+            }
+            return res;
+        }
+
+        string getHeaderValue(const HttpRequest& req, const char* key) const {
+            return string(req.header(key));
+        }
+
+        // One cookie from the Cookie header's "name=value; name=value" list, matched by its
+        // whole name.
+        string_view getCookieValue(const HttpRequest& req, string_view cookieName) const {
+            string_view cookies = req.header("Cookie");
+            while (!cookies.empty()) {
+                size_t semi = cookies.find(';');
+                string_view pair = cookies.substr(0, semi);
+                cookies = semi == string_view::npos ? string_view() : cookies.substr(semi + 1);
+                while (!pair.empty() && pair.front() == ' ') pair.remove_prefix(1);
+                size_t eq = pair.find('=');
+                if (eq != string_view::npos && pair.substr(0, eq) == cookieName) return pair.substr(eq + 1);
+            }
+            return string_view();
+        }
+
+        // body is taken by value so that callers handing over a temporary or a moved string
+        // have it queued as it is.
+        void sendHttpResponse(Connection& conn, int status, const string& contentType, string body, const string& additionalHeaders = "") const {
+            HttpResponse response(status);
+            response.header("Content-Type", contentType).header("Content-Length", (long long)body.size()).lines(additionalHeaders);
+            response.send(conn, move(body));
+        }
+
+        // The Connection line and the blank line ending a head, shared by every response.
+        static const shared_ptr<const string>& headEnd(const Connection& conn) {
+            static const shared_ptr<const string> keepAlive = make_shared<const string>("Connection: keep-alive\r\n\r\n");
+            static const shared_ptr<const string> close = make_shared<const string>("Connection: close\r\n\r\n");
+            return conn.keepAlive ? keepAlive : close;
+        }
+
+        // For requests whose body will not be read: the connection can't be reused after this.
+        void rejectRequest(Connection& conn, int status, const string& contentType, const string& body,
+                           const string& additionalHeaders = "") const {
+            conn.keepAlive = false;
+            sendHttpResponse(conn, status, contentType, body, additionalHeaders);
+            conn.finish();
+        }
+
+        // Whether a GET can be answered with 304 (RFC 9110 13.2.2): If-None-Match decides when
+        // present, using weak comparison; otherwise If-Modified-Since. tag is the quoted ETag,
+        // modified the Last-Modified time or -1 when the resource has none.
+        bool notModified(const HttpRequest& req, const string& tag, long long modified) const {
+            string ifNoneMatch = getHeaderValue(req, "If-None-Match");
+            if (!ifNoneMatch.empty()) {
+                istringstream list(ifNoneMatch);
+                string candidate;
+                while (getline(list, candidate, ',')) {
+                    candidate.erase(0, candidate.find_first_not_of(" \t"));
+                    candidate.erase(candidate.find_last_not_of(" \t") + 1);
+                    if (candidate.compare(0, 2, "W/") == 0) candidate.erase(0, 2);
+                    if (candidate == "*" || candidate == tag) return true;
+                }
+                return false;
+            }
+            string ifModifiedSince = getHeaderValue(req, "If-Modified-Since");
+            if (ifModifiedSince.empty() || modified < 0) return false;
+            long long since = HttpDate::parse(ifModifiedSince);
+            return since >= 0 && modified <= since;
+        }
+
+        // validators: the ETag/Last-Modified/Vary lines the full response would have carried.
+        void sendNotModified(Connection& conn, const string& validators) const {
+            HttpResponse response(304);
+            response.lines(validators).sendHead(conn);
+        }
+
+        // HTTP/1.1 connections persist unless the client sends "Connection: close"; HTTP/1.0
+        // ones only when it asks for keep-alive. The loop has already cleared conn.keepAlive
+        // if the connection reached its request limit.
+        void negotiateKeepAlive(Connection& conn, const HttpRequest& req) const {
+            string connection = getHeaderValue(req, "Connection");
+            transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+            bool persistent = req.http11()
+                ? connection.find("close") == string::npos
+                : connection.find("keep-alive") != string::npos;
+            if (!persistent) conn.keepAlive = false;
+        }
+
+        // Also records on conn whose transfer this is, for the per-user bandwidth limit.
+        bool isAuthenticated(Connection& conn, const HttpRequest& req) const {
+            return fileManager.getSessionManager().validateToken(getCookieValue(req, "session"), &conn.flow.user);
+        }
+
+    public:
+        HttpRequestHandler(FileManager& fm, NetworkManager& nm, ChunkedUploadManager& cu, StaticAssetCache& sa,
+                           TransferShaper& ts, AdmissionControl& ac)
+            : fileManager(fm), networkManager(nm), chunkedUploads(cu), assets(sa), shaper(ts), admission(ac) {}
+
+        // Called by the loop about once a second.
+        void expireSessions() {
+            fileManager.getSessionManager().expireIdle();
+        }
+
+        // Called once a request's headers are complete, before any body is buffered. Uploads
+        // take their body over as a stream (Connection::State::HttpUploadBody) and other
+        // requests with an oversized body are refused. Returns false when the loop should
+        // buffer the whole request and call handleRequest as usual.
+        bool beginStreamingRequest(Connection& conn, const HttpRequest& req) {
+            negotiateKeepAlive(conn, req);
+            string method(req.method), path(req.target);
+            long long contentLength = req.contentLength;
+
+            string route = routeOf(path);
+            if (method == "POST" && (route == "/upload" || route == "/upload/chunk" || route == "/api/delta")) {
+                if (!isAuthenticated(conn, req)) {
+                    rejectRequest(conn, 401, "text/html",
+                        "<html><body><h1>401 Unauthorized</h1><p>Please <a href='/login'>login</a></p></body></html>");
+                    return true;
+                }
+                if (!admission.beginTransfer(conn)) {
+                    rejectRequest(conn, 503, "text/plain", "Server busy", AdmissionControl::retryAfterHeader());
+                    return true;
+                }
+                string boundary = MultipartParser::boundaryOf(req.header("Content-Type"));
+                if (route == "/upload" && !boundary.empty()) {
+                    handleMultipartUpload(conn, boundary, contentLength, getHeaderValue(req, "Content-Encoding"));
+                } else if (route == "/upload") {
+                    handleUpload(conn, filenameParam(path), contentLength, getHeaderValue(req, "Content-Encoding"));
+                } else if (route == "/api/delta") {
+                    handleDeltaUpload(conn, path, contentLength);
+                } else {
+                    handleUploadChunk(conn, path, contentLength);
+                }
+                return true;
+            }
+
+            if (contentLength > MAX_BUFFERED_BODY) {
+                rejectRequest(conn, 413, "text/plain", "Request body too large");
+                return true;
+            }
+            return false;
+        }
+
+        // Body bytes of a streaming upload; returns how many belonged to it.
+        size_t handleUploadData(Connection& conn, const char* data, size_t len) {
+            if (conn.multipart) {
+                size_t used = (size_t)min((unsigned long long)len, conn.dataRemaining);
+                conn.dataRemaining -= used;
+                if (!conn.multipart->write(data, used)) {
+                    bool failed = conn.multipart->hasFailed();
+                    conn.multipart.reset();
+                    rejectRequest(conn, failed ? 500 : 400, "text/plain", failed ? "Error writing file" : "Malformed multipart body");
+                    return len;
+                }
+                if (conn.dataRemaining == 0) finishMultipartUpload(conn);
+                return used;
+            }
+            if (conn.uploadDecoder) {
+                size_t used = (size_t)min((unsigned long long)len, conn.dataRemaining);
+                UploadSink& sink = *conn.uploadSink;
+                long long decoded = 0;
+                bool ok = conn.uploadDecoder->update(data, used, [&](const char* out, size_t n) {
+                    decoded += (long long)n;
+                    return sink.write(out, n) == n && !sink.hasFailed();
+                });
+                TransferStats::recordEncoded(TransferStats::UPLOAD, decoded, (long long)used);
+                conn.dataRemaining -= used;
+                if (!ok) {
+                    bool failed = sink.hasFailed();
+                    conn.uploadSink.reset();
+                    conn.uploadDecoder.reset();
+                    rejectRequest(conn, failed ? 500 : 400, "text/plain", failed ? "Error writing file" : "Corrupt compressed body");
+                    return len;
+                }
+                if (conn.dataRemaining == 0) finishEncodedUpload(conn);
+                return used;
+            }
+
+            size_t used = conn.uploadSink->write(data, len);
+            if (conn.uploadSink->hasFailed()) {
+                conn.uploadSink.reset();
+                conn.chunkUploadId.clear();
+                conn.deltaVersion.clear();
+                rejectRequest(conn, 500, "text/plain", "Error writing file");
+                return len;
+            }
+            if (conn.uploadSink->complete()) {
+                finishUpload(conn);
+            }
+            return used;
+        }
+
+        // A head HttpParser refused; what follows it can't be framed, so the connection ends.
+        void rejectMalformed(Connection& conn) const {
+            rejectRequest(conn, 400, "text/plain", "Malformed request");
+        }
+
+        void rejectOversizedHead(Connection& conn) const {
+            rejectRequest(conn, 431, "text/plain", "Request header too large");
+        }
+
+        // A request head or body that missed its read deadline.
+        void rejectTimedOut(Connection& conn) const {
+            rejectRequest(conn, 408, "text/plain", "Request timed out");
+        }
+
+        // A request with its whole body buffered (req.body).
+        void handleRequest(Connection& conn, const HttpRequest& req) {
+            string method(req.method), path(req.target);
+
+            // Handle login page and login request without authentication
+            if (path == "/login" || path == "/login.html") {
+                serveLoginPage(conn, req);
+                return;
+            }
+
+            if (path == "/auth" && method == "POST") {
+                handleLogin(conn, req);
+                return;
+            }
+
+            if (path == "/logout") {
+                handleLogout(conn, req);
+                return;
+            }
+
+            if (path == "/") {
+                if (isAuthenticated(conn, req)) {
+                    serveStaticFile(conn, req, "/index.html");
+                } else {
+                    sendHttpResponse(conn, 302, "text/html", "", "Location: /login\r\n");
+                }
+                return;
+            }
+
+            // Check authentication for other routes
+            if (!isAuthenticated(conn, req)) {
+                sendHttpResponse(conn, 401, "text/html",
+                    "<html><body><h1>401 Unauthorized</h1><p>Please <a href='/login'>login</a></p></body></html>");
+                return;
+            }
+
+            // Handle authenticated routes
+            if (method == "GET") {
+                handleGetRequest(conn, req, path);
+            } else if (method == "POST") {
+                handlePostRequest(conn, path);
+            } else {
+                sendHttpResponse(conn, 400, "text/plain", "Unsupported request method");
+            }
+        }
+
+    private:
+        void serveLoginPage(Connection& conn, const HttpRequest& req) const {
+            static const shared_ptr<const StaticAssetCache::Asset> page = StaticAssetCache::build("text/html", R"(
+    <!DOCTYPE html>
+    <html>
+    <head>
+        <meta charset="utf-8">
+        <title>FTP Server - Login</title>
+        <style>
+            * { margin: 0; padding: 0; box-sizing: border-box; }
+            body { 
+                font-family: 'Segoe UI', Tahoma, Geneva, Verdana, sans-serif;
+                background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
+                height: 100vh;
+                display: flex;
+                align-items: center;
+                justify-content: center;
+            }
+            .login-container {
+                background: rgba(255, 255, 255, 0.95);
+                padding: 40px;
+                border-radius: 15px;
+                box-shadow: 0 10px 30px rgba(0, 0, 0, 0.2);
+                width: 100%;
+                max-width: 400px;
+            }
+            h1 { 
+                text-align: center; 
+                margin-bottom: 30px;
+                color: #2c3e50;
+            }
+            .form-group { margin-bottom: 20px; }
+            label { display: block; margin-bottom: 5px; color: #34495e; }
+            input[type="text"], input[type="password"] {
+                width: 100%;
+                padding: 12px;
+                border: 2px solid #ddd;
+                border-radius: 8px;
+                font-size: 14px;
+            }
+            input:focus { outline: none; border-color: #3498db; }
+            button {
+                width: 100%;
+                padding: 12px;
+                background: #3498db;
+                color: white;
+                border: none;
+                border-radius: 8px;
+                font-size: 16px;
+                cursor: pointer;
+                transition: background 0.3s ease;
+            }
+            button:hover { background: #2980b9; }
+            .error { 
+                color: #e74c3c; 
+                margin-top: 10px; 
+                text-align: center;
+                min-height: 20px;
+            }
+            .credentials {
+                margin-top: 20px;
+                padding: 15px;
+                background: #f8f9fa;
+                border-radius: 8px;
+                border-left: 4px solid #3498db;
+            }
+            .credentials h3 {
+                margin-bottom: 10px;
+                color: #2c3e50;
+            }
+        </style>
+    </head>
+    <body>
+        <div class="login-container">
+            <h1>🔐 FTP Server Login</h1>
+            <form id="loginForm">
+                <div class="form-group">
+                    <label>Username:</label>
+                    <input type="text" id="username" name="username" required>
+                </div>
+                <div class="form-group">
+                    <label>Password:</label>
+                    <input type="password" id="password" name="password" required>
+                </div>
+                <button type="submit">Login</button>
+            </form>
+            <div id="error" class="error"></div>
+            
+            <div class="credentials">
+                <h3>Default Credentials:</h3>
+                <p><strong>Username:</strong> admin</p>
+                <p><strong>Password:</strong> password123</p>
+            </div>
+        </div>
+
+        <script>
+            document.getElementById('loginForm').addEventListener('submit', async (e) => {
+                e.preventDefault();
+                
+                const username = document.getElementById('username').value;
+                const password = document.getElementById('password').value;
+                const errorDiv = document.getElementById('error');
+                
+                errorDiv.textContent = ''; // Clear previous errors
+                
+                try {
+                    const formData = new FormData();
+                    formData.append('username', username);
+                    formData.append('password', password);
+                    
+                    const response = await fetch('/auth', {
+                        method: 'POST',
+                        body: formData
+                    });
+                    
+                    if (response.ok) {
+                        // Login successful, redirect to main page
+                        window.location.href = '/';
+                    } else {
+                        const errorText = await response.text();
+                        errorDiv.textContent = 'Login failed: ' + errorText;
+                    }
+                } catch (error) {
+                    errorDiv.textContent = 'Login failed: ' + error.message;
+                }
+            });
+
+            // Auto-focus username field
+            document.getElementById('username').focus();
+        </script>
+    </body>
+    </html>
+            )", "login-1", -1);
+            sendCachedAsset(conn, req, *page);
+        }
+
+        // A cached response is its prebuilt headers, this connection's Connection line and the
+        // shared body; the loop writes the three with one gathered send.
+        void sendCachedAsset(Connection& conn, const HttpRequest& req, const StaticAssetCache::Asset& asset) const {
+            const StaticAssetCache::Variant& variant = asset.select(req.header("Accept-Encoding"));
+            if (notModified(req, variant.etag, asset.modified)) {
+                sendNotModified(conn, variant.validators);
+                return;
+            }
+            conn.sendShared(variant.headers);
+            conn.sendShared(headEnd(conn));
+            conn.sendShared(variant.body);
+        }
+
+        // The plain fields of a buffered multipart/form-data body; file parts are skipped.
+        static bool formFields(string_view body, const string& boundary, map<string, string>& fields) {
+            string name;
+            bool file = false;
+            MultipartParser parser(boundary,
+                [&](const MultipartParser::Part& part) {
+                    name = part.name;
+                    file = !part.filename.empty();
+                    if (!file) fields[name].clear();
+                    return true;
+                },
+                [&](const char* data, size_t len) {
+                    if (!file) fields[name].append(data, len);
+                    return true;
+                },
+                [] { return true; });
+            return parser.feed(body.data(), body.size()) && parser.finished();
+        }
+
+        void handleLogin(Connection& conn, const HttpRequest& req) {
+        string body(req.body);
+        string username, password;
+
+        // Check if it's multipart/form-data
+        string boundary = MultipartParser::boundaryOf(req.header("Content-Type"));
+        if (!boundary.empty()) {
+            map<string, string> fields;
+            if (formFields(req.body, boundary, fields)) {
+                username = fields["username"];
+                password = fields["password"];
+            }
+        } else {
+            // Parse URL-encoded form data (original code)
+            size_t userPos = body.find("username=");
+            size_t passPos = body.find("&password=");
+            if (userPos != string::npos && passPos != string::npos) {
+                username = urlDecode(body.substr(userPos + 9, passPos - (userPos + 9)));
+                password = urlDecode(body.substr(passPos + 10));
+            }
+        }
+
+        // Debug output
+        cout << "Login attempt - Username: " << username << ", Password: " << password << endl;
+
+        string token;
+        if (fileManager.getSessionManager().authenticate(username, password)) {
+            token = fileManager.getSessionManager().issueToken(username);
+            if (token.empty()) {
+                sendHttpResponse(conn, 500, "text/plain", "Could not start a session");
+                return;
+            }
+        }
+        if (!token.empty()) {
+            string redirectPage = R"(
+    <html>
+    <head>
+        <meta http-equiv="refresh" content="0;url=/">
+    </head>
+    <body>
+        <p>Login successful! Redirecting...</p>
+    </body>
+    </html>
+            )";
+            sendHttpResponse(conn, 200, "text/html", redirectPage, 
+                        "Set-Cookie: session=" + token + "; Path=/; HttpOnly; SameSite=Strict\r\n");
+            cout << "Login successful for user: " << username << endl;
+        } else {
+            sendHttpResponse(conn, 401, "text/plain", "Invalid credentials");
+            cout << "Login failed for user: " << username << endl;
+        }
+    }
+
+        void handleLogout(Connection& conn, const HttpRequest& req) {
+            fileManager.getSessionManager().revokeToken(getCookieValue(req, "session"));
+            string logoutPage = R"(
+    <html>
+    <head>
+        <meta http-equiv="refresh" content="2;url=/login">
+    </head>
+    <body>
+        <p>Logged out successfully. Redirecting to login page...</p>
+    </body>
+    </html>
+            )";
+            sendHttpResponse(conn, 200, "text/html", logoutPage,
+                        "Set-Cookie: session=; Path=/; Expires=Thu, 01 Jan 1970 00:00:00 GMT\r\n");
+        }
+
+        void handleGetRequest(Connection& conn, const HttpRequest& req, const string& path) {
+            string actualPath = (path == "/") ? "/index.html" : path;
+
+            if (routeOf(actualPath) == "/upload/status") {
+                string id = queryParam(actualPath, "id");
+                ChunkedUploadManager::Status status;
+                if (!chunkedUploads.status(id, status)) {
+                    sendHttpResponse(conn, 404, "text/plain", "Unknown upload");
+                } else {
+                    sendHttpResponse(conn, 200, "application/json", uploadStatusJson(id, status));
+                }
+                return;
+            }
+
+            if (routeOf(actualPath) == "/api/files") {
+                handleFileListApi(conn, req, actualPath);
+                return;
+            }
+
+            if (routeOf(actualPath) == "/api/signature") {
+                handleSignatureRequest(conn, queryParam(actualPath, "filename"));
+                return;
+            }
+
+            if (actualPath.rfind("/list_trash", 0) == 0) {
+                sendListing(conn, req, "=== Trash Files ===\n", true);
+                return;
+            }
+            
+            if (actualPath.rfind("/list", 0) == 0) {
+                sendListing(conn, req, "=== Server Files ===\n", false);
+                return;
+            }
+
+            if (actualPath.rfind("/download", 0) == 0) {
+                if (!admission.beginTransfer(conn)) {
+                    sendHttpResponse(conn, 503, "text/plain", "Server busy", AdmissionControl::retryAfterHeader());
+                    return;
+                }
+                handleDownloadRequest(conn, req, actualPath);
+                return;
+            }
+
+            if (actualPath == "/stats") {
+                sendHttpResponse(conn, 200, "text/plain", TransferStats::report() + BufferPool::report() +
+                                                      fileManager.getSessionManager().report() + shaper.report() +
+                                                      admission.report());
+                return;
+            }
+
+            if (actualPath == "/limits") {
+                sendHttpResponse(conn, 200, "application/json", limitsJson(shaper.limits()));
+                return;
+            }
+
+            serveStaticFile(conn, req, actualPath);
+        }
+
+        // Listings are versioned by the catalog, so a poll that finds nothing new costs a 304.
+        // The tag is read before the folder: a change racing the listing can only leave the
+        // body newer than its tag, which the next poll corrects.
+        void sendListing(Connection& conn, const HttpRequest& req, const string& title, bool trash) const {
+            string tag = "\"" + fileManager.catalogTag() + "\"";
+            string validators = "ETag: " + tag + "\r\nCache-Control: no-cache\r\n";
+            if (notModified(req, tag, -1)) {
+                sendNotModified(conn, validators);
+                return;
+            }
+            sendHttpResponse(conn, 200, "text/plain", title + (trash ? fileManager.listTrash() : fileManager.listUploads()), validators);
+        }
+
+        // GET /api/files?folder=uploads|trash&sort=name|size|mtime&order=asc|desc&limit=&cursor=
+        //               &prefix=&glob=&fields=name,size,mtime
+        // One page of a folder as JSON: {"folder","total","files":[...],"next"}, where next is
+        // the cursor for the following page or null. Pages come from the catalog's ordered
+        // indexes and are versioned by the catalog like the plain listings.
+        void handleFileListApi(Connection& conn, const HttpRequest& req, const string& path) {
+            static const size_t DEFAULT_PAGE = 100;
+            static const size_t MAX_PAGE = 1000;
+
+            string folder = queryParam(path, "folder");
+            string sort = queryParam(path, "sort");
+            string order = queryParam(path, "order");
+            string fields = queryParam(path, "fields");
+            long long limit = numberParam(path, "limit");
+            if (folder.empty()) folder = "uploads";
+            if (fields.empty()) fields = "name,size,mtime";
+
+            FileManager::ListQuery query;
+            query.sort = sort == "size" ? FileManager::ListQuery::SIZE :
+                         sort == "mtime" ? FileManager::ListQuery::MODIFIED : FileManager::ListQuery::NAME;
+            query.descending = order == "desc";
+            query.prefix = queryParam(path, "prefix");
+            query.glob = queryParam(path, "glob");
+            query.limit = limit < 0 ? DEFAULT_PAGE : (size_t)min((long long)MAX_PAGE, limit);
+
+            bool wantName = false, wantSize = false, wantModified = false;
+            istringstream fieldList(fields);
+            string field;
+            bool valid = (folder == "uploads" || folder == "trash") &&
+                         (sort.empty() || sort == "name" || sort == "size" || sort == "mtime") &&
+                         (order.empty() || order == "asc" || order == "desc") &&
+                         (limit >= 0 || queryParam(path, "limit").empty()) &&
+                         hexDecode(queryParam(path, "cursor"), query.after);
+            while (valid && getline(fieldList, field, ',')) {
+                if (field == "name") wantName = true;
+                else if (field == "size") wantSize = true;
+                else if (field == "mtime") wantModified = true;
+                else valid = false;
+            }
+            if (!valid) {
+                sendHttpResponse(conn, 400, "text/plain", "Bad listing parameters");
+                return;
+            }
+
+            string tag = "\"" + fileManager.catalogTag() + "\"";
+            string validators = "ETag: " + tag + "\r\nCache-Control: no-cache\r\n";
+            if (notModified(req, tag, -1)) {
+                sendNotModified(conn, validators);
+                return;
+            }
+
+            FileManager::ListPage page;
+            if (!fileManager.listPage(folder == "trash", query, page)) {
+                sendHttpResponse(conn, 400, "text/plain", "Bad cursor");
+                return;
+            }
+
+            string json = "{\"folder\":\"" + folder + "\",\"total\":" + to_string(page.total) + ",\"files\":[";
+            for (size_t i = 0; i < page.entries.size(); ++i) {
+                const auto& entry = page.entries[i];
+                string item;
+                if (wantName) item += ",\"name\":\"" + jsonEscape(entry.first) + "\"";
+                if (wantSize) item += ",\"size\":" + to_string(entry.second.size);
+                if (wantModified) item += ",\"mtime\":" + to_string(entry.second.modified);
+                if (!item.empty()) item[0] = '{';
+                else item = "{";
+                json += (i > 0 ? "," : "") + item + "}";
+            }
+            json += "],\"next\":" + (page.next.empty() ? string("null") : "\"" + hexEncode(page.next) + "\"") + "}";
+            sendHttpResponse(conn, 200, "application/json", move(json), validators);
+        }
+
+        // Listing cursors travel hex-encoded so they need no escaping in a URL.
+        static string hexEncode(const string& raw) {
+            static const char digits[] = "0123456789abcdef";
+            string out;
+            out.reserve(raw.size() * 2);
+            for (unsigned char c : raw) {
+                out += digits[c >> 4];
+                out += digits[c & 0xf];
+            }
+            return out;
+        }
+
+        static bool hexDecode(const string& hex, string& raw) {
+            raw.clear();
+            if (hex.size() % 2 != 0) return false;
+            for (size_t i = 0; i < hex.size(); i += 2) {
+                int hi = hexDigit(hex[i]), lo = hexDigit(hex[i + 1]);
+                if (hi < 0 || lo < 0) return false;
+                raw += (char)(hi << 4 | lo);
+            }
+            return true;
+        }
+
+        static int hexDigit(char c) {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+        }
+
+        void handleDownloadRequest(Connection& conn, const HttpRequest& req, const string& path) {
+            size_t q = path.find("?");
+            string filename;
+            if (q != string::npos) {
+                string query = path.substr(q + 1);
+                size_t eq = query.find("file=");
+                if (eq != string::npos) filename = query.substr(eq + 5);
+            }
+            
+            if (filename.empty()) {
+                sendHttpResponse(conn, 400, "text/plain", "Missing file parameter");
+                return;
+            }
+
+            string filepath = fileManager.getUploadFolder() + filename;
+            if (!fileManager.hasUpload(filename)) {
+                sendHttpResponse(conn, 404, "text/plain", "File not found");
+                return;
+            }
+
+            StoredFile file;
+            if (!file.open(filepath, fileManager.getChunkStore())) {
+                sendHttpResponse(conn, 500, "text/plain", "Unable to open file");
+                return;
+            }
+
+            sendFileResponse(conn, req, file, "application/octet-stream",
+                             "Content-Disposition: attachment; filename=\"" + filename + "\"\r\n");
+        }
+
+        void serveStaticFile(Connection& conn, const HttpRequest& req, const string& path) {
+            string localPath = fileManager.getWwwFolder() + path.substr(1);
+            
+            if (localPath.find("..") != string::npos) {
+                sendHttpResponse(conn, 403, "text/plain", "Forbidden");
+                return;
+            }
+
+            // Range requests and files too large to cache are served from disk.
+            if (getHeaderValue(req, "Range").empty()) {
+                shared_ptr<const StaticAssetCache::Asset> asset = assets.lookup(path.substr(1));
+                if (asset) {
+                    sendCachedAsset(conn, req, *asset);
+                    return;
+                }
+            }
+
+            StoredFile file;
+            if (!file.open(localPath, nullptr)) {
+                sendHttpResponse(conn, 404, "text/plain", "Not Found");
+                return;
+            }
+
+            sendFileResponse(conn, req, file, StaticAssetCache::contentTypeFor(localPath), "");
+        }
+
+        // Strong ETag for a file on disk; also what If-Range is compared against.
+        static string fileTag(unsigned long long fileId, long long size, long long modified) {
+            return "\"" + FileManager::versionTag(fileId, size, modified) + "\"";
+        }
+
+        // Parses "bytes=a-b, c-, -n". Malformed headers and more than MAX_RANGES parts are
+        // ignored (the whole file is sent); parts starting past the end are dropped.
+        RangeResult parseRanges(const string& header, long long size, vector<ByteRange>& ranges) const {
+            ranges.clear();
+            if (header.compare(0, 6, "bytes=") != 0) return RANGE_IGNORED;
+
+            istringstream specs(header.substr(6));
+            string spec;
+            size_t count = 0;
+            while (getline(specs, spec, ',')) {
+                size_t a = spec.find_first_not_of(" \t");
+                size_t b = spec.find_last_not_of(" \t");
+                spec = (a == string::npos) ? "" : spec.substr(a, b - a + 1);
+                size_t dash = spec.find('-');
+                if (++count > MAX_RANGES || dash == string::npos) {
+                    ranges.clear();
+                    return RANGE_IGNORED;
+                }
+                string from = spec.substr(0, dash);
+                string to = spec.substr(dash + 1);
+                bool valid = !(from.empty() && to.empty()) && from.size() <= 18 && to.size() <= 18 &&
+                             from.find_first_not_of("0123456789") == string::npos &&
+                             to.find_first_not_of("0123456789") == string::npos;
+                if (!valid || (!from.empty() && !to.empty() && atoll(to.c_str()) < atoll(from.c_str()))) {
+                    ranges.clear();
+                    return RANGE_IGNORED;
+                }
+
+                long long first, last;
+                if (from.empty()) {
+                    long long suffix = atoll(to.c_str());
+                    if (suffix == 0) continue;
+                    first = max(0LL, size - suffix);
+                    last = size - 1;
+                } else {
+                    first = atoll(from.c_str());
+                    last = to.empty() ? size - 1 : min(atoll(to.c_str()), size - 1);
+                }
+                if (first >= size) continue;
+                ranges.push_back(ByteRange(first, last));
+            }
+            return ranges.empty() ? RANGE_UNSATISFIABLE : RANGE_SATISFIABLE;
+        }
+
+        // Sends the whole file, or 206 with only the parts named by a Range header - a single
+        // part directly, several as multipart/byteranges. A Range is honoured only while
+        // If-Range, if sent, still matches the file's tag.
+        void sendFileResponse(Connection& conn, const HttpRequest& req, const StoredFile& file,
+                              const string& contentType, const string& extraHeaders) {
+            long long size = file.size;
+            string tag = fileTag(file.fileId, size, file.modified);
+            string rangeHeader = getHeaderValue(req, "Range");
+
+            // Whole bodies are compressed when the client takes an encoding and sampling says
+            // it pays; ranges always refer to the identity bytes. The file is only sampled once
+            // a compressed answer is actually on the table.
+            Compression::Codec codec = Compression::NONE;
+            if (rangeHeader.empty() && acceptsChunked(req)) codec = Compression::negotiate(getHeaderValue(req, "Accept-Encoding"));
+            if (codec != Compression::NONE && !CompressedBody::worthCompressing(file)) {
+                TransferStats::recordIncompressible();
+                codec = Compression::NONE;
+            }
+            if (codec != Compression::NONE) tag = tag.substr(0, tag.size() - 1) + "-" + Compression::name(codec) + "\"";
+
+            string validators = "ETag: " + tag + "\r\nLast-Modified: " + HttpDate::format(file.modified) + "\r\n" +
+                                (Compression::enabled() ? "Vary: Accept-Encoding\r\n" : "");
+            if (notModified(req, tag, file.modified)) {
+                sendNotModified(conn, validators);
+                return;
+            }
+            string common = "Accept-Ranges: bytes\r\n" + validators + extraHeaders;
+
+            if (codec != Compression::NONE) {
+                shared_ptr<StoredFile> source = file.share();
+                shared_ptr<CompressedBody> body = source ? make_shared<CompressedBody>(source, codec, CompressedBody::HTTP_CHUNKED)
+                                                         : nullptr;
+                if (!body || !body->begin()) {
+                    sendHttpResponse(conn, 500, "text/plain", "Error opening file");
+                    return;
+                }
+                TransferStats::recordEncodedBody(TransferStats::DOWNLOAD);
+                HttpResponse response(200);
+                response.header("Content-Type", contentType).header("Content-Encoding", Compression::name(codec))
+                        .header("Transfer-Encoding", "chunked").lines(common).sendHead(conn);
+                conn.sendEncoded(body);
+                return;
+            }
+            vector<ByteRange> ranges;
+            string ifRange = getHeaderValue(req, "If-Range");
+            RangeResult result = RANGE_IGNORED;
+            if (!rangeHeader.empty() && (ifRange.empty() || ifRange == tag)) {
+                result = parseRanges(rangeHeader, size, ranges);
+            }
+
+            if (result == RANGE_UNSATISFIABLE) {
+                HttpResponse response(416);
+                response.header("Content-Range", "bytes */" + to_string(size)).header("Content-Length", 0LL)
+                        .lines(common).sendHead(conn);
+                return;
+            }
+
+            if (result == RANGE_IGNORED) {
+                HttpResponse response(200);
+                response.header("Content-Type", contentType).header("Content-Length", size).lines(common).sendHead(conn);
+                if (!file.queue(conn, 0, size)) abandonResponse(conn);
+                return;
+            }
+
+            if (ranges.size() == 1) {
+                const ByteRange& r = ranges[0];
+                HttpResponse response(206);
+                response.header("Content-Type", contentType)
+                        .header("Content-Range", "bytes " + to_string(r.first) + "-" + to_string(r.second) + "/" + to_string(size))
+                        .header("Content-Length", r.second - r.first + 1).lines(common).sendHead(conn);
+                if (!file.queue(conn, r.first, r.second - r.first + 1)) abandonResponse(conn);
+                return;
+            }
+
+            string boundary = "ftp-byteranges-" + tag.substr(1, tag.size() - 2);
+            vector<string> partHeaders;
+            long long length = 0;
+            for (const ByteRange& r : ranges) {
+                partHeaders.push_back("\r\n--" + boundary + "\r\nContent-Type: " + contentType + "\r\n" +
+                                      "Content-Range: bytes " + to_string(r.first) + "-" + to_string(r.second) + "/" +
+                                      to_string(size) + "\r\n\r\n");
+                length += (long long)partHeaders.back().size() + (r.second - r.first + 1);
+            }
+            string closing = "\r\n--" + boundary + "--\r\n";
+            length += (long long)closing.size();
+
+            HttpResponse response(206);
+            response.header("Content-Type", "multipart/byteranges; boundary=" + boundary).header("Content-Length", length)
+                    .lines(common).sendHead(conn);
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                conn.send(partHeaders[i]);
+                if (!file.queue(conn, ranges[i].first, ranges[i].second - ranges[i].first + 1)) {
+                    abandonResponse(conn);
+                    return;
+                }
+            }
+            conn.send(closing);
+        }
+
+        // Chunked transfer coding, which a compressed body of unknown length needs, is HTTP/1.1.
+        static bool acceptsChunked(const HttpRequest& req) {
+            return req.http11();
+        }
+
+        // Out of descriptors mid-body: the promised length can't be met, so end the connection.
+        void abandonResponse(Connection& conn) const {
+            conn.keepAlive = false;
+            conn.finish();
+        }
+
+        void handlePostRequest(Connection& conn, const string& path) {
+            // Uploads and chunks never get here: beginStreamingRequest took their body as a stream.
+            string filename = filenameParam(path);
+            string route = routeOf(path);
+
+            if (route == "/upload/start") {
+                handleUploadStart(conn, path);
+            } else if (route == "/upload/commit") {
+                handleUploadCommit(conn, queryParam(path, "id"));
+            } else if (route == "/limits") {
+                handleSetLimits(conn, path);
+            } else if (route == "/upload/abort") {
+                if (chunkedUploads.abort(queryParam(path, "id"))) {
+                    sendHttpResponse(conn, 200, "text/plain", "Upload aborted");
+                } else {
+                    sendHttpResponse(conn, 404, "text/plain", "Unknown upload");
+                }
+            } else if (path.rfind("/delete", 0) == 0) {
+                handleDelete(conn, filename);
+            } else if (path.rfind("/restore", 0) == 0) {
+                handleRestore(conn, filename);
+            } else if (path.rfind("/delete_permanent", 0) == 0) {
+                handleDeletePermanent(conn, filename);
+            } else if (path.rfind("/empty_trash", 0) == 0) {
+                handleEmptyTrash(conn);
+            } else {
+                sendHttpResponse(conn, 404, "text/plain", "Unknown POST endpoint");
+            }
+        }
+
+        // POST /limits?global=&user=&connection= in bytes per second, with an optional k, m or
+        // g suffix; 0 lifts a limit and a parameter left out keeps its current value.
+        void handleSetLimits(Connection& conn, const string& path) {
+            TransferShaper::Limits limits = shaper.limits();
+            const pair<const char*, long long*> params[] = {
+                { "global", &limits.global }, { "user", &limits.perUser }, { "connection", &limits.perConnection },
+            };
+            for (const auto& param : params) {
+                string value = queryParam(path, param.first);
+                if (value.empty()) continue;
+                long long rate = TransferShaper::parseRate(value);
+                if (rate < 0) {
+                    sendHttpResponse(conn, 400, "text/plain", string("Invalid ") + param.first + " rate");
+                    return;
+                }
+                *param.second = rate;
+            }
+            shaper.setLimits(limits);
+            sendHttpResponse(conn, 200, "application/json", limitsJson(limits));
+        }
+
+        static string limitsJson(const TransferShaper::Limits& limits) {
+            return "{\"global\":" + to_string(limits.global) + ",\"user\":" + to_string(limits.perUser) +
+                   ",\"connection\":" + to_string(limits.perConnection) + "}";
+        }
+
+        string filenameParam(const string& path) const {
+            size_t q = path.find("?");
+            string filename;
+            if (q != string::npos) {
+                string query = path.substr(q + 1);
+                size_t eq = query.find("filename=");
+                if (eq != string::npos) filename = urlDecode(query.substr(eq + 9));
+            }
+            return filename;
+        }
+
+        // Path without its query string.
+        static string routeOf(const string& path) {
+            return path.substr(0, path.find('?'));
+        }
+
+        // Decoded value of key in the query string, or "" when absent.
+        string queryParam(const string& path, const string& key) const {
+            size_t q = path.find('?');
+            if (q == string::npos) return "";
+            size_t pos = q + 1;
+            while (pos <= path.size()) {
+                size_t end = path.find('&', pos);
+                if (end == string::npos) end = path.size();
+                string pair = path.substr(pos, end - pos);
+                size_t eq = pair.find('=');
+                if (pair.substr(0, eq) == key) {
+                    return eq == string::npos ? "" : urlDecode(pair.substr(eq + 1));
+                }
+                pos = end + 1;
+            }
+            return "";
+        }
+
+        // Non-negative decimal query value, or -1 when absent or malformed.
+        long long numberParam(const string& path, const string& key) const {
+            string value = queryParam(path, key);
+            if (value.empty() || value.size() > 18 || value.find_first_not_of("0123456789") != string::npos) return -1;
+            return atoll(value.c_str());
+        }
+
+        static string jsonEscape(const string& text) {
+            string out;
+            for (unsigned char c : text) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                    out += (char)c;
+                } else if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += (char)c;
+                }
+            }
+            return out;
+        }
+
+        static string uploadStatusJson(const string& id, const ChunkedUploadManager::Status& status) {
+            string json = "{\"id\":\"" + jsonEscape(id) + "\",\"filename\":\"" + jsonEscape(status.filename) +
+                          "\",\"size\":" + to_string(status.size) + ",\"received\":" + to_string(status.received) +
+                          ",\"missing\":[";
+            for (size_t i = 0; i < status.missing.size(); ++i) {
+                if (i > 0) json += ",";
+                json += "{\"offset\":" + to_string(status.missing[i].first) +
+                        ",\"length\":" + to_string(status.missing[i].second) + "}";
+            }
+            return json + "]}";
+        }
+
+        // POST /upload/start?id=&filename=&size= creates a resumable upload, or reports how far
+        // an existing one with the same id got.
+        void handleUploadStart(Connection& conn, const string& path) {
+            string id = queryParam(path, "id");
+            ChunkedUploadManager::Status status;
+            int code = chunkedUploads.start(id, queryParam(path, "filename"), numberParam(path, "size"), status);
+            if (code == 200) {
+                sendHttpResponse(conn, 200, "application/json", uploadStatusJson(id, status));
+            } else if (code == 409) {
+                sendHttpResponse(conn, 409, "text/plain", "Upload id is in use for another file");
+            } else if (code == 400) {
+                sendHttpResponse(conn, 400, "text/plain", "Missing or invalid id, filename or size");
+            } else {
+                sendHttpResponse(conn, 500, "text/plain", "Error creating file");
+            }
+        }
+
+        // POST /upload/chunk?id=&offset= streams its body into the upload's file at offset.
+        void handleUploadChunk(Connection& conn, const string& path, long long contentLength) {
+            if (contentLength < 0) {
+                rejectRequest(conn, 411, "text/plain", "Content-Length required");
+                return;
+            }
+            string id = queryParam(path, "id");
+            long long offset = numberParam(path, "offset");
+            string filePath;
+            shared_ptr<const void> writer;
+            int code = chunkedUploads.beginChunk(id, offset, contentLength, filePath, writer);
+            if (code != 200) {
+                rejectRequest(conn, code, "text/plain", code == 400 ? "Missing or invalid offset" :
+                              code == 404 ? "Unknown upload" : code == 409 ? "Upload is being committed" :
+                              "Chunk lies outside the file");
+                return;
+            }
+
+            unique_ptr<UploadSink> sink(new UploadSink());
+            if (!sink->openAt(filePath, offset, contentLength, move(writer))) {
+                rejectRequest(conn, 500, "text/plain", "Error opening upload file");
+                return;
+            }
+
+            conn.uploadSink = move(sink);
+            conn.chunkUploadId = id;
+            conn.chunkOffset = offset;
+            conn.state = Connection::State::HttpUploadBody;
+            if (conn.uploadSink->complete()) {
+                finishUpload(conn);
+            }
+        }
+
+        // POST /upload/commit?id= publishes a complete upload; 409 lists what is still missing,
+        // which is nothing when a chunk is still being written or another commit is under way.
+        void handleUploadCommit(Connection& conn, const string& id) {
+            ChunkedUploadManager::Status status;
+            int code = chunkedUploads.commit(id, status);
+            if (code == 200 || code == 409) {
+                sendHttpResponse(conn, code, "application/json", uploadStatusJson(id, status));
+            } else if (code == 404) {
+                sendHttpResponse(conn, 404, "text/plain", "Unknown upload");
+            } else {
+                sendHttpResponse(conn, 500, "text/plain", "Error writing file");
+            }
+        }
+
+        void handleUpload(Connection& conn, const string& filename, long long contentLength, const string& contentEncoding) {
+            if (!FileManager::validName(filename)) {
+                rejectRequest(conn, 400, "text/plain", filename.empty() ? "Missing filename param" : "Invalid filename");
+                return;
+            }
+            if (contentLength < 0) {
+                rejectRequest(conn, 411, "text/plain", "Content-Length required");
+                return;
+            }
+
+            // A compressed body's decoded length isn't known up front; its Content-Length ends it.
+            unique_ptr<Compression::Decoder> decoder;
+            if (!contentEncoding.empty() && contentEncoding != "identity") {
+                Compression::Codec codec = Compression::fromName(contentEncoding);
+                decoder.reset(new Compression::Decoder());
+                if (codec == Compression::NONE || !decoder->begin(codec)) {
+                    rejectRequest(conn, 415, "text/plain", "Unsupported Content-Encoding");
+                    return;
+                }
+            }
+
+            unique_ptr<UploadSink> sink(new UploadSink());
+            if (!sink->open(fileManager.newStagingPath(filename), decoder ? LLONG_MAX : contentLength)) {
+                rejectRequest(conn, 500, "text/plain", "Error creating file");
+                return;
+            }
+
+            conn.uploadSink = move(sink);
+            conn.uploadName = filename;
+            conn.state = Connection::State::HttpUploadBody;
+            if (decoder) {
+                TransferStats::recordEncodedBody(TransferStats::UPLOAD);
+                conn.uploadDecoder = move(decoder);
+                conn.dataRemaining = (unsigned long long)contentLength;
+                if (contentLength == 0) finishEncodedUpload(conn);
+                return;
+            }
+            if (conn.uploadSink->complete()) {
+                finishUpload(conn);
+            }
+        }
+
+        // POST /upload with a multipart/form-data body, as an HTML form sends it. Every file
+        // part becomes a file named by its filename; the body ends at Content-Length.
+        void handleMultipartUpload(Connection& conn, const string& boundary, long long contentLength,
+                                   const string& contentEncoding) {
+            if (contentLength < 0) {
+                rejectRequest(conn, 411, "text/plain", "Content-Length required");
+                return;
+            }
+            if (!contentEncoding.empty() && contentEncoding != "identity") {
+                rejectRequest(conn, 415, "text/plain", "Unsupported Content-Encoding");
+                return;
+            }
+            conn.multipart.reset(new MultipartUpload(fileManager, boundary));
+            conn.dataRemaining = (unsigned long long)contentLength;
+            conn.state = Connection::State::HttpUploadBody;
+            if (contentLength == 0) finishMultipartUpload(conn);
+        }
+
+        void finishMultipartUpload(Connection& conn) {
+            unique_ptr<MultipartUpload> upload = move(conn.multipart);
+            vector<string> names;
+            if (!upload->finished()) {
+                sendHttpResponse(conn, 400, "text/plain", "Incomplete multipart body");
+            } else if (!upload->commit(names)) {
+                sendHttpResponse(conn, 500, "text/plain", "Error writing file");
+            } else if (names.empty()) {
+                sendHttpResponse(conn, 400, "text/plain", "No file in form");
+            } else {
+                string list;
+                for (const string& name : names) list += (list.empty() ? "" : ", ") + name;
+                sendHttpResponse(conn, 200, "text/plain", (names.size() == 1 ? "File uploaded: " : "Files uploaded: ") + list);
+            }
+            conn.endHttpRequest();
+        }
+
+        // GET /api/signature?filename= is the DeltaSync signature of a file in uploads.
+        void handleSignatureRequest(Connection& conn, const string& filename) {
+            string signature;
+            int status = DeltaSync::signature(fileManager, filename, signature);
+            if (status == 200) {
+                sendHttpResponse(conn, 200, "text/plain", move(signature), "Cache-Control: no-cache\r\n");
+            } else {
+                sendHttpResponse(conn, status, "text/plain", status == 404 ? "File not found" : "Error reading file");
+            }
+        }
+
+        // POST /api/delta?filename=&version= streams a DeltaSync delta against that version of
+        // the file; it is applied once the body is complete.
+        void handleDeltaUpload(Connection& conn, const string& path, long long contentLength) {
+            string filename = queryParam(path, "filename");
+            string version = queryParam(path, "version");
+            if (filename.empty() || version.empty()) {
+                rejectRequest(conn, 400, "text/plain", "Missing filename or version param");
+                return;
+            }
+            if (contentLength <= 0) {
+                rejectRequest(conn, 411, "text/plain", "Content-Length required");
+                return;
+            }
+
+            unique_ptr<UploadSink> sink(new UploadSink());
+            if (!sink->open(fileManager.newStagingPath(filename), contentLength)) {
+                rejectRequest(conn, 500, "text/plain", "Error creating file");
+                return;
+            }
+            conn.uploadSink = move(sink);
+            conn.uploadName = filename;
+            conn.deltaVersion = version;
+            conn.state = Connection::State::HttpUploadBody;
+        }
+
+        // The whole compressed body is in; it must have held exactly one complete stream.
+        void finishEncodedUpload(Connection& conn) {
+            unique_ptr<Compression::Decoder> decoder = move(conn.uploadDecoder);
+            if (!decoder->finished()) {
+                conn.uploadSink.reset();
+                sendHttpResponse(conn, 400, "text/plain", "Truncated compressed body");
+                conn.endHttpRequest();
+                return;
+            }
+            finishUpload(conn);
+        }
+
+        void finishUpload(Connection& conn) {
+            unique_ptr<UploadSink> sink = move(conn.uploadSink);
+            if (!conn.deltaVersion.empty()) {
+                string version = move(conn.deltaVersion);
+                conn.deltaVersion.clear();
+                long long copied = 0, literal = 0;
+                int status = sink->finish() ? DeltaSync::apply(fileManager, conn.uploadName, version, sink->stagingPath(),
+                                                               copied, literal) : 500;
+                Platform::deleteFile(sink->stagingPath());
+                if (status == 200) {
+                    sendHttpResponse(conn, 200, "application/json", "{\"copied\":" + to_string(copied) +
+                                     ",\"literal\":" + to_string(literal) + "}");
+                } else {
+                    sendHttpResponse(conn, status, "text/plain",
+                                     status == 404 ? "File not found" : status == 409 ? "File changed since its signature was read" :
+                                     status == 400 ? "Delta does not apply" : "Error writing file");
+                }
+                conn.endHttpRequest();
+                return;
+            }
+            if (!conn.chunkUploadId.empty()) {
+                string id = move(conn.chunkUploadId);
+                conn.chunkUploadId.clear();
+                ChunkedUploadManager::Status status;
+                if (sink->finish() && chunkedUploads.recordChunk(id, conn.chunkOffset, sink->length(), status)) {
+                    sendHttpResponse(conn, 200, "application/json", uploadStatusJson(id, status));
+                } else {
+                    sendHttpResponse(conn, 500, "text/plain", "Error writing chunk");
+                }
+                conn.endHttpRequest();
+                return;
+            }
+            if (sink->finish() && fileManager.commitUpload(sink->stagingPath(), conn.uploadName)) {
+                sendHttpResponse(conn, 200, "text/plain", "File uploaded");
+            } else {
+                sendHttpResponse(conn, 500, "text/plain", "Error writing file");
+            }
+            conn.endHttpRequest();
+        }
+
+        void handleDelete(Connection& conn, const string& filename) {
+            if (filename.empty()) {
+                sendHttpResponse(conn, 400, "text/plain", "Missing filename param");
+                return;
+            }
+
+            if (!fileManager.hasUpload(filename)) {
+                sendHttpResponse(conn, 404, "text/plain", "File not found in uploads");
+            } else if (fileManager.moveToTrash(filename)) {
+                sendHttpResponse(conn, 200, "text/plain", "Moved to trash");
+            } else {
+                sendHttpResponse(conn, 500, "text/plain", "Error moving file");
+            }
+        }
+
+        void handleRestore(Connection& conn, const string& filename) {
+            if (filename.empty()) {
+                sendHttpResponse(conn, 400, "text/plain", "Missing filename param");
+                return;
+            }
+
+            if (!fileManager.hasTrashed(filename)) {
+                sendHttpResponse(conn, 404, "text/plain", "File not found in trash");
+                return;
+            }
+
+            if (fileManager.restoreFromTrash(filename)) {
+                sendHttpResponse(conn, 200, "text/plain", "Restored");
+            } else {
+                sendHttpResponse(conn, 500, "text/plain", "Error restoring");
+            }
+        }
+
+        void handleDeletePermanent(Connection& conn, const string& filename) {
+            if (filename.empty()) {
+                sendHttpResponse(conn, 400, "text/plain", "Missing filename param");
+                return;
+            }
+
+            if (!fileManager.hasTrashed(filename)) {
+                sendHttpResponse(conn, 404, "text/plain", "File not found in trash");
+                return;
+            }
+
+            if (fileManager.deleteFromTrash(filename)) {
+                sendHttpResponse(conn, 200, "text/plain", "Permanently deleted");
+            } else {
+                sendHttpResponse(conn, 500, "text/plain", "Error deleting file");
+            }
+        }
+
+        void handleEmptyTrash(Connection& conn) {
+            int deletedCount = fileManager.emptyTrash();
+            
+            sendHttpResponse(conn, 200, "text/plain", 
+                            "Deleted " + to_string(deletedCount) + " files from trash");
+        }
+    };
+
+    // Raw command protocol. A legacy connection sends credentials, then one command, and is
+    // closed after the reply; transfers are delimited by short reads and connection close.
+    // A v2 connection (see Frame) carries any number of commands, one per REQUEST frame, each
+    // answered with a RESPONSE frame:
+    //   SESSION <user> <password> | RESUME <token> -> 200, payload is the token to RESUME with
+    //   UPLOAD <name> <size>  then DATA frames totalling <size> bytes and an END frame
+    //   DOWNLOAD <name>       -> DATA frame holding the file, then END (or an error RESPONSE)
+    //   LIST | LIST_TRASH | DELETE <name> | RESTORE <name>
+    // Large files can be split into byte ranges moved over several sessions at once:
+    //   STAT <name>           -> "<size> <version>"
+    //   DOWNLOAD_RANGE <version> <offset> <length> <name>
+    //                         -> like DOWNLOAD for that range; 409 once the file has changed
+    //   CHECKSUM <version> <name> -> SHA-256 (hex) of the whole file, to check what the ranges
+    //                         add up to; 409 once the file has changed
+    //   UPLOAD_START <id> <size> <name> | UPLOAD_COMMIT <id>
+    //   UPLOAD_CHUNK <id> <offset> <length>  then DATA frames and END, as for UPLOAD
+    // In dedup mode (--dedup) an upload can leave out the chunks the server already holds:
+    //   UPLOAD_DEDUP <manifest bytes> <name>  then the file's manifest (see ChunkStore) as for
+    //                         UPLOAD -> 200, payload lists the chunk hashes still needed, one
+    //                         per line; then those chunks back to back in DATA frames and END
+    //                         -> 200 once the file is published. 501 when dedup is off.
+    // A file the server already has can be updated by sending only what changed (see DeltaSync):
+    //   SIGNATURE <name>      -> 200, payload is the signature of the server's copy
+    //   UPLOAD_DELTA <version> <delta bytes> <name>  then the delta as for UPLOAD -> 200 once
+    //                         the new version is published; 409 if the file changed meanwhile
+    // Transfers can be compressed once the session has agreed on a codec:
+    //   ENCODING <codecs>     -> 200, payload is the codec picked from the comma-separated list
+    //                         ("zstd", "gzip"), or "identity". From then on DOWNLOAD may answer
+    //                         with DATA frames flagged Frame::ENCODED followed by END, and
+    //                         UPLOAD accepts the same (<size> stays the uncompressed size).
+    //   QUIT                  -> closes the connection, the token stays valid
+    //   LOGOUT                -> closes the connection and revokes the token
+    class CommandHandler {
+    private:
+        static const size_t CHECKSUM_BUFFER_BYTES = 256 * 1024;
+
+        FileManager& fileManager;
+        NetworkManager& networkManager;
+        ChunkedUploadManager& chunkedUploads;
+        AdmissionControl& admission;
+
+        void reply(Connection& conn, int status, const string& text) {
+            if (conn.sessionMode) {
+                conn.send(Frame::header(Frame::RESPONSE, status, text.size()) + text);
+            } else {
+                conn.send(text);
+            }
+        }
+
+    public:
+        CommandHandler(FileManager& fm, NetworkManager& nm, ChunkedUploadManager& cu, AdmissionControl& ac)
+            : fileManager(fm), networkManager(nm), chunkedUploads(cu), admission(ac) {}
+
+        void handleCommand(Connection& conn, const string& command) {
+            string cmd = command;
+            while (!cmd.empty() && (cmd.back() == '\r' || cmd.back() == '\n')) {
+                cmd.pop_back();
+            }
+
+            // First message should be authentication
+            if (!conn.authenticated) {
+                if (conn.sessionMode) {
+                    openSession(conn, cmd);
+                } else if ((conn.flow.user = fileManager.authenticateClient(command)).empty()) {
+                    string resp = "AUTH FAILED";
+                    conn.send(resp);
+                    conn.finish();
+                } else {
+                    string resp = "AUTH OK";
+                    conn.send(resp);
+                    conn.authenticated = true;
+                    conn.state = Connection::State::CommandReady;
+                }
+                return;
+            }
+
+            cout << "Received command: " << cmd << endl;
+
+            if (startsTransfer(cmd) && !admission.beginTransfer(conn)) {
+                reply(conn, 503, "Server busy, retry in " + to_string(AdmissionControl::RETRY_AFTER_SECONDS) + " s");
+            } else if (cmd.rfind("UPLOAD ", 0) == 0) {
+                handleUploadCommand(conn, cmd.substr(7));
+            } else if (cmd.rfind("DOWNLOAD ", 0) == 0) {
+                handleDownloadCommand(conn, cmd.substr(9));
+            } else if (cmd == "LIST") {
+                handleListCommand(conn);
+            } else if (cmd.rfind("DELETE ", 0) == 0) {
+                handleDeleteCommand(conn, cmd.substr(7));
+            } else if (cmd == "LIST_TRASH") {
+                handleListTrashCommand(conn);
+            } else if (cmd.rfind("RESTORE ", 0) == 0) {
+                handleRestoreCommand(conn, cmd.substr(8));
+            } else if (conn.sessionMode && cmd.rfind("STAT ", 0) == 0) {
+                handleStatCommand(conn, cmd.substr(5));
+            } else if (conn.sessionMode && cmd.rfind("DOWNLOAD_RANGE ", 0) == 0) {
+                handleDownloadRangeCommand(conn, cmd.substr(15));
+            } else if (conn.sessionMode && cmd.rfind("CHECKSUM ", 0) == 0) {
+                handleChecksumCommand(conn, cmd.substr(9));
+            } else if (conn.sessionMode && cmd.rfind("UPLOAD_START ", 0) == 0) {
+                handleUploadStartCommand(conn, cmd.substr(13));
+            } else if (conn.sessionMode && cmd.rfind("UPLOAD_CHUNK ", 0) == 0) {
+                handleUploadChunkCommand(conn, cmd.substr(13));
+            } else if (conn.sessionMode && cmd.rfind("UPLOAD_COMMIT ", 0) == 0) {
+                handleUploadCommitCommand(conn, cmd.substr(14));
+            } else if (conn.sessionMode && cmd.rfind("UPLOAD_DEDUP ", 0) == 0) {
+                handleUploadDedupCommand(conn, cmd.substr(13));
+            } else if (conn.sessionMode && cmd.rfind("ENCODING ", 0) == 0) {
+                conn.encoding = Compression::negotiate(cmd.substr(9));
+                reply(conn, 200, Compression::name(conn.encoding));
+            } else if (conn.sessionMode && cmd.rfind("SIGNATURE ", 0) == 0) {
+                handleSignatureCommand(conn, cmd.substr(10));
+            } else if (conn.sessionMode && cmd.rfind("UPLOAD_DELTA ", 0) == 0) {
+                handleUploadDeltaCommand(conn, cmd.substr(13));
+            } else if (conn.sessionMode && (cmd == "QUIT" || cmd == "LOGOUT")) {
+                if (cmd == "LOGOUT") fileManager.getSessionManager().revokeToken(conn.sessionToken);
+                reply(conn, 200, "Bye");
+                conn.finish();
+            } else {
+                reply(conn, 400, "Unknown command");
+            }
+
+            // Legacy connections carry one command; an upload closes once its data has arrived.
+            if (!conn.sessionMode && conn.state != Connection::State::CommandUpload) {
+                conn.finish();
+            }
+        }
+
+        // Commands that move file content, which count against AdmissionControl's transfer cap.
+        static bool startsTransfer(const string& cmd) {
+            static const char* const verbs[] = {
+                "UPLOAD ", "DOWNLOAD ", "DOWNLOAD_RANGE ", "UPLOAD_CHUNK ", "UPLOAD_DEDUP ", "UPLOAD_DELTA ",
+            };
+            for (const char* verb : verbs) {
+                if (cmd.rfind(verb, 0) == 0) return true;
+            }
+            return false;
+        }
+
+        // Raw bytes following UPLOAD; returns how many belonged to the upload. Legacy uploads
+        // end with a read shorter than the receive buffer, matching what the old client's
+        // fixed-size sends produce.
+        size_t handleUploadData(Connection& conn, const char* data, size_t len) {
+            if (conn.sessionMode) {
+                return handleUploadFrames(conn, data, len);
+            }
+
+            if (len > 0) {
+                conn.uploadFile->write(data, len);
+            }
+            if (len < (size_t)NetworkManager::bufferSize()) {
+                finishUpload(conn);
+            }
+            return len;
+        }
+
+        void finishUpload(Connection& conn) {
+            if (conn.uploadSink) {
+                // Also reached when the peer disconnects mid-file; the partial upload is dropped.
+                unique_ptr<UploadSink> sink = move(conn.uploadSink);
+                string chunkId = move(conn.chunkUploadId);
+                conn.chunkUploadId.clear();
+                int dedupStage = conn.dedupStage;
+                conn.dedupStage = 0;
+                string deltaVersion = move(conn.deltaVersion);
+                conn.deltaVersion.clear();
+                bool truncated = conn.uploadDecoder && !conn.uploadDecoder->finished();
+                conn.uploadDecoder.reset();
+                conn.frameHeader.clear();
+                conn.dataRemaining = 0;
+                conn.state = Connection::State::CommandReady;
+                if (!sink->complete() || truncated) {
+                    reply(conn, 400, "Upload size mismatch: " + conn.uploadName);
+                } else if (dedupStage == 1) {
+                    receiveDedupManifest(conn, *sink);
+                } else if (dedupStage == 2) {
+                    receiveDedupChunks(conn, *sink);
+                } else if (!deltaVersion.empty()) {
+                    receiveDelta(conn, *sink, deltaVersion);
+                } else if (!chunkId.empty()) {
+                    ChunkedUploadManager::Status status;
+                    if (sink->finish() && chunkedUploads.recordChunk(chunkId, conn.chunkOffset, sink->length(), status)) {
+                        reply(conn, 200, "Received " + to_string(status.received) + " of " + to_string(status.size));
+                    } else {
+                        reply(conn, 500, "Error writing chunk: " + chunkId);
+                    }
+                } else if (!sink->finish() || !fileManager.commitUpload(sink->stagingPath(), conn.uploadName)) {
+                    reply(conn, 500, "Error writing file: " + conn.uploadName);
+                } else {
+                    reply(conn, 200, "File uploaded: " + conn.uploadName);
+                }
+                return;
+            }
+
+            if (!conn.uploadFile) return;
+            conn.uploadFile->close();
+            conn.uploadFile.reset();
+            fileManager.uploadChanged(conn.uploadName);
+
+            string resp = "File uploaded: " + conn.uploadName;
+            conn.send(resp);
+            conn.finish();
+        }
+
+        void connectionClosed(Connection& conn) {
+            conn.uploadFile.reset();
+            conn.uploadSink.reset();
+            conn.multipart.reset();
+        }
+
+    private:
+        void openSession(Connection& conn, const string& cmd) {
+            SessionManager& sessions = fileManager.getSessionManager();
+            bool ok = false;
+            if (cmd.rfind("RESUME ", 0) == 0) {
+                string token = cmd.substr(7);
+                if (sessions.validateToken(token, &conn.flow.user)) {
+                    conn.sessionToken = token;
+                    ok = true;
+                }
+            } else if (cmd.rfind("SESSION ", 0) == 0) {
+                conn.flow.user = fileManager.authenticateClient(cmd.substr(8));
+                if (!conn.flow.user.empty()) {
+                    conn.sessionToken = sessions.issueToken(conn.flow.user);
+                    ok = !conn.sessionToken.empty();
+                }
+            }
+
+            if (!ok) {
+                reply(conn, 401, "AUTH FAILED");
+                conn.finish();
+                return;
+            }
+            reply(conn, 200, conn.sessionToken);
+            conn.authenticated = true;
+            conn.state = Connection::State::CommandReady;
+        }
+
+        // v2 upload body: DATA frames streamed into the sink without buffering, closed by END.
+        size_t handleUploadFrames(Connection& conn, const char* data, size_t len) {
+            size_t used = 0;
+            while (used < len && conn.state == Connection::State::CommandUpload) {
+                if (conn.dataRemaining > 0) {
+                    size_t n = (size_t)min((unsigned long long)(len - used), conn.dataRemaining);
+                    size_t taken = conn.dataEncoded ? decodeUploadData(conn, data + used, n) : conn.uploadSink->write(data + used, n);
+                    if (conn.uploadSink->hasFailed() || taken < n) {
+                        bool tooLong = !conn.uploadSink->hasFailed();
+                        conn.uploadSink.reset();
+                        conn.uploadDecoder.reset();
+                        reply(conn, tooLong ? 400 : 500,
+                              (!tooLong ? "Error writing file: " : conn.dataEncoded ? "Corrupt compressed data or size mismatch: " :
+                                          "Upload size mismatch: ") + conn.uploadName);
+                        conn.finish();
+                        return len;
+                    }
+                    used += n;
+                    conn.dataRemaining -= n;
+                    continue;
+                }
+
+                size_t n = min(Frame::HEADER_SIZE - conn.frameHeader.size(), len - used);
+                conn.frameHeader.append(data + used, n);
+                used += n;
+                if (conn.frameHeader.size() < Frame::HEADER_SIZE) break;
+
+                Frame frame = Frame::parse(conn.frameHeader.data());
+                conn.frameHeader.clear();
+                if (frame.type == Frame::DATA && !acceptDataFrame(conn, frame)) {
+                    conn.uploadSink.reset();
+                    conn.uploadDecoder.reset();
+                    reply(conn, 400, "Compressed data without an agreed ENCODING, or mixed with plain data");
+                    conn.finish();
+                    return len;
+                }
+                if (frame.type == Frame::DATA) {
+                    conn.dataRemaining = frame.length;
+                    conn.dataEncoded = frame.status == Frame::ENCODED;
+                } else if (frame.type == Frame::END) {
+                    finishUpload(conn);
+                } else {
+                    conn.uploadSink.reset();
+                    reply(conn, 400, "Expected DATA or END frame");
+                    conn.finish();
+                    return len;
+                }
+            }
+            return used;
+        }
+
+        // An upload body is either all plain DATA frames or all ENCODED ones; the decoder is
+        // set up by the first encoded frame.
+        bool acceptDataFrame(Connection& conn, const Frame& frame) {
+            bool encoded = frame.status == Frame::ENCODED;
+            if (encoded && !conn.uploadDecoder) {
+                if (conn.encoding == Compression::NONE) return false;
+                conn.uploadDecoder.reset(new Compression::Decoder());
+                if (!conn.uploadDecoder->begin(conn.encoding)) return false;
+                TransferStats::recordEncodedBody(TransferStats::UPLOAD);
+            }
+            return encoded == (conn.uploadDecoder != nullptr);
+        }
+
+        // Decompresses an ENCODED frame's payload into the sink; returns len, or less when the
+        // data is corrupt or decodes past the declared size.
+        size_t decodeUploadData(Connection& conn, const char* data, size_t len) {
+            UploadSink& sink = *conn.uploadSink;
+            long long decoded = 0;
+            bool ok = conn.uploadDecoder->update(data, len, [&](const char* out, size_t n) {
+                decoded += (long long)n;
+                return sink.write(out, n) == n && !sink.hasFailed();
+            });
+            TransferStats::recordEncoded(TransferStats::UPLOAD, decoded, (long long)len);
+            return ok ? len : 0;
+        }
+
+        void handleUploadCommand(Connection& conn, const string& args) {
+            if (conn.sessionMode) {
+                size_t sp = args.rfind(' ');
+                string filename = sp == string::npos ? "" : args.substr(0, sp);
+                long long size = sp == string::npos ? -1 : atoll(args.c_str() + sp + 1);
+                bool valid = FileManager::validName(filename) && size >= 0;
+                unique_ptr<UploadSink> sink(new UploadSink());
+                if (!valid || !sink->open(fileManager.newStagingPath(filename), size)) {
+                    // The client streams the body right behind the command, so it can't be skipped.
+                    reply(conn, valid ? 500 : 400, valid ? "Error creating file: " + filename : string("Usage: UPLOAD <name> <size>"));
+                    conn.finish();
+                    return;
+                }
+                conn.uploadSink = move(sink);
+                conn.uploadName = filename;
+                conn.frameHeader.clear();
+                conn.dataRemaining = 0;
+                conn.state = Connection::State::CommandUpload;
+                return;
+            }
+
+            const string& filename = args;
+            string filepath = fileManager.getUploadFolder() + filename;
+            string ready = "READY";
+            conn.send(ready);
+
+            unique_ptr<ofstream> out(new ofstream(filepath, ios::binary));
+            if (!out->is_open()) {
+                string resp = "Error creating file";
+                conn.send(resp);
+                return;
+            }
+
+            conn.uploadFile = move(out);
+            conn.uploadName = filename;
+            fileManager.uploadChanged(filename);
+            conn.state = Connection::State::CommandUpload;
+        }
+
+        void handleDownloadCommand(Connection& conn, const string& filename) {
+            string filepath = fileManager.getUploadFolder() + filename;
+            if (!fileManager.hasUpload(filename)) {
+                reply(conn, 404, "File not found: " + filename);
+                return;
+            }
+
+            StoredFile file;
+            if (!file.open(filepath, fileManager.getChunkStore())) {
+                reply(conn, 500, "Error opening file: " + filename);
+                return;
+            }
+            if (conn.encoding != Compression::NONE) {
+                if (CompressedBody::worthCompressing(file)) {
+                    shared_ptr<StoredFile> source = file.share();
+                    shared_ptr<CompressedBody> body = source ? make_shared<CompressedBody>(source, conn.encoding,
+                                                                                            CompressedBody::COMMAND_FRAMES) : nullptr;
+                    if (!body || !body->begin()) {
+                        reply(conn, 500, "Error opening file: " + filename);
+                        return;
+                    }
+                    TransferStats::recordEncodedBody(TransferStats::DOWNLOAD);
+                    conn.sendEncoded(body);
+                    return;
+                }
+                TransferStats::recordIncompressible();
+            }
+            if (conn.sessionMode) conn.send(Frame::header(Frame::DATA, 200, (unsigned long long)file.size));
+            if (!file.queue(conn, 0, file.size)) {
+                conn.finish();
+                return;
+            }
+            if (conn.sessionMode) conn.send(Frame::header(Frame::END, 200, 0));
+        }
+
+        void handleStatCommand(Connection& conn, const string& filename) {
+            if (!FileManager::validName(filename)) {
+                reply(conn, 400, "Invalid file name: " + filename);
+                return;
+            }
+            StoredFile file;
+            if (!fileManager.hasUpload(filename) || !file.open(fileManager.getUploadFolder() + filename, fileManager.getChunkStore())) {
+                reply(conn, 404, "File not found: " + filename);
+                return;
+            }
+            // Range transfers name this version so they never mix pieces of different uploads.
+            reply(conn, 200, to_string(file.size) + " " + FileManager::versionTag(file.fileId, file.size, file.modified));
+        }
+
+        void handleDownloadRangeCommand(Connection& conn, const string& args) {
+            istringstream in(args);
+            string version, filename;
+            long long offset = -1, length = -1;
+            in >> version >> offset >> length;
+            getline(in >> ws, filename);
+            if (!FileManager::validName(filename) || offset < 0 || length < 0) {
+                reply(conn, 400, "Usage: DOWNLOAD_RANGE <version> <offset> <length> <name>");
+                return;
+            }
+
+            StoredFile file;
+            if (!fileManager.hasUpload(filename) || !file.open(fileManager.getUploadFolder() + filename, fileManager.getChunkStore())) {
+                reply(conn, 404, "File not found: " + filename);
+                return;
+            }
+            if (FileManager::versionTag(file.fileId, file.size, file.modified) != version) {
+                reply(conn, 409, "File changed: " + filename);
+                return;
+            }
+            if (offset > file.size || length > file.size - offset) {
+                reply(conn, 416, "Range outside file: " + filename);
+                return;
+            }
+            conn.send(Frame::header(Frame::DATA, 200, (unsigned long long)length));
+            if (!file.queue(conn, offset, length)) {
+                conn.finish();
+                return;
+            }
+            conn.send(Frame::header(Frame::END, 200, 0));
+        }
+
+        void handleChecksumCommand(Connection& conn, const string& args) {
+            istringstream in(args);
+            string version, filename;
+            in >> version;
+            getline(in >> ws, filename);
+            if (!FileManager::validName(filename) || version.empty()) {
+                reply(conn, 400, "Usage: CHECKSUM <version> <name>");
+                return;
+            }
+
+            StoredFile file;
+            if (!fileManager.hasUpload(filename) || !file.open(fileManager.getUploadFolder() + filename, fileManager.getChunkStore())) {
+                reply(conn, 404, "File not found: " + filename);
+                return;
+            }
+            if (FileManager::versionTag(file.fileId, file.size, file.modified) != version) {
+                reply(conn, 409, "File changed: " + filename);
+                return;
+            }
+            Sha256 hash;
+            vector<char> buffer(CHECKSUM_BUFFER_BYTES);
+            for (long long offset = 0; offset < file.size;) {
+                size_t len = (size_t)min((long long)buffer.size(), file.size - offset);
+                if (!file.readFully(buffer.data(), len, offset)) {
+                    reply(conn, 500, "Error reading file: " + filename);
+                    return;
+                }
+                hash.update(buffer.data(), len);
+                offset += (long long)len;
+            }
+            reply(conn, 200, hash.hex());
+        }
+
+        void handleUploadStartCommand(Connection& conn, const string& args) {
+            istringstream in(args);
+            string id, filename;
+            long long size = -1;
+            in >> id >> size;
+            getline(in >> ws, filename);
+            ChunkedUploadManager::Status status;
+            int code = chunkedUploads.start(id, filename, size, status);
+            if (code == 200) {
+                reply(conn, 200, "Received " + to_string(status.received) + " of " + to_string(status.size));
+            } else if (code == 409) {
+                reply(conn, 409, "Upload id is in use for another file: " + id);
+            } else if (code == 400) {
+                reply(conn, 400, "Usage: UPLOAD_START <id> <size> <name>");
+            } else {
+                reply(conn, 500, "Error creating file: " + filename);
+            }
+        }
+
+        void handleUploadChunkCommand(Connection& conn, const string& args) {
+            istringstream in(args);
+            string id;
+            long long offset = -1, length = -1;
+
+            string path;
+            shared_ptr<const void> writer;
+            int code = (in >> id >> offset >> length) ? chunkedUploads.beginChunk(id, offset, length, path, writer) : 400;
+            unique_ptr<UploadSink> sink(new UploadSink());
+            if (code != 200 || !sink->openAt(path, offset, length, move(writer))) {
+                // As with UPLOAD, the chunk's data follows unasked, so the session ends here.
+                reply(conn, code != 200 ? code : 500,
+                      code == 400 ? string("Usage: UPLOAD_CHUNK <id> <offset> <length>") :
+                      code == 404 ? "Unknown upload: " + id :
+                      code == 409 ? "Upload is being committed: " + id :
+                      code == 416 ? "Chunk lies outside the file: " + id : "Error opening upload file: " + id);
+                conn.finish();
+                return;
+            }
+            conn.uploadSink = move(sink);
+            conn.uploadName = id;
+            conn.chunkUploadId = id;
+            conn.chunkOffset = offset;
+            conn.frameHeader.clear();
+            conn.dataRemaining = 0;
+            conn.state = Connection::State::CommandUpload;
+        }
+
+        void handleUploadCommitCommand(Connection& conn, const string& id) {
+            ChunkedUploadManager::Status status;
+            int code = chunkedUploads.commit(id, status);
+            if (code == 200) {
+                reply(conn, 200, "File uploaded: " + status.filename);
+            } else if (code == 409 && status.missing.empty()) {
+                reply(conn, 409, "Upload is busy with chunks being written or a commit: " + id);
+            } else if (code == 409) {
+                reply(conn, 409, "Upload incomplete: received " + to_string(status.received) + " of " + to_string(status.size));
+            } else if (code == 404) {
+                reply(conn, 404, "Unknown upload: " + id);
+            } else {
+                reply(conn, 500, "Error writing file: " + status.filename);
+            }
+        }
+
+        // UPLOAD_DEDUP, first half: the client's manifest arrives like an UPLOAD body.
+        void handleUploadDedupCommand(Connection& conn, const string& args) {
+            istringstream in(args);
+            string filename;
+            long long manifestBytes = -1;
+            in >> manifestBytes;
+            getline(in >> ws, filename);
+
+            bool enabled = fileManager.getChunkStore() != nullptr;
+            bool valid = FileManager::validName(filename) && manifestBytes > 0 && manifestBytes <= ChunkStore::MAX_MANIFEST_BYTES;
+            unique_ptr<UploadSink> sink(new UploadSink());
+            if (!enabled || !valid || !sink->open(fileManager.newStagingPath(filename), manifestBytes)) {
+                // As with UPLOAD, the manifest follows unasked, so the session ends here.
+                reply(conn, !enabled ? 501 : !valid ? 400 : 500,
+                      !enabled ? "Dedup storage is not enabled" :
+                      !valid ? "Usage: UPLOAD_DEDUP <manifest bytes> <name>" : "Error creating file: " + filename);
+                conn.finish();
+                return;
+            }
+            conn.uploadSink = move(sink);
+            conn.uploadName = filename;
+            conn.dedupStage = 1;
+            conn.frameHeader.clear();
+            conn.dataRemaining = 0;
+            conn.state = Connection::State::CommandUpload;
+        }
+
+        // Positional read of exactly len bytes.
+        static bool readExact(int fd, char* buffer, long long len, long long offset) {
+            long long done = 0;
+            while (done < len) {
+                int got = Platform::readFileAt(fd, buffer + done, (int)min(len - done, (long long)INT_MAX), offset + done);
+                if (got <= 0) return false;
+                done += got;
+            }
+            return true;
+        }
+
+        // Answers the manifest with the chunks the store lacks, each asked for once, and
+        // waits for them.
+        void receiveDedupManifest(Connection& conn, UploadSink& sink) {
+            ChunkStore* store = fileManager.getChunkStore();
+            string text((size_t)sink.length(), '\0');
+            long long size = 0;
+            int fd = sink.finish() ? Platform::openFileForRead(sink.stagingPath(), size) : -1;
+            bool read = fd != -1 && size == sink.length() && readExact(fd, &text[0], size, 0);
+            if (fd != -1) Platform::closeFile(fd);
+            Platform::deleteFile(sink.stagingPath());
+
+            ChunkStore::Manifest manifest;
+            if (!read) {
+                reply(conn, 500, "Error writing file: " + conn.uploadName);
+                return;
+            }
+            if (!ChunkStore::parseManifest(text, manifest)) {
+                reply(conn, 400, "Invalid manifest: " + conn.uploadName);
+                return;
+            }
+
+            vector<pair<string, long long>> missing;
+            unordered_set<string> asked;
+            long long owed = 0;
+            string list;
+            for (const auto& chunk : manifest.chunks) {
+                if (!asked.insert(chunk.first).second || store->has(chunk.first, chunk.second)) continue;
+                missing.push_back(chunk);
+                owed += chunk.second;
+                list += chunk.first + "\n";
+            }
+
+            unique_ptr<UploadSink> next(new UploadSink());
+            if (!next->open(fileManager.newStagingPath(conn.uploadName), owed)) {
+                reply(conn, 500, "Error creating file: " + conn.uploadName);
+                return;
+            }
+            reply(conn, 200, list);
+            conn.uploadSink = move(next);
+            conn.dedupManifest = move(manifest);
+            conn.dedupMissing = move(missing);
+            conn.dedupStage = 2;
+            conn.state = Connection::State::CommandUpload;
+        }
+
+        // Checks each chunk the client sent against its hash, stores it and publishes the file.
+        void receiveDedupChunks(Connection& conn, UploadSink& sink) {
+            ChunkStore* store = fileManager.getChunkStore();
+            long long size = 0;
+            int fd = sink.finish() ? Platform::openFileForRead(sink.stagingPath(), size) : -1;
+            int status = fd == -1 ? 500 : 200;
+            vector<char> buffer(ContentChunker::MAX_SIZE);
+            long long offset = 0;
+            for (const auto& chunk : conn.dedupMissing) {
+                if (status != 200) break;
+                if (!readExact(fd, buffer.data(), chunk.second, offset)) status = 500;
+                else if (Sha256::of(buffer.data(), (size_t)chunk.second) != chunk.first) status = 400;
+                else if (!store->put(chunk.first, buffer.data(), (size_t)chunk.second)) status = 500;
+                offset += chunk.second;
+            }
+            if (fd != -1) Platform::closeFile(fd);
+            Platform::deleteFile(sink.stagingPath());
+
+            // Chunks the client was told to skip may have been swept if it took very long; one
+            // still there but of another length than the manifest claims is refused outright.
+            for (size_t i = 0; status == 200 && i < conn.dedupManifest.chunks.size(); ++i) {
+                const auto& chunk = conn.dedupManifest.chunks[i];
+                if (!store->has(chunk.first, chunk.second)) status = store->has(chunk.first) ? 400 : 409;
+            }
+            if (status == 200 && !fileManager.commitManifest(conn.dedupManifest, conn.uploadName)) status = 500;
+
+            size_t sent = conn.dedupMissing.size();
+            size_t total = conn.dedupManifest.chunks.size();
+            conn.dedupManifest = ChunkStore::Manifest();
+            conn.dedupMissing.clear();
+            if (status == 200) {
+                reply(conn, 200, "File uploaded: " + conn.uploadName + " (" + to_string(sent) + " of " +
+                                 to_string(total) + " chunks sent)");
+            } else if (status == 400) {
+                reply(conn, 400, "Chunk does not match its hash or length: " + conn.uploadName);
+            } else if (status == 409) {
+                reply(conn, 409, "Chunks expired, upload again: " + conn.uploadName);
+            } else {
+                reply(conn, 500, "Error writing file: " + conn.uploadName);
+            }
+        }
+
+        void handleSignatureCommand(Connection& conn, const string& filename) {
+            string signature;
+            int status = DeltaSync::signature(fileManager, filename, signature);
+            if (status == 200) {
+                reply(conn, 200, signature);
+            } else {
+                reply(conn, status, (status == 404 ? "File not found: " : "Error reading file: ") + filename);
+            }
+        }
+
+        // UPLOAD_DELTA: the delta arrives like an UPLOAD body and is applied once complete.
+        void handleUploadDeltaCommand(Connection& conn, const string& args) {
+            istringstream in(args);
+            string version, filename;
+            long long deltaBytes = -1;
+            in >> version >> deltaBytes;
+            getline(in >> ws, filename);
+
+            bool valid = !version.empty() && !filename.empty() && deltaBytes > 0;
+            unique_ptr<UploadSink> sink(new UploadSink());
+            if (!valid || !sink->open(fileManager.newStagingPath(filename), deltaBytes)) {
+                reply(conn, valid ? 500 : 400, valid ? "Error creating file: " + filename :
+                                                       "Usage: UPLOAD_DELTA <version> <delta bytes> <name>");
+                conn.finish();
+                return;
+            }
+            conn.uploadSink = move(sink);
+            conn.uploadName = filename;
+            conn.deltaVersion = version;
+            conn.frameHeader.clear();
+            conn.dataRemaining = 0;
+            conn.state = Connection::State::CommandUpload;
+        }
+
+        void receiveDelta(Connection& conn, UploadSink& sink, const string& version) {
+            long long copied = 0, literal = 0;
+            int status = sink.finish() ? DeltaSync::apply(fileManager, conn.uploadName, version, sink.stagingPath(),
+                                                          copied, literal) : 500;
+            Platform::deleteFile(sink.stagingPath());
+            if (status == 200) {
+                reply(conn, 200, "File updated: " + conn.uploadName + " (" + to_string(copied) + " bytes reused, " +
+                                 to_string(literal) + " sent)");
+            } else if (status == 404) {
+                reply(conn, 404, "File not found: " + conn.uploadName);
+            } else if (status == 409) {
+                reply(conn, 409, "File changed since its signature was read: " + conn.uploadName);
+            } else if (status == 400) {
+                reply(conn, 400, "Delta does not apply: " + conn.uploadName);
+            } else {
+                reply(conn, 500, "Error writing file: " + conn.uploadName);
+            }
+        }
+
+        void handleListCommand(Connection& conn) {
+            string listing = "=== Server Files ===\n" + fileManager.listUploads();
+            reply(conn, 200, listing);
+        }
+
+        void handleDeleteCommand(Connection& conn, const string& filename) {
+            if (fileManager.moveToTrash(filename)) {
+                reply(conn, 200, "File moved to trash: " + filename);
+            } else {
+                reply(conn, 404, "Error moving file to trash: " + filename);
+            }
+        }
+
+        void handleListTrashCommand(Connection& conn) {
+            string listing = "=== Trash Files ===\n" + fileManager.listTrash();
+            reply(conn, 200, listing);
+        }
+
+        void handleRestoreCommand(Connection& conn, const string& filename) {
+            if (fileManager.restoreFromTrash(filename)) {
+                reply(conn, 200, "File restored: " + filename);
+            } else {
+                reply(conn, 404, "Error restoring file: " + filename);
+            }
+        }
+    };
+
+    // Readiness notification for the event loop: edge-triggered epoll on Linux,
+    // level-triggered poll()/WSAPoll elsewhere.
+    class Poller {
+    public:
+        struct Event {
+            SOCKET sock;
+            bool readable;
+            bool writable;
+        };
+
+    private:
+    #ifdef __linux__
+        int epollFd;
+    #else
+        vector<pollfd> fds;
+    #endif
+
+    public:
+    #ifdef __linux__
+        Poller() : epollFd(-1) {}
+        ~Poller() { if (epollFd != -1) close(epollFd); }
+
+        bool open() {
+            epollFd = epoll_create1(EPOLL_CLOEXEC);
+            return epollFd != -1;
+        }
+
+        bool add(SOCKET sock) {
+            epoll_event ev;
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = sock;
+            return epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &ev) == 0;
+        }
+
+        // Edge-triggered epoll already reports every writable edge.
+        void setWriteInterest(SOCKET, bool) {}
+
+        void remove(SOCKET sock) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, sock, NULL);
+        }
+
+        int wait(vector<Event>& events, int timeoutMs) {
+            epoll_event ready[256];
+            events.clear();
+            int n = epoll_wait(epollFd, ready, 256, timeoutMs);
+            for (int i = 0; i < n; ++i) {
+                bool failed = (ready[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0;
+                Event e;
+                e.sock = ready[i].data.fd;
+                e.readable = failed || (ready[i].events & EPOLLIN);
+                e.writable = failed || (ready[i].events & EPOLLOUT);
+                events.push_back(e);
+            }
+            return n < 0 ? 0 : n;
+        }
+    #else
+        bool open() { return true; }
+
+        bool add(SOCKET sock) {
+            pollfd p;
+            p.fd = sock;
+            p.events = POLLIN;
+            p.revents = 0;
+            fds.push_back(p);
+            return true;
+        }
+
+        void setWriteInterest(SOCKET sock, bool enabled) {
+            for (pollfd& p : fds) {
+                if (p.fd == sock) {
+                    p.events = enabled ? (POLLIN | POLLOUT) : POLLIN;
+                    return;
+                }
+            }
+        }
+
+        void remove(SOCKET sock) {
+            for (size_t i = 0; i < fds.size(); ++i) {
+                if (fds[i].fd == sock) {
+                    fds.erase(fds.begin() + i);
+                    return;
+                }
+            }
+        }
+
+        int wait(vector<Event>& events, int timeoutMs) {
+            events.clear();
+            if (fds.empty()) return 0;
+    #ifdef _WIN32
+            int n = WSAPoll(fds.data(), (ULONG)fds.size(), timeoutMs);
+    #else
+            int n = poll(fds.data(), fds.size(), timeoutMs);
+    #endif
+            if (n <= 0) return 0;
+            for (const pollfd& p : fds) {
+                if (!p.revents) continue;
+                bool failed = (p.revents & (POLLERR | POLLHUP)) != 0;
+                Event e;
+                e.sock = p.fd;
+                e.readable = failed || (p.revents & POLLIN);
+                e.writable = failed || (p.revents & POLLOUT);
+                events.push_back(e);
+            }
+            return (int)events.size();
+        }
+    #endif
+    };
+
+    #ifdef FTP_HAVE_IO_URING
+    // Minimal io_uring ring driven through the raw syscalls, so no liburing is needed.
+    // Submissions are queued locally and published in one io_uring_enter per loop turn.
+    class IoUring {
+    private:
+        int ringFd;
+        unsigned sqEntries;
+        unsigned* sqHead;
+        unsigned* sqTail;
+        unsigned* sqMask;
+        unsigned* sqArray;
+        unsigned* cqHead;
+        unsigned* cqTail;
+        unsigned* cqMask;
+        io_uring_sqe* sqes;
+        io_uring_cqe* cqes;
+        void* sqRing;
+        size_t sqRingSize;
+        void* cqRing;
+        size_t cqRingSize;
+        size_t sqesSize;
+        unsigned localTail;
+        unsigned unsubmitted;
+
+    public:
+        IoUring()
+            : ringFd(-1), sqEntries(0), sqHead(NULL), sqTail(NULL), sqMask(NULL), sqArray(NULL),
+              cqHead(NULL), cqTail(NULL), cqMask(NULL), sqes(NULL), cqes(NULL),
+              sqRing(MAP_FAILED), sqRingSize(0), cqRing(MAP_FAILED), cqRingSize(0), sqesSize(0),
+              localTail(0), unsubmitted(0) {}
+
+        ~IoUring() {
+            if (sqes) munmap(sqes, sqesSize);
+            if (cqRing != MAP_FAILED) munmap(cqRing, cqRingSize);
+            if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+            if (ringFd != -1) close(ringFd);
+        }
+
+        bool init(unsigned entries) {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+            if (ringFd < 0) {
+                ringFd = -1;
+                return false;
+            }
+
+            sqEntries = params.sq_entries;
+            sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+            sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            void* sqeMap = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+            if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeMap == MAP_FAILED) return false;
+            sqes = (io_uring_sqe*)sqeMap;
+
+            char* sq = (char*)sqRing;
+            char* cq = (char*)cqRing;
+            sqHead = (unsigned*)(sq + params.sq_off.head);
+            sqTail = (unsigned*)(sq + params.sq_off.tail);
+            sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+            sqArray = (unsigned*)(sq + params.sq_off.array);
+            cqHead = (unsigned*)(cq + params.cq_off.head);
+            cqTail = (unsigned*)(cq + params.cq_off.tail);
+            cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+            localTail = *sqTail;
+            return true;
+        }
+
+        // Next free submission entry, zeroed; flushes the queue once if the ring is full.
+        io_uring_sqe* nextSqe() {
+            if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+                submitAndWait(0);
+                if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) return NULL;
+            }
+            unsigned index = localTail & *sqMask;
+            io_uring_sqe* sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqArray[index] = index;
+            localTail++;
+            unsubmitted++;
+            return sqe;
+        }
+
+        // Publishes every queued entry and waits for at least waitFor completions, in one syscall.
+        int submitAndWait(unsigned waitFor) {
+            __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+            int r;
+            do {
+                r = (int)syscall(__NR_io_uring_enter, ringFd, unsubmitted, waitFor,
+                                 waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            } while (r < 0 && errno == EINTR);
+            if (r > 0) unsubmitted -= min((unsigned)r, unsubmitted);
+            return r;
+        }
+
+        bool popCompletion(io_uring_cqe& out) {
+            unsigned head = *cqHead;
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+            out = cqes[head & *cqMask];
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        // Registers one contiguous region as fixed buffer index 0.
+        bool registerBuffer(void* base, size_t len) {
+            iovec iov;
+            iov.iov_base = base;
+            iov.iov_len = len;
+            return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+        }
+
+        // Registers an empty fixed-file table; slots are filled with updateFile.
+        bool registerFileTable(unsigned count) {
+            vector<int> fds(count, -1);
+            return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES, fds.data(), count) == 0;
+        }
+
+        bool updateFile(unsigned slot, int fd) {
+            io_uring_files_update update;
+            memset(&update, 0, sizeof(update));
+            update.offset = slot;
+            update.fds = (unsigned long long)(uintptr_t)&fd;
+            return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+        }
+    };
+    #endif
+
+    // Single-threaded non-blocking server loop. Every connection is a small state machine
+    // (see Connection::State); no connection can stall another, and each one gets at most
+    // IO_BUDGET bytes of reads and writes per wakeup before the loop moves on.
+    //
+    // When opened with preferIoUring and the kernel allows it, the same state machines are
+    // driven by io_uring completions instead of epoll readiness (see runIoUring). On the epoll
+    // engine, file bodies go out with sendfile() unless options.zeroCopy is off.
+    class EventLoop {
+    private:
+        static const int IO_BUDGET = 256 * 1024;
+        static const int ACCEPT_BATCH = 64;             // accepts per wakeup, so admitted work goes first
+        static const int IDLE_TIMEOUT_SECONDS = 60;
+        static const int RATE_WINDOW_SECONDS = 10;      // span over which options.minTransferRate is measured
+        static const size_t MAX_HEADER_BYTES = 64 * 1024;
+        static const size_t MAX_PIPELINED_RESPONSES = 32;
+
+        HttpRequestHandler& httpHandler;
+        CommandHandler& commandHandler;
+        TransferShaper& shaper;
+        AdmissionControl& admission;
+        const ServerOptions& options;
+        Poller poller;
+        SOCKET listenSocket;
+        bool acceptPending;     // the last batch stopped short of draining the listener
+        unordered_map<SOCKET, unique_ptr<Connection>> connections;
+        vector<SOCKET> readyList;
+        vector<SOCKET> throttledList;   // waiting for the shaper; retried every REFILL_MS
+        chrono::steady_clock::time_point refillDue;
+        atomic<bool> running;
+
+    #ifdef FTP_HAVE_IO_URING
+        static const unsigned RING_ENTRIES = 1024;
+        static const int BUFFER_SLOTS = 64;
+        static const int SLOT_SIZE = 64 * 1024;
+        static const int READ_AHEAD = 2;
+        static const unsigned FIXED_FILE_SLOTS = 4096;
+
+        enum UringOp { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_SEND_FIXED, OP_FILE_READ, OP_TICK, OP_REFILL };
+
+        unique_ptr<IoUring> ring;
+        vector<char> slotPool;
+        vector<int> freeSlots;
+        deque<SOCKET> slotWaiters;
+        bool fixedFiles;
+        __kernel_timespec tickInterval;
+        __kernel_timespec refillInterval;
+    #endif
+
+    public:
+        EventLoop(HttpRequestHandler& http, CommandHandler& command, TransferShaper& ts, AdmissionControl& ac,
+                  const ServerOptions& opts)
+            : httpHandler(http), commandHandler(command), shaper(ts), admission(ac), options(opts),
+              listenSocket(INVALID_SOCKET), acceptPending(false), running(false) {}
+
+        ~EventLoop() {
+    #ifdef FTP_HAVE_IO_URING
+            ring.reset();
+            for (auto& entry : connections) entry.second->inflight = 0;
+    #endif
+            vector<SOCKET> open;
+            for (auto& entry : connections) open.push_back(entry.first);
+            for (SOCKET sock : open) closeConnection(sock);
+        }
+
+        bool open(SOCKET listener) {
+            listenSocket = listener;
+            running = true;
+    #ifdef FTP_HAVE_IO_URING
+            if (options.ioUring) {
+                if (openIoUring()) return true;
+                cout << "io_uring unavailable, falling back to epoll\n";
+            }
+    #else
+            if (options.ioUring) cout << "io_uring not supported on this platform, using the default poller\n";
+    #endif
+            return poller.open() && Platform::setNonBlocking(listenSocket) && poller.add(listenSocket);
+        }
+
+        void run() {
+    #ifdef FTP_HAVE_IO_URING
+            if (ring) {
+                runIoUring();
+                return;
+            }
+    #endif
+            vector<Poller::Event> events;
+            auto lastSweep = chrono::steady_clock::now();
+
+            while (running) {
+                int timeoutMs = readyList.empty() && !acceptPending ? 1000 : 0;
+                if (timeoutMs > 0 && !throttledList.empty()) {
+                    auto until = refillDue - chrono::steady_clock::now();
+                    timeoutMs = (int)max(0LL, (long long)chrono::ceil<chrono::milliseconds>(until).count());
+                }
+                poller.wait(events, timeoutMs);
+
+                for (const Poller::Event& ev : events) {
+                    if (ev.sock == listenSocket) {
+                        acceptConnections();
+                        continue;
+                    }
+                    auto it = connections.find(ev.sock);
+                    if (it == connections.end()) continue;
+                    if (ev.readable) it->second->canRead = true;
+                    service(*it->second);
+                }
+                if (acceptPending) acceptConnections();
+
+                // Connections that ran out of budget resume here without waiting for a new edge.
+                vector<SOCKET> resume;
+                resume.swap(readyList);
+                for (SOCKET sock : resume) {
+                    auto it = connections.find(sock);
+                    if (it == connections.end()) continue;
+                    it->second->queued = false;
+                    service(*it->second);
+                }
+
+                auto now = chrono::steady_clock::now();
+                if (!throttledList.empty() && now >= refillDue) resumeThrottled();
+                if (now - lastSweep >= chrono::seconds(1)) {
+                    enforceDeadlines(now);
+                    lastSweep = now;
+                }
+            }
+        }
+
+        void stop() { running = false; }
+
+    private:
+        void acceptConnections() {
+            acceptPending = false;
+            for (int accepted = 0; accepted < ACCEPT_BATCH; ++accepted) {
+                SOCKET client = accept(listenSocket, NULL, NULL);
+                if (client == INVALID_SOCKET) {
+                    int err = Platform::lastSocketError();
+                    if (!Platform::wouldBlock(err)) cout << "Accept failed. Error: " << err << "\n";
+                    return;
+                }
+                if (!admission.admitConnection()) {
+                    refuseConnection(client);
+                    continue;
+                }
+                if (!Platform::setNonBlocking(client) || !poller.add(client)) {
+                    Platform::closeSocket(client);
+                    admission.connectionClosed();
+                    continue;
+                }
+                connections[client] = unique_ptr<Connection>(new Connection(client));
+            }
+            acceptPending = true;
+        }
+
+        // Answers a connection over the cap with a 503 and closes it at once. Whatever the
+        // client already sent is read first, since closing on unread input would reset the
+        // connection and could discard the reply before the client sees it.
+        static void refuseConnection(SOCKET client) {
+            char scratch[4096];
+            if (Platform::setNonBlocking(client)) {
+                for (int i = 0; i < 4 && NetworkManager::recvSome(client, scratch, sizeof(scratch)) > 0; ++i) {}
+                const string& response = AdmissionControl::busyResponse();
+                NetworkManager::sendSome(client, response.data(), (int)response.size());
+            }
+            Platform::closeSocket(client);
+        }
+
+        void service(Connection& conn) {
+            SOCKET sock = conn.sock;
+            if (conn.canRead && !readFrom(conn)) {
+                closeConnection(sock);
+                return;
+            }
+            if (conn.pipelined) processInput(conn);
+            if (!writeTo(conn)) {
+                closeConnection(sock);
+                return;
+            }
+            if (!conn.hasPendingOutput() && !conn.pipelined && (conn.closeWhenDrained || conn.peerClosed)) {
+                closeConnection(sock);
+                return;
+            }
+            settleTransfer(conn);
+            if ((conn.canRead || conn.moreToWrite || conn.pipelined) && !conn.queued && !conn.throttled) {
+                conn.queued = true;
+                readyList.push_back(sock);
+            }
+            poller.setWriteInterest(sock, conn.hasPendingOutput() && !conn.throttled);
+        }
+
+        // A transfer is over once its upload body is in and its response has been written.
+        void settleTransfer(Connection& conn) {
+            if (conn.transferring && !receivingUpload(conn) && !conn.hasPendingOutput()) admission.endTransfer(conn);
+        }
+
+        // Sets a connection aside until the shaper has bandwidth for it again.
+        void park(Connection& conn) {
+            if (conn.throttled) return;
+            conn.throttled = true;
+            if (throttledList.empty()) {
+                refillDue = chrono::steady_clock::now() + chrono::milliseconds(TransferShaper::REFILL_MS);
+    #ifdef FTP_HAVE_IO_URING
+                if (ring) postRefill();
+    #endif
+            }
+            throttledList.push_back(conn.sock);
+        }
+
+        void resumeThrottled() {
+            vector<SOCKET> resume;
+            resume.swap(throttledList);
+            for (SOCKET sock : resume) {
+                auto it = connections.find(sock);
+                if (it == connections.end() || !it->second->throttled) continue;
+                it->second->throttled = false;
+    #ifdef FTP_HAVE_IO_URING
+                if (ring) {
+                    advanceUring(*it->second);
+                    continue;
+                }
+    #endif
+                service(*it->second);
+            }
+        }
+
+        static bool receivingUpload(const Connection& conn) {
+            return conn.state == Connection::State::HttpUploadBody || conn.state == Connection::State::CommandUpload;
+        }
+
+        bool readFrom(Connection& conn) {
+            char buf[8192];
+            int budget = IO_BUDGET;
+            while (budget > 0) {
+                // Upload bodies are bulk; anything else read is interactive.
+                bool bulk = receivingUpload(conn);
+                long long allowed = bulk ? shaper.grant(conn.flow, sizeof(buf)) : (long long)sizeof(buf);
+                if (allowed == 0) {
+                    park(conn);
+                    break;
+                }
+                int r = NetworkManager::recvSome(conn.sock, buf, (int)allowed);
+                if (bulk) shaper.giveBack(conn.flow, allowed - max(r, 0));
+                if (r == NetworkManager::IO_WOULD_BLOCK) {
+                    conn.canRead = false;
+                    break;
+                }
+                if (r == NetworkManager::IO_ERROR) return false;
+                if (r == 0) {
+                    conn.canRead = false;
+                    onPeerClosed(conn);
+                    break;
+                }
+
+                budget -= r;
+                consumeInput(conn, buf, r);
+            }
+
+            processInput(conn);
+            return true;
+        }
+
+        void consumeInput(Connection& conn, const char* data, int len) {
+            conn.lastActivity = chrono::steady_clock::now();
+            conn.windowBytes += len;
+            if (conn.inBuffer.empty() && conn.state == Connection::State::HttpRequest) conn.headStarted = conn.lastActivity;
+            if (conn.state == Connection::State::CommandUpload || conn.state == Connection::State::HttpUploadBody) {
+                size_t used = conn.state == Connection::State::CommandUpload
+                    ? commandHandler.handleUploadData(conn, data, (size_t)len)
+                    : httpHandler.handleUploadData(conn, data, (size_t)len);
+                if (used < (size_t)len && conn.state != Connection::State::Draining) {
+                    conn.inBuffer.append(data + used, len - used);
+                }
+            } else if (conn.state != Connection::State::Draining) {
+                conn.inBuffer.append(data, len);
+            }
+        }
+
+        void onPeerClosed(Connection& conn) {
+            conn.peerClosed = true;
+            if (conn.state == Connection::State::CommandUpload) {
+                commandHandler.finishUpload(conn);
+            }
+        }
+
+        void processInput(Connection& conn) {
+            if (conn.inBuffer.empty()) return;
+
+            if (conn.state == Connection::State::Detecting) {
+                const string& b = conn.inBuffer;
+                bool isHttp = b.find("HTTP/") != string::npos || b.find("GET ") == 0 || b.find("POST ") == 0;
+                auto mayBecome = [&b](const string& prefix) {
+                    return b.size() < prefix.size() && prefix.compare(0, b.size(), b) == 0;
+                };
+                if (!isHttp && (mayBecome(Frame::MAGIC) || mayBecome("GET ") || mayBecome("POST "))) {
+                    return;   // may still become the v2 preamble or a request line
+                }
+                conn.state = isHttp ? Connection::State::HttpRequest : Connection::State::CommandAuth;
+                if (!isHttp && b.compare(0, Frame::MAGIC_SIZE, Frame::MAGIC) == 0) {
+                    conn.sessionMode = true;
+                    conn.inBuffer.erase(0, Frame::MAGIC_SIZE);
+                }
+            }
+
+            // Pipelined requests are answered in order; responses queue up in conn.output.
+            conn.pipelined = false;
+            while (conn.state == Connection::State::HttpRequest && !conn.inBuffer.empty()) {
+                if (conn.output.size() >= MAX_PIPELINED_RESPONSES) {
+                    conn.pipelined = true;
+                    return;
+                }
+                HttpRequest& request = conn.request;
+                request.body = string_view();
+                HttpParser::Status parsed = conn.httpParser.feed(conn.inBuffer, request);
+                if (parsed == HttpParser::INVALID) {
+                    httpHandler.rejectMalformed(conn);
+                    return;
+                }
+                if (parsed == HttpParser::INCOMPLETE) {
+                    if (conn.inBuffer.size() > MAX_HEADER_BYTES) {
+                        admission.record(AdmissionControl::HEADER_TOO_LARGE);
+                        httpHandler.rejectOversizedHead(conn);
+                    }
+                    return;
+                }
+
+                conn.keepAlive = conn.requestsServed + 1 < options.maxRequestsPerConnection;
+                if (httpHandler.beginStreamingRequest(conn, request)) {
+                    conn.httpParser.reset();
+                    if (conn.state == Connection::State::HttpUploadBody) {
+                        // The buffered body start is handed over in place while a fresh pooled
+                        // buffer takes over as inBuffer for whatever the upload leaves.
+                        size_t head = request.head.size();
+                        string buffered = BufferPool::acquire(Connection::INPUT_BUFFER_BYTES);
+                        buffered.swap(conn.inBuffer);
+                        if (buffered.size() > head) consumeInput(conn, buffered.data() + head, (int)(buffered.size() - head));
+                        BufferPool::release(buffered);
+                    } else if (conn.state == Connection::State::Draining) {
+                        conn.inBuffer.clear();
+                    } else {
+                        // Answered already (an empty body): what follows is the next request.
+                        conn.inBuffer.erase(0, request.head.size());
+                    }
+                    continue;
+                }
+
+                // The request is handled in place, its views still into inBuffer, and then dropped.
+                size_t len = request.head.size() + (size_t)max(0LL, request.contentLength);
+                if (conn.inBuffer.size() < len) return;
+                request.body = string_view(conn.inBuffer.data() + request.head.size(), len - request.head.size());
+                httpHandler.handleRequest(conn, request);
+                conn.inBuffer.erase(0, len);
+                conn.httpParser.reset();
+                conn.endHttpRequest();
+            }
+
+            // v2 connections carry one command per REQUEST frame. Legacy ones send a single
+            // unframed command per connection, so one drained read is one message.
+            while ((conn.state == Connection::State::CommandAuth || conn.state == Connection::State::CommandReady) &&
+                   !conn.inBuffer.empty()) {
+                if (conn.output.size() >= MAX_PIPELINED_RESPONSES) {
+                    conn.pipelined = true;
+                    return;
+                }
+                string message;
+                if (conn.sessionMode) {
+                    if (conn.inBuffer.size() < Frame::HEADER_SIZE) return;
+                    Frame frame = Frame::parse(conn.inBuffer.data());
+                    if (frame.type != Frame::REQUEST || frame.length > MAX_HEADER_BYTES) {
+                        if (frame.type == Frame::REQUEST) admission.record(AdmissionControl::HEADER_TOO_LARGE);
+                        conn.finish();
+                        return;
+                    }
+                    if (conn.inBuffer.size() < Frame::HEADER_SIZE + frame.length) return;
+                    message = conn.inBuffer.substr(Frame::HEADER_SIZE, (size_t)frame.length);
+                    conn.inBuffer.erase(0, Frame::HEADER_SIZE + (size_t)frame.length);
+                } else {
+                    message.swap(conn.inBuffer);
+                }
+                commandHandler.handleCommand(conn, message);
+
+                // Bytes after an UPLOAD line are the start of the file.
+                if (conn.state == Connection::State::CommandUpload && !conn.inBuffer.empty()) {
+                    string data;
+                    data.swap(conn.inBuffer);
+                    consumeInput(conn, data.data(), (int)data.size());
+                }
+            }
+        }
+
+        bool writeTo(Connection& conn) {
+            conn.moreToWrite = false;
+            int budget = IO_BUDGET;
+            while (!conn.output.empty()) {
+                if (budget <= 0) {
+                    conn.moreToWrite = true;
+                    return true;
+                }
+
+                OutputSegment& seg = conn.output.front();
+                // Header directly followed by a file body: cork so both share the first segment.
+                if (!conn.corked && seg.inMemory() && headPrecedesFile(conn)) {
+                    Platform::setCork(conn.sock, true);
+                    conn.corked = true;
+                }
+                if (seg.inMemory() && conn.output.size() > 1 && conn.output[1].inMemory()) {
+                    // Consecutive in-memory segments (e.g. cached headers and body) go out together.
+                    int n = writeGathered(conn, budget);
+                    if (n == NetworkManager::IO_WOULD_BLOCK) return true;
+                    if (n == NetworkManager::IO_ERROR) return false;
+                    shaper.charge(conn.flow, n);
+                    conn.windowBytes += n;
+                    budget -= n;
+                    conn.lastActivity = chrono::steady_clock::now();
+                    continue;
+                }
+                if (seg.offset < seg.size()) {
+                    // File and compressed bodies are bulk and wait for the shaper; the rest is charged.
+                    bool bulk = !seg.inMemory();
+                    long long want = (long long)min(seg.size() - seg.offset, (size_t)IO_BUDGET);
+                    long long allowed = bulk ? shaper.grant(conn.flow, want) : want;
+                    if (allowed == 0) {
+                        park(conn);
+                        return true;
+                    }
+                    auto started = chrono::steady_clock::now();
+                    int n = NetworkManager::sendSome(conn.sock, seg.bytes() + seg.offset, (int)allowed);
+                    if (seg.isFile()) TransferStats::record(TransferStats::COPY, n, chrono::steady_clock::now() - started);
+                    if (bulk) shaper.giveBack(conn.flow, allowed - max(n, 0));
+                    else shaper.charge(conn.flow, n);
+                    if (n == NetworkManager::IO_WOULD_BLOCK) return true;
+                    if (n == NetworkManager::IO_ERROR) return false;
+                    seg.offset += n;
+                    budget -= n;
+                    conn.windowBytes += n;
+                    conn.lastActivity = chrono::steady_clock::now();
+                    if (bulk && yieldAfterQuantum(conn)) return true;
+                    continue;
+                }
+
+                if (seg.encoder && !seg.encoder->done()) {
+                    seg.data.clear();
+                    seg.offset = 0;
+                    if (!seg.encoder->produce(seg.data)) return false;
+                    continue;
+                }
+
+                if (seg.isFile() && seg.fileRemaining > 0) {
+                    if (!seg.openFile()) return false;
+    #ifdef __linux__
+                    if (options.zeroCopy) {
+                        long long allowed = shaper.grant(conn.flow, min((long long)budget, seg.fileRemaining));
+                        if (allowed == 0) {
+                            park(conn);
+                            return true;
+                        }
+                        auto started = chrono::steady_clock::now();
+                        off_t offset = (off_t)seg.fileOffset;
+                        ssize_t n = sendfile(conn.sock, seg.fileFd, &offset, (size_t)allowed);
+                        TransferStats::record(TransferStats::ZERO_COPY, n, chrono::steady_clock::now() - started);
+                        shaper.giveBack(conn.flow, allowed - max((long long)n, 0LL));
+                        if (n < 0) return Platform::wouldBlock(errno);
+                        if (n == 0) return false;
+                        seg.fileOffset += n;
+                        seg.fileRemaining -= n;
+                        budget -= (int)n;
+                        conn.windowBytes += n;
+                        conn.lastActivity = chrono::steady_clock::now();
+                        if (yieldAfterQuantum(conn)) return true;
+                        continue;
+                    }
+    #endif
+                    auto started = chrono::steady_clock::now();
+                    if (seg.data.capacity() == 0) seg.data = BufferPool::acquire((size_t)NetworkManager::bufferSize());
+                    seg.data.resize((size_t)min((long long)NetworkManager::bufferSize(), seg.fileRemaining));
+                    int got = Platform::readFileAt(seg.fileFd, &seg.data[0], (int)seg.data.size(), seg.fileOffset);
+                    TransferStats::record(TransferStats::COPY, 0, chrono::steady_clock::now() - started);
+                    if (got <= 0) {
+                        return false;
+                    }
+                    seg.data.resize((size_t)got);
+                    seg.offset = 0;
+                    seg.fileOffset += got;
+                    seg.fileRemaining -= got;
+                    continue;
+                }
+
+                if (!seg.inMemory() && conn.corked) {
+                    Platform::setCork(conn.sock, false);
+                    conn.corked = false;
+                }
+                conn.output.pop_front();
+            }
+            return true;
+        }
 
-            if (actualPath.rfind("/download", 0) == 0) {
-                handleDownloadRequest(clientSocket, actualPath);
-                return;
+        // While shaping, a bulk transfer gives up the loop after each granted quantum so that
+        // transfers sharing a limit take turns.
+        bool yieldAfterQuantum(Connection& conn) {
+            if (!shaper.shaping()) return false;
+            conn.moreToWrite = true;
+            return true;
+        }
+
+        // Whether the in-memory segments at the front of the queue, gathered into one send,
+        // are followed by a file body.
+        static bool headPrecedesFile(const Connection& conn) {
+            for (size_t i = 1; i < conn.output.size() && i < (size_t)NetworkManager::MAX_GATHER; ++i) {
+                if (!conn.output[i].inMemory()) return true;
             }
+            return false;
+        }
 
-            serveStaticFile(clientSocket, actualPath);
+        // One gathered send of the in-memory segments at the front of the queue, up to budget
+        // bytes; fully sent segments are dropped. Returns bytes sent or an IO_* code.
+        int writeGathered(Connection& conn, int budget) {
+            pair<const char*, size_t> parts[NetworkManager::MAX_GATHER];
+            int count = conn.gatherOutput(parts, (size_t)budget);
+            int n = NetworkManager::sendGathered(conn.sock, parts, count);
+            if (n < 0) return n;
+            conn.consumeOutput((size_t)n);
+            return n;
         }
 
-        void handleDownloadRequest(SOCKET clientSocket, const string& path) {
-            size_t q = path.find("?");
-            string filename;
-            if (q != string::npos) {
-                string query = path.substr(q + 1);
-                size_t eq = query.find("file=");
-                if (eq != string::npos) filename = query.substr(eq + 5);
+        // Run once a second: closes idle connections and holds the rest to their deadlines. A
+        // request head (or a command login) must be complete within headerTimeoutSeconds of its
+        // first byte, or of the accept for the first one; an upload body may not stall longer
+        // than bodyTimeoutSeconds; and a transfer must average minTransferRate over each
+        // RATE_WINDOW_SECONDS unless the shaper held it back. Only a late HTTP head is still
+        // answered (408); the others are simply closed.
+        void enforceDeadlines(chrono::steady_clock::time_point now) {
+            vector<SOCKET> idle, late;
+            for (auto& entry : connections) {
+                Connection& conn = *entry.second;
+                if (conn.closing) continue;
+
+                AdmissionControl::Reason missed = AdmissionControl::REASONS;
+                if (readingHead(conn) && now - conn.headStarted > chrono::seconds(options.headerTimeoutSeconds)) {
+                    missed = AdmissionControl::HEADER_TIMEOUT;
+                } else if (receivingUpload(conn) && now - conn.lastActivity > chrono::seconds(options.bodyTimeoutSeconds)) {
+                    missed = AdmissionControl::BODY_TIMEOUT;
+                } else if (conn.transferring && now - conn.windowStarted >= chrono::seconds(RATE_WINDOW_SECONDS)) {
+                    if (options.minTransferRate > 0 && !conn.flow.held &&
+                        conn.windowBytes < options.minTransferRate * RATE_WINDOW_SECONDS) {
+                        missed = AdmissionControl::SLOW_TRANSFER;
+                    }
+                    conn.windowStarted = now;
+                    conn.windowBytes = 0;
+                    conn.flow.held = false;
+                }
+                if (missed != AdmissionControl::REASONS) {
+                    admission.record(missed);
+                    if (missed == AdmissionControl::HEADER_TIMEOUT && conn.state == Connection::State::HttpRequest) {
+                        httpHandler.rejectTimedOut(conn);
+                        late.push_back(entry.first);
+                    } else {
+                        idle.push_back(entry.first);
+                    }
+                    continue;
+                }
+
+                bool betweenRequests = conn.state == Connection::State::HttpRequest && conn.requestsServed > 0 &&
+                                       conn.inBuffer.empty() && !conn.hasPendingOutput();
+                int timeout = betweenRequests ? options.keepAliveSeconds : IDLE_TIMEOUT_SECONDS;
+                if (now - conn.lastActivity > chrono::seconds(timeout)) {
+                    idle.push_back(entry.first);
+                }
             }
-            
-            if (filename.empty()) {
-                sendHttpResponse(clientSocket, 400, "text/plain", "Missing file parameter");
-                return;
+            for (SOCKET sock : idle) closeConnection(sock);
+            for (SOCKET sock : late) {
+                Connection& conn = *connections[sock];
+    #ifdef FTP_HAVE_IO_URING
+                if (ring) {
+                    advanceUring(conn);
+                    continue;
+                }
+    #endif
+                service(conn);
             }
+            httpHandler.expireSessions();
+        }
 
-            string filepath = fileManager.getUploadFolder() + filename;
-            if (!fileManager.fileExists(filepath)) {
-                sendHttpResponse(clientSocket, 404, "text/plain", "File not found");
-                return;
+        // Waiting on a request head or login, as opposed to between requests or mid-transfer.
+        static bool readingHead(const Connection& conn) {
+            switch (conn.state) {
+            case Connection::State::Detecting:
+            case Connection::State::CommandAuth:
+                return true;
+            case Connection::State::HttpRequest:
+                return !conn.inBuffer.empty() && !conn.pipelined && !conn.hasPendingOutput();
+            default:
+                return false;
             }
+        }
 
-            ifstream file(filepath, ios::binary | ios::ate);
-            if (!file.is_open()) {
-                sendHttpResponse(clientSocket, 500, "text/plain", "Unable to open file");
+        void closeConnection(SOCKET sock) {
+            auto it = connections.find(sock);
+            if (it == connections.end()) return;
+    #ifdef FTP_HAVE_IO_URING
+            if (ring) {
+                beginUringClose(*it->second);
+                if (it->second->inflight == 0) finishUringClose(sock);
                 return;
             }
+    #endif
+            commandHandler.connectionClosed(*it->second);
+            admission.endTransfer(*it->second);
+            admission.connectionClosed();
+            poller.remove(sock);
+            Platform::closeSocket(sock);
+            connections.erase(it);
+        }
 
-            streamsize fileSize = file.tellg();
-            file.seekg(0, ios::beg);
+    #ifdef FTP_HAVE_IO_URING
+        // ---- io_uring engine -------------------------------------------------------------
+        //
+        // Accepts, socket receives, socket sends and file reads are all submitted as SQEs and
+        // published together once per loop turn. File bodies are read with READ_FIXED into a
+        // registered buffer pool (READ_AHEAD chunks per connection, so the next disk read
+        // overlaps the current send) and sent from there with WRITE_FIXED. Client sockets are
+        // installed in a fixed-file table. A connection is only freed once it has no operation
+        // in flight, since the kernel may still write into its receive buffer.
 
-            string header = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n" +
-                        string("Content-Length: ") + to_string((long long)fileSize) + "\r\n" +
-                        "Content-Disposition: attachment; filename=\"" + filename + "\"\r\n\r\n";
-            
-            NetworkManager::sendAll(clientSocket, header.c_str(), (int)header.size());
+        static uint64_t uringTag(UringOp op, SOCKET sock, int slot = 0) {
+            return ((uint64_t)op << 56) | ((uint64_t)(slot & 0xffff) << 32) | (uint32_t)sock;
+        }
 
-            char buf[8192];
-            while (file.good()) {
-                file.read(buf, sizeof(buf));
-                streamsize got = file.gcount();
-                if (got > 0) {
-                    if (NetworkManager::sendAll(clientSocket, buf, (int)got) == SOCKET_ERROR) break;
-                }
+        bool openIoUring() {
+            unique_ptr<IoUring> r(new IoUring());
+            if (!r->init(RING_ENTRIES)) return false;
+            slotPool.assign((size_t)BUFFER_SLOTS * SLOT_SIZE, 0);
+            if (!r->registerBuffer(slotPool.data(), slotPool.size())) {
+                slotPool.clear();
+                return false;
             }
-            file.close();
+            for (int i = BUFFER_SLOTS - 1; i >= 0; --i) freeSlots.push_back(i);
+            fixedFiles = r->registerFileTable(FIXED_FILE_SLOTS);
+            tickInterval.tv_sec = 1;
+            tickInterval.tv_nsec = 0;
+            refillInterval.tv_sec = 0;
+            refillInterval.tv_nsec = TransferShaper::REFILL_MS * 1000000L;
+            ring = move(r);
+            return true;
         }
 
-        void serveStaticFile(SOCKET clientSocket, const string& path) {
-            string localPath = fileManager.getWwwFolder() + path.substr(1);
-            
-            if (localPath.find("..") != string::npos) {
-                sendHttpResponse(clientSocket, 403, "text/plain", "Forbidden");
-                return;
+        void runIoUring() {
+            postAccept();
+            postTick();
+            io_uring_cqe cqe;
+            while (running) {
+                ring->submitAndWait(1);
+                while (ring->popCompletion(cqe)) {
+                    handleCompletion(cqe);
+                }
+                while (!freeSlots.empty() && !slotWaiters.empty()) {
+                    SOCKET sock = slotWaiters.front();
+                    slotWaiters.pop_front();
+                    auto it = connections.find(sock);
+                    if (it == connections.end()) continue;
+                    it->second->queued = false;
+                    advanceUring(*it->second);
+                }
             }
-            
-            if (!fileManager.fileExists(localPath)) {
-                sendHttpResponse(clientSocket, 404, "text/plain", "Not Found");
-                return;
+        }
+
+        void targetSocket(io_uring_sqe* sqe, const Connection& conn) {
+            if (conn.fixedSlot >= 0) {
+                sqe->fd = conn.fixedSlot;
+                sqe->flags |= IOSQE_FIXED_FILE;
+            } else {
+                sqe->fd = conn.sock;
             }
+        }
 
-            string contentType = "application/octet-stream";
-            if (localPath.rfind(".html") != string::npos) contentType = "text/html";
-            else if (localPath.rfind(".css") != string::npos) contentType = "text/css";
-            else if (localPath.rfind(".js") != string::npos) contentType = "application/javascript";
-            else if (localPath.rfind(".png") != string::npos) contentType = "image/png";
+        void postAccept() {
+            io_uring_sqe* sqe = ring->nextSqe();
+            if (!sqe) return;
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listenSocket;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            sqe->user_data = uringTag(OP_ACCEPT, listenSocket);
+        }
 
-            ifstream in(localPath, ios::binary | ios::ate);
-            streamsize size = in.tellg();
-            in.seekg(0, ios::beg);
-            
-            string header = "HTTP/1.1 200 OK\r\nContent-Type: " + contentType + "\r\n" +
-                        "Content-Length: " + to_string((long long)size) + "\r\n\r\n";
-            
-            NetworkManager::sendAll(clientSocket, header.c_str(), (int)header.size());
+        void postTick() {
+            io_uring_sqe* sqe = ring->nextSqe();
+            if (!sqe) return;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (unsigned long long)(uintptr_t)&tickInterval;
+            sqe->len = 1;
+            sqe->user_data = uringTag(OP_TICK, 0);
+        }
 
-            char buf[8192];
-            while (in.good()) {
-                in.read(buf, sizeof(buf));
-                streamsize got = in.gcount();
-                if (got > 0) {
-                    if (NetworkManager::sendAll(clientSocket, buf, (int)got) == SOCKET_ERROR) break;
-                }
-            }
-            in.close();
+        void postRefill() {
+            io_uring_sqe* sqe = ring->nextSqe();
+            if (!sqe) return;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (unsigned long long)(uintptr_t)&refillInterval;
+            sqe->len = 1;
+            sqe->user_data = uringTag(OP_REFILL, 0);
         }
 
-        void handlePostRequest(SOCKET clientSocket, const string& req, const string& path) {
-            size_t headersEnd = req.find("\r\n\r\n");
-            if (headersEnd == string::npos) {
-                sendHttpResponse(clientSocket, 400, "text/plain", "Bad Request");
+        void postRecv(Connection& conn) {
+            size_t len = conn.recvBuffer.size();
+            conn.recvGranted = 0;
+            if (receivingUpload(conn) && shaper.shaping()) {
+                conn.recvGranted = shaper.grant(conn.flow, (long long)len);
+                if (conn.recvGranted == 0) {
+                    park(conn);
+                    return;
+                }
+                len = (size_t)conn.recvGranted;
+            }
+            io_uring_sqe* sqe = ring->nextSqe();
+            if (!sqe) {
+                shaper.giveBack(conn.flow, conn.recvGranted);
                 return;
             }
+            sqe->opcode = IORING_OP_RECV;
+            targetSocket(sqe, conn);
+            sqe->addr = (unsigned long long)(uintptr_t)conn.recvBuffer.data();
+            sqe->len = (unsigned)len;
+            sqe->user_data = uringTag(OP_RECV, conn.sock);
+            conn.recvPosted = true;
+            conn.inflight++;
+        }
 
-            string headers = req.substr(0, headersEnd + 4);
-            string body = req.substr(headersEnd + 4);
-            string contentLengthStr = getHeaderValue(headers, "Content-Length");
-            long long contentLength = contentLengthStr.empty() ? 0 : atoll(contentLengthStr.c_str());
-
-            int already = (int)body.size();
-            while (already < contentLength) {
-                char tmp[8192];
-                int r = recv(clientSocket, tmp, sizeof(tmp), 0);
-                if (r <= 0) break;
-                body.append(tmp, tmp + r);
-                already += r;
+        // A bulk send of compressed body bytes, as much of len as the shaper grants.
+        void postSend(Connection& conn, const char* data, size_t len) {
+            long long allowed = shaper.grant(conn.flow, (long long)min(len, (size_t)IO_BUDGET));
+            if (allowed == 0) {
+                park(conn);
+                return;
             }
-
-            size_t q = path.find("?");
-            string filename;
-            if (q != string::npos) {
-                string query = path.substr(q + 1);
-                size_t eq = query.find("filename=");
-                if (eq != string::npos) filename = urlDecode(query.substr(eq + 9));
+            io_uring_sqe* sqe = ring->nextSqe();
+            if (!sqe) {
+                shaper.giveBack(conn.flow, allowed);
+                return;
             }
+            conn.sendGranted = allowed;
+            sqe->opcode = IORING_OP_SEND;
+            targetSocket(sqe, conn);
+            sqe->addr = (unsigned long long)(uintptr_t)data;
+            sqe->len = (unsigned)allowed;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = uringTag(OP_SEND, conn.sock);
+            conn.sendPosted = true;
+            conn.inflight++;
+        }
 
-            if (path.rfind("/upload", 0) == 0) {
-                handleUpload(clientSocket, filename, body);
-            } else if (path.rfind("/delete", 0) == 0) {
-                handleDelete(clientSocket, filename);
-            } else if (path.rfind("/restore", 0) == 0) {
-                handleRestore(clientSocket, filename);
-            } else if (path.rfind("/delete_permanent", 0) == 0) {
-                handleDeletePermanent(clientSocket, filename);
-            } else if (path.rfind("/empty_trash", 0) == 0) {
-                handleEmptyTrash(clientSocket);
-            } else {
-                sendHttpResponse(clientSocket, 404, "text/plain", "Unknown POST endpoint");
+        // One sendmsg over the in-memory segments at the front of the queue; its completion
+        // is accounted like a plain send.
+        void postSendGathered(Connection& conn) {
+            pair<const char*, size_t> parts[NetworkManager::MAX_GATHER];
+            int count = conn.gatherOutput(parts, (size_t)IO_BUDGET);
+            io_uring_sqe* sqe = ring->nextSqe();
+            if (!sqe) return;
+            conn.sendGranted = 0;
+            for (int i = 0; i < count; ++i) {
+                conn.sendParts[i].iov_base = (void*)parts[i].first;
+                conn.sendParts[i].iov_len = parts[i].second;
             }
+            conn.sendMessage = msghdr();
+            conn.sendMessage.msg_iov = conn.sendParts;
+            conn.sendMessage.msg_iovlen = (size_t)count;
+            sqe->opcode = IORING_OP_SENDMSG;
+            targetSocket(sqe, conn);
+            sqe->addr = (unsigned long long)(uintptr_t)&conn.sendMessage;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = uringTag(OP_SEND, conn.sock);
+            conn.sendPosted = true;
+            conn.inflight++;
         }
 
-        void handleUpload(SOCKET clientSocket, const string& filename, const string& body) {
-            if (filename.empty()) {
-                sendHttpResponse(clientSocket, 400, "text/plain", "Missing filename param");
+        void postSendChunk(Connection& conn, const Connection::FileChunk& chunk) {
+            long long allowed = shaper.grant(conn.flow, (long long)(chunk.len - chunk.sent));
+            if (allowed == 0) {
+                park(conn);
                 return;
             }
-
-            string filepath = fileManager.getUploadFolder() + filename;
-            ofstream out(filepath, ios::binary);
-            if (!out.is_open()) {
-                sendHttpResponse(clientSocket, 500, "text/plain", "Error creating file");
+            io_uring_sqe* sqe = ring->nextSqe();
+            if (!sqe) {
+                shaper.giveBack(conn.flow, allowed);
                 return;
             }
+            conn.sendGranted = allowed;
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            targetSocket(sqe, conn);
+            sqe->addr = (unsigned long long)(uintptr_t)(slotPool.data() + (size_t)chunk.slot * SLOT_SIZE + chunk.sent);
+            sqe->len = (unsigned)allowed;
+            sqe->buf_index = 0;
+            sqe->user_data = uringTag(OP_SEND_FIXED, conn.sock, chunk.slot);
+            conn.sendPosted = true;
+            conn.inflight++;
+        }
 
-            out.write(body.data(), body.size());
-            out.close();
+        bool postFileRead(Connection& conn, OutputSegment& seg) {
+            io_uring_sqe* sqe = ring->nextSqe();
+            if (!sqe) return false;
+            int slot = freeSlots.back();
+            freeSlots.pop_back();
+            size_t len = (size_t)min((long long)SLOT_SIZE, seg.fileRemaining);
 
-            string trashPath = fileManager.getTrashFolder() + filename;
-            if (fileManager.fileExists(trashPath)) {
-                DeleteFileA(trashPath.c_str());
-            }
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->fd = seg.fileFd;
+            sqe->off = (unsigned long long)seg.fileOffset;
+            sqe->addr = (unsigned long long)(uintptr_t)(slotPool.data() + (size_t)slot * SLOT_SIZE);
+            sqe->len = (unsigned)len;
+            sqe->buf_index = 0;
+            sqe->user_data = uringTag(OP_FILE_READ, conn.sock, slot);
 
-            sendHttpResponse(clientSocket, 200, "text/plain", "File uploaded");
+            Connection::FileChunk chunk = { slot, len, 0, false };
+            conn.chunks.push_back(chunk);
+            seg.fileOffset += (long long)len;
+            seg.fileRemaining -= (long long)len;
+            conn.inflight++;
+            return true;
         }
 
-        void handleDelete(SOCKET clientSocket, const string& filename) {
-            if (filename.empty()) {
-                sendHttpResponse(clientSocket, 400, "text/plain", "Missing filename param");
+        void adoptConnection(SOCKET client) {
+            if (!admission.admitConnection()) {
+                refuseConnection(client);
                 return;
             }
-
-            string sourcePath = fileManager.getUploadFolder() + filename;
-            if (!fileManager.fileExists(sourcePath)) {
-                sendHttpResponse(clientSocket, 404, "text/plain", "File not found in uploads");
-            } else if (fileManager.moveToTrash(filename)) {
-                sendHttpResponse(clientSocket, 200, "text/plain", "Moved to trash");
-            } else {
-                sendHttpResponse(clientSocket, 500, "text/plain", "Error moving file");
+            unique_ptr<Connection> conn(new Connection(client));
+            conn->recvBuffer.resize(NetworkManager::bufferSize());
+            if (fixedFiles && client >= 0 && (unsigned)client < FIXED_FILE_SLOTS && ring->updateFile(client, client)) {
+                conn->fixedSlot = client;
             }
+            Connection& ref = *conn;
+            connections[client] = move(conn);
+            postRecv(ref);
         }
 
-        void handleRestore(SOCKET clientSocket, const string& filename) {
-            if (filename.empty()) {
-                sendHttpResponse(clientSocket, 400, "text/plain", "Missing filename param");
+        void handleCompletion(const io_uring_cqe& cqe) {
+            UringOp op = (UringOp)(cqe.user_data >> 56);
+            SOCKET sock = (SOCKET)(uint32_t)cqe.user_data;
+            int slot = (int)((cqe.user_data >> 32) & 0xffff);
+
+            if (op == OP_TICK) {
+                enforceDeadlines(chrono::steady_clock::now());
+                if (running) postTick();
+                return;
+            }
+            if (op == OP_REFILL) {
+                resumeThrottled();
+                return;
+            }
+            if (op == OP_ACCEPT) {
+                if (cqe.res >= 0) {
+                    adoptConnection((SOCKET)cqe.res);
+                } else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED) {
+                    cout << "Accept failed. Error: " << -cqe.res << "\n";
+                }
+                if (running) postAccept();
                 return;
             }
 
-            string trashPath = fileManager.getTrashFolder() + filename;
-            if (!fileManager.fileExists(trashPath)) {
-                sendHttpResponse(clientSocket, 404, "text/plain", "File not found in trash");
+            auto it = connections.find(sock);
+            if (it == connections.end()) {
+                if (op == OP_FILE_READ || op == OP_SEND_FIXED) freeSlots.push_back(slot);
                 return;
             }
+            Connection& conn = *it->second;
+            conn.inflight--;
 
-            string uploadPath = fileManager.getUploadFolder() + filename;
+            switch (op) {
+            case OP_RECV:
+                conn.recvPosted = false;
+                shaper.giveBack(conn.flow, conn.recvGranted - max(cqe.res, 0));
+                conn.recvGranted = 0;
+                if (cqe.res > 0 && !conn.closing) {
+                    consumeInput(conn, conn.recvBuffer.data(), cqe.res);
+                    processInput(conn);
+                } else if (cqe.res == 0) {
+                    onPeerClosed(conn);
+                } else if (cqe.res != -EAGAIN && cqe.res != -EINTR) {
+                    beginUringClose(conn);
+                }
+                break;
 
-            if (MoveFileExA(trashPath.c_str(), uploadPath.c_str(), MOVEFILE_COPY_ALLOWED | MOVEFILE_REPLACE_EXISTING)) {
-                sendHttpResponse(clientSocket, 200, "text/plain", "Restored");
-            } else {
-                sendHttpResponse(clientSocket, 500, "text/plain", "Error restoring");
+            case OP_SEND:
+                conn.sendPosted = false;
+                if (conn.sendGranted > 0) shaper.giveBack(conn.flow, conn.sendGranted - max(cqe.res, 0));
+                else shaper.charge(conn.flow, cqe.res);
+                conn.sendGranted = 0;
+                if (cqe.res < 0) {
+                    beginUringClose(conn);
+                } else {
+                    conn.consumeOutput((size_t)cqe.res);
+                    conn.windowBytes += cqe.res;
+                    conn.lastActivity = chrono::steady_clock::now();
+                }
+                break;
+
+            case OP_SEND_FIXED:
+                conn.sendPosted = false;
+                shaper.giveBack(conn.flow, conn.sendGranted - max(cqe.res, 0));
+                conn.sendGranted = 0;
+                if (cqe.res < 0 || conn.chunks.empty()) {
+                    beginUringClose(conn);
+                } else {
+                    Connection::FileChunk& chunk = conn.chunks.front();
+                    chunk.sent += (size_t)cqe.res;
+                    conn.windowBytes += cqe.res;
+                    conn.lastActivity = chrono::steady_clock::now();
+                    if (chunk.sent >= chunk.len) {
+                        freeSlots.push_back(chunk.slot);
+                        conn.chunks.pop_front();
+                    }
+                }
+                break;
+
+            case OP_FILE_READ:
+                for (Connection::FileChunk& chunk : conn.chunks) {
+                    if (chunk.slot != slot) continue;
+                    // A short read means the file shrank under us; the promised length can't be met.
+                    if (cqe.res != (int)chunk.len) beginUringClose(conn);
+                    chunk.filled = true;
+                    break;
+                }
+                break;
+
+            default:
+                break;
             }
+
+            advanceUring(conn);
         }
 
-        void handleDeletePermanent(SOCKET clientSocket, const string& filename) {
-            if (filename.empty()) {
-                sendHttpResponse(clientSocket, 400, "text/plain", "Missing filename param");
+        // Queues whatever the connection can do next, or frees it once a close has drained.
+        void advanceUring(Connection& conn) {
+            if (conn.closing) {
+                if (conn.inflight == 0) finishUringClose(conn.sock);
                 return;
             }
 
-            string trashPath = fileManager.getTrashFolder() + filename;
-            if (!fileManager.fileExists(trashPath)) {
-                sendHttpResponse(clientSocket, 404, "text/plain", "File not found in trash");
+            if (conn.pipelined) processInput(conn);
+            pumpUringOutput(conn);
+            if (conn.closing) {
+                if (conn.inflight == 0) finishUringClose(conn.sock);
                 return;
             }
+            settleTransfer(conn);
 
-            if (DeleteFileA(trashPath.c_str())) {
-                sendHttpResponse(clientSocket, 200, "text/plain", "Permanently deleted");
-            } else {
-                sendHttpResponse(clientSocket, 500, "text/plain", "Error deleting file");
+            if (!conn.hasPendingOutput() && !conn.pipelined && (conn.closeWhenDrained || conn.peerClosed)) {
+                beginUringClose(conn);
+                if (conn.inflight == 0) finishUringClose(conn.sock);
+                return;
             }
-        }
-
-        void handleEmptyTrash(SOCKET clientSocket) {
-            string pattern = fileManager.getTrashFolder() + "*";
-            WIN32_FIND_DATAA ffd;
-            HANDLE hFind = FindFirstFileA(pattern.c_str(), &ffd);
-            int deletedCount = 0;
-            
-            if (hFind != INVALID_HANDLE_VALUE) {
-                do {
-                    string name = ffd.cFileName;
-                    if (name == "." || name == "..") continue;
-                    if (!(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                        string filepath = fileManager.getTrashFolder() + name;
-                        if (DeleteFileA(filepath.c_str())) deletedCount++;
-                    }
-                } while (FindNextFileA(hFind, &ffd));
-                FindClose(hFind);
+            if (!conn.recvPosted && !conn.peerClosed) {
+                postRecv(conn);
             }
-            
-            sendHttpResponse(clientSocket, 200, "text/plain", 
-                            "Deleted " + to_string(deletedCount) + " files from trash");
         }
-    };
-
-    class CommandHandler {
-    private:
-        FileManager& fileManager;
-        NetworkManager& networkManager;
 
-    public:
-        CommandHandler(FileManager& fm, NetworkManager& nm) 
-            : fileManager(fm), networkManager(nm) {}
-
-        void handleCommand(SOCKET clientSocket, const string& command) {
-            // First message should be authentication
-            if (!fileManager.getSessionManager().isAuthenticated(clientSocket)) {
-                if (!fileManager.authenticateClient(clientSocket)) {
-                    string resp = "AUTH FAILED";
-                    NetworkManager::sendAll(clientSocket, resp.c_str(), (int)resp.size());
-                    closesocket(clientSocket);
+        void pumpUringOutput(Connection& conn) {
+            while (!conn.output.empty()) {
+                OutputSegment& seg = conn.output.front();
+                if (seg.offset < seg.size()) {
+                    if (conn.sendPosted) return;
+                    if (seg.inMemory()) postSendGathered(conn);
+                    else postSend(conn, seg.bytes() + seg.offset, seg.size() - seg.offset);
                     return;
-                } else {
-                    string resp = "AUTH OK";
-                    NetworkManager::sendAll(clientSocket, resp.c_str(), (int)resp.size());
+                }
+                if (seg.encoder && !seg.encoder->done()) {
+                    seg.data.clear();
+                    seg.offset = 0;
+                    if (!seg.encoder->produce(seg.data)) {
+                        beginUringClose(conn);
+                        return;
+                    }
+                    continue;
+                }
+                if (!seg.isFile()) {
+                    conn.output.pop_front();
+                    continue;
+                }
+                if (!seg.openFile()) {
+                    beginUringClose(conn);
                     return;
                 }
-            }
-
-            string cmd = command;
-            while (!cmd.empty() && (cmd.back() == '\r' || cmd.back() == '\n')) {
-                cmd.pop_back();
-            }
-
-            cout << "Received command: " << cmd << endl;
-
-            if (cmd.rfind("UPLOAD ", 0) == 0) {
-                handleUploadCommand(clientSocket, cmd.substr(7));
-            } else if (cmd.rfind("DOWNLOAD ", 0) == 0) {
-                handleDownloadCommand(clientSocket, cmd.substr(9));
-            } else if (cmd == "LIST") {
-                handleListCommand(clientSocket);
-            } else if (cmd.rfind("DELETE ", 0) == 0) {
-                handleDeleteCommand(clientSocket, cmd.substr(7));
-            } else if (cmd == "LIST_TRASH") {
-                handleListTrashCommand(clientSocket);
-            } else if (cmd.rfind("RESTORE ", 0) == 0) {
-                handleRestoreCommand(clientSocket, cmd.substr(8));
-            } else {
-                string resp = "Unknown command";
-                NetworkManager::sendAll(clientSocket, resp.c_str(), (int)resp.size());
-            }
-        }
 
-    private:
-        void handleUploadCommand(SOCKET clientSocket, const string& filename) {
-            string filepath = fileManager.getUploadFolder() + filename;
-            string ready = "READY";
-            NetworkManager::sendAll(clientSocket, ready.c_str(), (int)ready.size());
+                while ((int)conn.chunks.size() < READ_AHEAD && seg.fileRemaining > 0) {
+                    if (freeSlots.empty()) {
+                        if (!conn.queued) {
+                            conn.queued = true;
+                            slotWaiters.push_back(conn.sock);
+                        }
+                        break;
+                    }
+                    if (!postFileRead(conn, seg)) break;
+                }
 
-            ofstream out(filepath, ios::binary);
-            if (!out.is_open()) {
-                string resp = "Error creating file";
-                NetworkManager::sendAll(clientSocket, resp.c_str(), (int)resp.size());
+                if (conn.chunks.empty()) {
+                    if (seg.fileRemaining > 0) return;
+                    conn.output.pop_front();
+                    continue;
+                }
+                if (!conn.sendPosted && conn.chunks.front().filled) {
+                    postSendChunk(conn, conn.chunks.front());
+                }
                 return;
             }
+        }
 
-            char buf[8192];
-            int r;
-            while ((r = recv(clientSocket, buf, sizeof(buf), 0)) > 0) {
-                out.write(buf, r);
-                if (r < (int)sizeof(buf)) break;
-            }
-            out.close();
+        // Shutting the socket down completes any receive or send still parked in the kernel;
+        // the descriptor is closed by finishUringClose once they have all been reaped.
+        void beginUringClose(Connection& conn) {
+            if (conn.closing) return;
+            conn.closing = true;
+            commandHandler.connectionClosed(conn);
+            shutdown(conn.sock, SHUT_RDWR);
+        }
 
-            string resp = "File uploaded: " + filename;
-            NetworkManager::sendAll(clientSocket, resp.c_str(), (int)resp.size());
+        void finishUringClose(SOCKET sock) {
+            auto it = connections.find(sock);
+            if (it == connections.end()) return;
+            Connection& conn = *it->second;
+            for (const Connection::FileChunk& chunk : conn.chunks) freeSlots.push_back(chunk.slot);
+            conn.chunks.clear();
+            if (conn.fixedSlot >= 0) ring->updateFile(conn.fixedSlot, -1);
+            admission.endTransfer(conn);
+            admission.connectionClosed();
+            Platform::closeSocket(sock);
+            connections.erase(it);
         }
+    #endif
+    };
 
-        void handleDownloadCommand(SOCKET clientSocket, const string& filename) {
-            string filepath = fileManager.getUploadFolder() + filename;
-            if (!fileManager.fileExists(filepath)) {
-                string err = "File not found: " + filename;
-                NetworkManager::sendAll(clientSocket, err.c_str(), (int)err.size());
-                return;
-            }
+    // One event loop with its own handlers, pinned to a CPU when requested. Workers share
+    // only SessionManager and FileManager, which are internally synchronized.
+    class Worker {
+    private:
+        HttpRequestHandler httpHandler;
+        CommandHandler commandHandler;
+        EventLoop eventLoop;
+        int cpu;
+        thread loopThread;
 
-            ifstream in(filepath, ios::binary | ios::ate);
-            streamsize size = in.tellg();
-            in.seekg(0, ios::beg);
-            char buf[8192];
-            
-            while (in.good()) {
-                in.read(buf, sizeof(buf));
-                streamsize g = in.gcount();
-                if (g > 0) {
-                    if (NetworkManager::sendAll(clientSocket, buf, (int)g) == SOCKET_ERROR) break;
-                }
-            }
-            in.close();
-        }
+    public:
+        Worker(FileManager& fm, NetworkManager& nm, ChunkedUploadManager& cu, StaticAssetCache& sa,
+               TransferShaper& ts, AdmissionControl& ac, const ServerOptions& options, int cpuIndex)
+            : httpHandler(fm, nm, cu, sa, ts, ac), commandHandler(fm, nm, cu, ac),
+            eventLoop(httpHandler, commandHandler, ts, ac, options), cpu(cpuIndex) {}
 
-        void handleListCommand(SOCKET clientSocket) {
-            string listing = "=== Server Files ===\n" + fileManager.listFilesInFolder(fileManager.getUploadFolder());
-            NetworkManager::sendAll(clientSocket, listing.c_str(), (int)listing.size());
+        ~Worker() {
+            stop();
+            join();
         }
 
-        void handleDeleteCommand(SOCKET clientSocket, const string& filename) {
-            if (fileManager.moveToTrash(filename)) {
-                string resp = "File moved to trash: " + filename;
-                NetworkManager::sendAll(clientSocket, resp.c_str(), (int)resp.size());
-            } else {
-                string resp = "Error moving file to trash: " + filename;
-                NetworkManager::sendAll(clientSocket, resp.c_str(), (int)resp.size());
-            }
+        bool open(SOCKET listener) {
+            return eventLoop.open(listener);
         }
 
-        void handleListTrashCommand(SOCKET clientSocket) {
-            string listing = "=== Trash Files ===\n" + fileManager.listFilesInFolder(fileManager.getTrashFolder());
-            NetworkManager::sendAll(clientSocket, listing.c_str(), (int)listing.size());
+        void start() {
+            loopThread = thread([this]() {
+                if (cpu >= 0 && !Platform::pinCurrentThread(cpu)) {
+                    cout << "Could not pin worker to CPU " << cpu << "\n";
+                }
+                eventLoop.run();
+            });
         }
 
-        void handleRestoreCommand(SOCKET clientSocket, const string& filename) {
-            string trashPath = fileManager.getTrashFolder() + filename;
-            string uploadPath = fileManager.getUploadFolder() + filename;
-            
-            if (MoveFileExA(trashPath.c_str(), uploadPath.c_str(), MOVEFILE_COPY_ALLOWED | MOVEFILE_REPLACE_EXISTING)) {
-                string resp = "File restored: " + filename;
-                NetworkManager::sendAll(clientSocket, resp.c_str(), (int)resp.size());
-            } else {
-                string resp = "Error restoring file: " + filename;
-                NetworkManager::sendAll(clientSocket, resp.c_str(), (int)resp.size());
-            }
+        void stop() { eventLoop.stop(); }
+
+        void join() {
+            if (loopThread.joinable()) loopThread.join();
         }
     };
 
@@ -974,126 +7577,167 @@
     private:
         SessionManager sessionManager;
         FileManager fileManager;
+        ChunkedUploadManager chunkedUploads;
+        StaticAssetCache staticAssets;
         NetworkManager networkManager;
-        HttpRequestHandler httpHandler;
-        CommandHandler commandHandler;
-        SOCKET serverSocket;
+        TransferShaper shaper;
+        AdmissionControl admission;
+        vector<unique_ptr<Worker>> workers;
+        vector<SOCKET> listenSockets;
+        ServerOptions options;
+        int workerCount;
         bool running;
 
     public:
-        FTPServer() 
-            : sessionManager(), fileManager(sessionManager), networkManager(), 
-            httpHandler(fileManager, networkManager),
-            commandHandler(fileManager, networkManager),
-            serverSocket(INVALID_SOCKET), running(false) {}
+        FTPServer(const ServerOptions& opts = ServerOptions()) 
+            : sessionManager(), fileManager(sessionManager, opts.dedup), chunkedUploads(fileManager),
+            staticAssets(fileManager.getWwwFolder()), networkManager(),
+            shaper(TransferShaper::Limits{ opts.rateLimit, opts.userRateLimit, opts.connectionRateLimit }),
+            admission(opts.maxConnections, opts.maxTransfers), options(opts), workerCount(opts.workers), running(false) {
+            if (workerCount <= 0) {
+                workerCount = max(1, (int)thread::hardware_concurrency());
+            }
+        }
 
         ~FTPServer() {
             stop();
         }
 
         bool start(int port = 8080) {
-            WSADATA wsaData;
-            if (WSAStartup(MAKEWORD(2,2), &wsaData) != 0) {
+            if (!Platform::initSockets()) {
                 cout << "WSAStartup failed\n";
                 return false;
             }
 
-            serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-            if (serverSocket == INVALID_SOCKET) {
-                cout << "Socket creation failed\n";
-                WSACleanup();
-                return false;
-            }
-
-            BOOL opt = TRUE;
-            setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
-
-            sockaddr_in serverAddr;
-            serverAddr.sin_family = AF_INET;
-            serverAddr.sin_port = htons(port);
-            serverAddr.sin_addr.s_addr = INADDR_ANY;
-
-            if (bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-                cout << "Bind failed. Error: " << WSAGetLastError() << "\n";
-                closesocket(serverSocket);
-                WSACleanup();
-                return false;
-            }
+            int cpus = max(1, (int)thread::hardware_concurrency());
+            for (int i = 0; i < workerCount; ++i) {
+                // With SO_REUSEPORT the kernel shards incoming connections across one listener
+                // per worker; elsewhere all workers poll a single shared listener.
+                SOCKET listener;
+    #ifdef SO_REUSEPORT
+                listener = openListener(port);
+    #else
+                listener = listenSockets.empty() ? openListener(port) : listenSockets[0];
+    #endif
+                if (listener == INVALID_SOCKET) {
+                    stop();
+                    return false;
+                }
+                if (listenSockets.empty() || listenSockets.back() != listener) {
+                    listenSockets.push_back(listener);
+                }
 
-            if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
-                cout << "Listen failed\n";
-                closesocket(serverSocket);
-                WSACleanup();
-                return false;
+                unique_ptr<Worker> worker(new Worker(fileManager, networkManager, chunkedUploads, staticAssets, shaper, admission, options, options.pinCpus ? i % cpus : -1));
+                if (!worker->open(listener)) {
+                    cout << "Event loop setup failed\n";
+                    stop();
+                    return false;
+                }
+                workers.push_back(move(worker));
             }
 
             running = true;
-            cout << "Server listening on http://localhost:" << port << "/\n";
+            cout << "Server listening on http://localhost:" << port << "/ with " << workerCount << " worker(s)\n";
             cout << "Default credentials: admin / password123\n";
             return true;
         }
 
         void run() {
-            while (running) {
-                SOCKET clientSocket = accept(serverSocket, NULL, NULL);
-                if (clientSocket == INVALID_SOCKET) {
-                    if (running) cout << "Accept failed\n";
-                    continue;
-                }
-                handleClient(clientSocket);
-            }
+            for (auto& worker : workers) worker->start();
+            for (auto& worker : workers) worker->join();
         }
 
         void stop() {
             running = false;
-            if (serverSocket != INVALID_SOCKET) {
-                closesocket(serverSocket);
-                serverSocket = INVALID_SOCKET;
-            }
-            WSACleanup();
+            for (auto& worker : workers) worker->stop();
+            for (auto& worker : workers) worker->join();
+            workers.clear();
+            for (SOCKET sock : listenSockets) Platform::closeSocket(sock);
+            listenSockets.clear();
+            Platform::cleanupSockets();
         }
 
     private:
-        void handleClient(SOCKET clientSocket) {
-            char buffer[8192];
-            int bytesReceived = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-            
-            if (bytesReceived <= 0) {
-                closesocket(clientSocket);
-                return;
+        SOCKET openListener(int port) {
+            SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (sock == INVALID_SOCKET) {
+                cout << "Socket creation failed\n";
+                return INVALID_SOCKET;
             }
-            
-            buffer[bytesReceived] = '\0';
-            string request(buffer);
-            
-            if (request.find("HTTP/") != string::npos || 
-                request.find("GET ") == 0 || 
-                request.find("POST ") == 0) {
-                
-                while (request.find("\r\n\r\n") == string::npos) {
-                    int more = recv(clientSocket, buffer, sizeof(buffer), 0);
-                    if (more <= 0) break;
-                    buffer[more] = '\0';
-                    request.append(buffer);
-                    if (request.size() > 64 * 1024) break;
-                }
-                
-                httpHandler.handleRequest(clientSocket, request);
-            } else {
-                commandHandler.handleCommand(clientSocket, request);
+
+            int opt = 1;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+    #ifdef SO_REUSEPORT
+            setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&opt, sizeof(opt));
+    #endif
+
+            sockaddr_in serverAddr;
+            serverAddr.sin_family = AF_INET;
+            serverAddr.sin_port = htons(port);
+            serverAddr.sin_addr.s_addr = INADDR_ANY;
+
+            if (bind(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+                cout << "Bind failed. Error: " << Platform::lastSocketError() << "\n";
+                Platform::closeSocket(sock);
+                return INVALID_SOCKET;
             }
-            
-            closesocket(clientSocket);
+
+            // A short accept queue: once it is full the kernel holds off new handshakes rather
+            // than letting clients pile up unseen behind connections the loops have yet to take.
+            if (listen(sock, options.acceptBacklog > 0 ? options.acceptBacklog : SOMAXCONN) == SOCKET_ERROR) {
+                cout << "Listen failed\n";
+                Platform::closeSocket(sock);
+                return INVALID_SOCKET;
+            }
+            return sock;
         }
     };
 
-    int main() {
-        FTPServer server;
+    // Usage: server [--port N] [--workers N] [--pin-cpus] [--io-uring] [--copy-path]
+    //               [--keepalive-timeout S] [--max-requests N] [--dedup]
+    //               [--rate-limit R] [--user-rate-limit R] [--connection-rate-limit R]
+    //               [--max-connections N] [--max-transfers N] [--backlog N]
+    //               [--header-timeout S] [--body-timeout S] [--min-rate R]
+    //   --workers 0 = one per CPU; --copy-path disables sendfile() for comparison on /stats
+    //   --max-requests 1 turns HTTP keep-alive off
+    //   --dedup keeps each distinct chunk of uploaded content once, in chunks/
+    //   rate limits are bytes per second (e.g. 512k, 10m) for bulk transfers; POST /limits changes them
+    //   --max-connections and --max-transfers 0 lift the caps; --min-rate 0 lets transfers crawl
+    // Build with -DFTP_WITH_ZLIB (-lz) and/or -DFTP_WITH_BROTLI (-lbrotlienc) to compress www/
+    // assets in memory; without them only .gz/.br files placed next to the assets are served.
+    // -DFTP_WITH_ZLIB and -DFTP_WITH_ZSTD (-lzstd) also compress downloads and uploads on the fly.
+    int main(int argc, char* argv[]) {
+        int port = 8080;
+        ServerOptions options;
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--port" && i + 1 < argc) port = atoi(argv[++i]);
+            else if (arg == "--workers" && i + 1 < argc) options.workers = atoi(argv[++i]);
+            else if (arg == "--pin-cpus") options.pinCpus = true;
+            else if (arg == "--io-uring") options.ioUring = true;
+            else if (arg == "--copy-path") options.zeroCopy = false;
+            else if (arg == "--keepalive-timeout" && i + 1 < argc) options.keepAliveSeconds = atoi(argv[++i]);
+            else if (arg == "--max-requests" && i + 1 < argc) options.maxRequestsPerConnection = atoi(argv[++i]);
+            else if (arg == "--dedup") options.dedup = true;
+            else if (arg == "--rate-limit" && i + 1 < argc) options.rateLimit = max(0LL, TransferShaper::parseRate(argv[++i]));
+            else if (arg == "--user-rate-limit" && i + 1 < argc) options.userRateLimit = max(0LL, TransferShaper::parseRate(argv[++i]));
+            else if (arg == "--connection-rate-limit" && i + 1 < argc) {
+                options.connectionRateLimit = max(0LL, TransferShaper::parseRate(argv[++i]));
+            }
+            else if (arg == "--max-connections" && i + 1 < argc) options.maxConnections = atoi(argv[++i]);
+            else if (arg == "--max-transfers" && i + 1 < argc) options.maxTransfers = atoi(argv[++i]);
+            else if (arg == "--backlog" && i + 1 < argc) options.acceptBacklog = atoi(argv[++i]);
+            else if (arg == "--header-timeout" && i + 1 < argc) options.headerTimeoutSeconds = atoi(argv[++i]);
+            else if (arg == "--body-timeout" && i + 1 < argc) options.bodyTimeoutSeconds = atoi(argv[++i]);
+            else if (arg == "--min-rate" && i + 1 < argc) options.minTransferRate = max(0LL, TransferShaper::parseRate(argv[++i]));
+        }
+
+        FTPServer server(options);
         
-        if (!server.start(8080)) {
+        if (!server.start(port)) {
             return 1;
         }
         
         server.run();
         return 0;
-    }
\ No newline at end of file
+    }
@@ -0,0 +1,83 @@
+// Heap allocation counter for the server, loaded with LD_PRELOAD (glibc only).
+// Every malloc, calloc, realloc and aligned allocation in the process is counted; on
+// SIGUSR2 the running total is written to stderr as "allocations <n>". operator new
+// goes through malloc, so C++ allocations are included.
+//
+//   g++ -O2 -shared -fPIC tests/alloc_count.cpp -o alloc_count.so
+//   LD_PRELOAD=./alloc_count.so ./server 2> counts.txt
+//   kill -USR2 <pid>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <unistd.h>
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+}
+
+namespace {
+    std::atomic<unsigned long long> allocations(0);
+
+    // Only async-signal-safe calls: formats the count by hand and writes it in one go.
+    void report(int) {
+        char text[48] = "allocations ";
+        size_t len = 12;
+        char digits[24];
+        size_t n = 0;
+        unsigned long long value = allocations.load();
+        do {
+            digits[n++] = (char)('0' + value % 10);
+            value /= 10;
+        } while (value > 0);
+        while (n > 0) text[len++] = digits[--n];
+        text[len++] = '\n';
+        ssize_t written = write(STDERR_FILENO, text, len);
+        (void)written;
+    }
+
+    __attribute__((constructor)) void install() {
+        struct sigaction action = {};
+        action.sa_handler = report;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR2, &action, nullptr);
+    }
+}
+
+extern "C" {
+    void* malloc(size_t size) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t count, size_t size) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_calloc(count, size);
+    }
+
+    void* realloc(void* ptr, size_t size) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_realloc(ptr, size);
+    }
+
+    int posix_memalign(void** out, size_t alignment, size_t size) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        void* p = __libc_memalign(alignment, size);
+        if (!p) return ENOMEM;
+        *out = p;
+        return 0;
+    }
+
+    void* aligned_alloc(size_t alignment, size_t size) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_memalign(alignment, size);
+    }
+
+    void* memalign(size_t alignment, size_t size) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_memalign(alignment, size);
+    }
+}
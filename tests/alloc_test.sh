@@ -0,0 +1,80 @@
+#!/bin/bash
+# Checks that steady-state request handling does not touch the heap: builds the server and
+# tests/alloc_count.cpp, warms a keep-alive connection up with cached pages and static
+# assets, then counts the allocations the server makes over ROUNDS further rounds of the
+# same requests and fails unless there were none.
+# Linux with glibc, g++ and python3; extra arguments go to the server (e.g. --io-uring).
+#
+#   tests/alloc_test.sh [server args]
+set -e
+cd "$(dirname "$0")/.."
+ROUNDS=${ROUNDS:-500}
+PORT=${PORT:-18080}
+work=$(mktemp -d)
+cleanup() {
+    status=$?
+    kill $pid 2>/dev/null || true
+    wait $pid 2>/dev/null || true
+    rm -rf "$work"
+    exit $status
+}
+trap cleanup EXIT
+
+g++ -std=c++17 -O2 -pthread server.cpp -o "$work/server"
+g++ -O2 -shared -fPIC tests/alloc_count.cpp -o "$work/alloc_count.so"
+cp -r www "$work/www"
+
+(cd "$work" && LD_PRELOAD="$work/alloc_count.so" exec ./server --port "$PORT" --workers 1 --max-requests 1000000 "$@" >/dev/null 2>counts.txt) &
+pid=$!
+
+python3 - "$PORT" "$pid" "$work/counts.txt" "$ROUNDS" <<'EOF'
+import os, signal, socket, sys, time
+port, pid, counts, rounds = int(sys.argv[1]), int(sys.argv[2]), sys.argv[3], int(sys.argv[4])
+paths = ["/login.html", "/", "/style.css", "/app.js"]
+
+def allocations():
+    os.kill(pid, signal.SIGUSR2)
+    time.sleep(0.2)
+    with open(counts) as f:
+        return int([l for l in f if l.startswith("allocations ")][-1].split()[1])
+
+def response(s, buf):
+    while b"\r\n\r\n" not in buf:
+        data = s.recv(65536)
+        if not data: sys.exit("connection closed")
+        buf += data
+    head, rest = buf.split(b"\r\n\r\n", 1)
+    length = 0
+    for line in head.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        if name.strip().lower() == b"content-length": length = int(value)
+    while len(rest) < length:
+        rest += s.recv(65536)
+    return head, rest[length:]
+
+for _ in range(50):
+    try:
+        s = socket.create_connection(("localhost", port))
+        break
+    except OSError:
+        time.sleep(0.1)
+s.sendall(b"POST /auth HTTP/1.1\r\nHost: x\r\nContent-Length: 35\r\n\r\nusername=admin&password=password123")
+head, buf = response(s, b"")
+cookie = [l for l in head.split(b"\r\n") if l.lower().startswith(b"set-cookie:")][0].split(b":", 1)[1].split(b";")[0].strip()
+requests = [b"GET " + p.encode() + b" HTTP/1.1\r\nHost: x\r\nCookie: " + cookie + b"\r\n\r\n" for p in paths]
+
+def run(count):
+    global buf
+    for _ in range(count):
+        for r in requests:
+            s.sendall(r)
+            head, buf = response(s, buf)
+            if not head.startswith(b"HTTP/1.1 200"): sys.exit("unexpected " + head.split(b"\r\n")[0].decode())
+
+run(50)
+before = allocations()
+run(rounds)
+made = allocations() - before
+print("%d allocations over %d keep-alive requests (%.2f per request)" % (made, rounds * len(paths), made / (rounds * len(paths))))
+sys.exit(1 if made > 0 else 0)
+EOF
@@ -1,3 +1,12 @@
+// Resumable uploads: files are sent as fixed-size chunks, several at a time. After a
+// network error the server is asked which ranges it is still missing.
+const UPLOAD_CHUNK_SIZE = 4 * 1024 * 1024;
+const UPLOAD_PARALLELISM = 4;
+const UPLOAD_MAX_RETRIES = 5;
+
+// File lists are fetched from /api/files a page at a time; further pages load on demand.
+const LIST_PAGE_SIZE = 200;
+
 class FTPClient {
   constructor() {
     this.baseUrl = window.location.origin;
@@ -6,7 +15,7 @@ class FTPClient {
 
   async checkAuthentication() {
     try {
-      const response = await fetch("/list");
+      const response = await fetch("/api/files?limit=1&fields=name");
       if (response.status === 401) {
         window.location.href = "/login";
         return;
@@ -112,9 +121,7 @@ class FTPClient {
 
   async refreshFiles() {
     try {
-      const response = await this.get("/list");
-      const text = await response.text();
-      this.updateFileList("fileList", text);
+      await this.loadListing("uploads", "fileList");
     } catch (error) {
       this.showError("fileList", "Error loading files: " + error.message);
     }
@@ -122,23 +129,37 @@ class FTPClient {
 
   async refreshTrash() {
     try {
-      const response = await this.get("/list_trash");
-      const text = await response.text();
-      this.updateFileList("trashList", text);
+      await this.loadListing("trash", "trashList");
     } catch (error) {
       this.showError("trashList", "Error loading trash: " + error.message);
     }
   }
 
-  updateFileList(elementId, fileText) {
-    const ul = document.getElementById(elementId);
-    ul.innerHTML = "";
+  // Shows the first page of a folder, or appends the page that follows cursor.
+  async loadListing(folder, elementId, cursor = null) {
+    let path = `/api/files?folder=${folder}&limit=${LIST_PAGE_SIZE}&fields=name`;
+    if (cursor) path += `&cursor=${cursor}`;
+    const response = await this.get(path);
+    const page = await response.json();
+
+    const loadMore = page.next
+      ? () => this.loadListing(folder, elementId, page.next)
+      : null;
+    this.updateFileList(
+      elementId,
+      page.files.map((file) => file.name),
+      cursor !== null,
+      loadMore,
+    );
+  }
 
-    const files = fileText
-      .split("\n")
-      .filter((line) => line.trim() && !line.startsWith("==="));
+  updateFileList(elementId, files, append = false, loadMore = null) {
+    const ul = document.getElementById(elementId);
+    if (!append) ul.innerHTML = "";
+    const more = ul.querySelector(".load-more");
+    if (more) more.remove();
 
-    if (files.length === 0) {
+    if (!append && files.length === 0 && !loadMore) {
       const li = document.createElement("li");
       li.textContent = "No files found";
       li.style.color = "#666";
@@ -147,22 +168,38 @@ class FTPClient {
       return;
     }
 
-    files.forEach((file) => {
-      if (file.trim()) {
-        const li = document.createElement("li");
-        li.textContent = file.trim();
+    const items = document.createDocumentFragment();
+    files.forEach((filename) => {
+      const li = document.createElement("li");
+      li.textContent = filename;
 
-        // Add click to fill filename
-        li.style.cursor = "pointer";
-        li.addEventListener("click", () => {
-          const filename = file.trim();
-          document.getElementById("actionFilename").value = filename;
-          document.getElementById("trashFilename").value = filename;
-        });
+      // Add click to fill filename
+      li.style.cursor = "pointer";
+      li.addEventListener("click", () => {
+        document.getElementById("actionFilename").value = filename;
+        document.getElementById("trashFilename").value = filename;
+      });
 
-        ul.appendChild(li);
-      }
+      items.appendChild(li);
     });
+
+    if (loadMore) {
+      const li = document.createElement("li");
+      li.className = "load-more";
+      li.textContent = "Load more...";
+      li.style.cursor = "pointer";
+      li.style.fontStyle = "italic";
+      li.addEventListener("click", async () => {
+        li.textContent = "Loading...";
+        try {
+          await loadMore();
+        } catch (error) {
+          li.textContent = "Load more... (" + error.message + ")";
+        }
+      });
+      items.appendChild(li);
+    }
+    ul.appendChild(items);
   }
 
   showError(elementId, message) {
@@ -194,8 +231,10 @@ class FTPClient {
     this.showStatus("uploadStatus", `Uploading ${file.name}...`);
 
     try {
-      const url = `/upload?filename=${encodeURIComponent(file.name)}`;
-      await this.post(url, file);
+      await this.uploadResumable(file, (received) => {
+        const percent = file.size ? Math.floor((received * 100) / file.size) : 100;
+        this.showStatus("uploadStatus", `Uploading ${file.name}... ${percent}%`);
+      });
       this.showStatus("uploadStatus", `✅ Successfully uploaded: ${file.name}`);
       input.value = ""; // Clear file input
       await this.refreshFiles();
@@ -208,6 +247,68 @@ class FTPClient {
     }
   }
 
+  // Same file, same id: a page reload or a second attempt picks up where the last one stopped.
+  uploadId(file) {
+    const key = `${file.name}|${file.size}|${file.lastModified}`;
+    let hash = 0x811c9dc5;
+    for (let i = 0; i < key.length; i++) {
+      hash ^= key.charCodeAt(i);
+      hash = Math.imul(hash, 0x01000193) >>> 0;
+    }
+    return `${hash.toString(16)}-${file.size.toString(16)}`;
+  }
+
+  async uploadStatus(id) {
+    const response = await this.get(`/upload/status?id=${id}`);
+    return await response.json();
+  }
+
+  async uploadResumable(file, onProgress) {
+    const id = this.uploadId(file);
+    const start = await this.post(
+      `/upload/start?id=${id}&filename=${encodeURIComponent(file.name)}&size=${file.size}`
+    );
+    let status = await start.json();
+    let retries = 0;
+
+    while (status.missing.length) {
+      // Split what is missing into chunks and let a few workers take them in turn.
+      const queue = [];
+      for (const range of status.missing) {
+        for (let offset = range.offset; offset < range.offset + range.length; offset += UPLOAD_CHUNK_SIZE) {
+          queue.push([offset, Math.min(UPLOAD_CHUNK_SIZE, range.offset + range.length - offset)]);
+        }
+      }
+      onProgress(status.received);
+
+      let failure = null;
+      const worker = async () => {
+        while (queue.length && !failure) {
+          const [offset, length] = queue.shift();
+          try {
+            const response = await this.post(
+              `/upload/chunk?id=${id}&offset=${offset}`,
+              file.slice(offset, offset + length)
+            );
+            const progress = await response.json();
+            onProgress(progress.received);
+          } catch (error) {
+            failure = error;
+          }
+        }
+      };
+      await Promise.all(Array.from({ length: UPLOAD_PARALLELISM }, worker));
+
+      if (failure) {
+        if (++retries > UPLOAD_MAX_RETRIES) throw failure;
+        await new Promise((resolve) => setTimeout(resolve, 500 * 2 ** retries));
+      }
+      status = await this.uploadStatus(id);
+    }
+
+    await this.post(`/upload/commit?id=${id}`);
+  }
+
   async downloadFile() {
     const filename = document.getElementById("actionFilename").value.trim();
     const status = document.getElementById("actionStatus");